@@ -0,0 +1,627 @@
+// Implements a bounded block cache for the disk image. Blocks are kept in a fixed pool of frames found through a
+// chained hash table; a frame in use is pinned, and frames are reused in CLOCK (second chance) order. Misses and
+// read-ahead are read with pread/preadv, and dirty blocks are written back with pwritev in runs of adjacent blocks.
+// Once started, a few I/O threads run read-ahead in the background and write the runs of a flush in parallel.
+
+// necessary libraries
+#define _GNU_SOURCE // preadv(), pwritev()
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "bcache.h"
+#include "log.h"
+
+#define BCACHE_MIN_FRAMES 16    // The pool never gets smaller than this, whatever the budget.
+#define BCACHE_MAX_IOV 64       // Blocks per preadv/pwritev call.
+#define BCACHE_POOL_ALIGN 4096  // Alignment of the pool, so frames can be used for direct I/O.
+#define BCACHE_IO_THREADS 4     // Threads running queued I/O.
+#define BCACHE_QUEUE_SIZE 256   // Jobs that can wait for an I/O thread.
+
+// States of a frame.
+#define FRAME_FREE 0    // Holds no block
+#define FRAME_LOADING 1 // Being read from the image; waiters sleep on frame_loaded
+#define FRAME_VALID 2   // Holds the block's current contents
+
+typedef struct {
+    int bnum;      // Block held by the frame
+    int pins;      // Number of bcache_get() calls not yet matched by bcache_put()
+    int next;      // Next frame in the same hash chain, -1 at the end
+    uint8_t state; // One of the FRAME_* values
+    uint8_t ref;   // Set on every use, cleared as the clock hand passes
+    uint8_t dirty; // Modified since it was read or last written back
+} frame_t;
+
+// cache_lock protects all of the state below except the contents of pinned frames.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_loaded = PTHREAD_COND_INITIALIZER;
+
+static int cache_fd = -1;
+static int frame_size = 0;
+static int frame_count = 0;
+static uint8_t *pool = NULL;  // frame_count frames of frame_size bytes
+static frame_t *frames = NULL;
+static int *buckets = NULL;   // Hash table: first frame of each chain, -1 if empty
+static int bucket_mask = 0;   // Number of buckets - 1, a power of two - 1
+static int clock_hand = 0;
+static int *flush_order = NULL; // Scratch space for bcache_flush(), frame_count entries
+
+// A group of jobs whose submitter waits for all of them.
+typedef struct {
+    int remaining; // Jobs not finished yet
+    int failed;    // Set if any job failed
+} io_batch_t;
+
+// Work for an I/O thread: read ahead a run of blocks, or write back a run of
+// pinned frames (when batch is set).
+typedef struct {
+    int bnum;
+    int count;
+    const int *frames; // For write-back: the frames holding blocks bnum..bnum + count - 1
+    io_batch_t *batch;
+} io_job_t;
+
+// io_lock protects the job queue and the batches; it is never held together with cache_lock.
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_work = PTHREAD_COND_INITIALIZER;  // Signaled when a job is queued
+static pthread_cond_t io_space = PTHREAD_COND_INITIALIZER; // Signaled when a job is taken
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;  // Signaled when a batch job finishes
+static io_job_t io_queue[BCACHE_QUEUE_SIZE];
+static int io_head = 0;  // Next job to run
+static int io_count = 0; // Jobs queued
+static int io_stop = 0;  // Set to shut the threads down
+static pthread_t io_threads[BCACHE_IO_THREADS];
+static int io_thread_count = 0;
+
+// @return The pool memory of frame i.
+static uint8_t *frame_data(int i) {
+    return pool + (size_t)i * frame_size;
+}
+
+// @return The hash bucket of a block.
+static int bucket_of(int bnum) {
+    return ((uint32_t)bnum * 2654435761u) & bucket_mask;
+}
+
+// @return The frame holding the given block, or -1 if it is not cached.
+static int frame_lookup(int bnum) {
+    for (int i = buckets[bucket_of(bnum)]; i >= 0; i = frames[i].next) {
+        if (frames[i].bnum == bnum) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Add frame i to the hash chain of its block.
+static void frame_hash(int i) {
+    int b = bucket_of(frames[i].bnum);
+    frames[i].next = buckets[b];
+    buckets[b] = i;
+}
+
+// Remove frame i from the hash chain of its block.
+static void frame_unhash(int i) {
+    int *link = &buckets[bucket_of(frames[i].bnum)];
+    while (*link != i) {
+        assert(*link >= 0);
+        link = &frames[*link].next;
+    }
+    *link = frames[i].next;
+    frames[i].next = -1;
+}
+
+// Write frame i back to its block. The caller holds cache_lock.
+static int frame_write(int i) {
+    ssize_t done = pwrite(cache_fd, frame_data(i), frame_size, (off_t)frames[i].bnum * frame_size);
+    if (done != frame_size) {
+        perror("bcache: pwrite");
+        return -1;
+    }
+    frames[i].dirty = 0;
+    return 0;
+}
+
+/**
+ * Find a frame to reuse, advancing the clock hand: frames used since the hand
+ * last passed get a second chance, pinned and loading frames are skipped.
+ * A dirty victim is written back first. The caller holds cache_lock.
+ *
+ * @return A free frame, or -1 if every frame is pinned.
+ */
+static int frame_evict() {
+    for (int scan = 0; scan < 2 * frame_count; scan++) {
+        int i = clock_hand;
+        clock_hand = (clock_hand + 1) % frame_count;
+
+        frame_t *f = &frames[i];
+        if (f->pins > 0 || f->state == FRAME_LOADING) {
+            continue;
+        }
+        if (f->state == FRAME_FREE) {
+            return i;
+        }
+        if (f->ref) {
+            f->ref = 0;
+            continue;
+        }
+        if (f->dirty && frame_write(i) < 0) {
+            continue;
+        }
+        frame_unhash(i);
+        f->state = FRAME_FREE;
+        return i;
+    }
+    return -1;
+}
+
+// Claim free frame i for a block that is about to be read. The caller holds cache_lock.
+static void frame_claim(int i, int bnum) {
+    frame_t *f = &frames[i];
+    f->bnum = bnum;
+    f->pins = 1;
+    f->ref = 1;
+    f->dirty = 0;
+    f->state = FRAME_LOADING;
+    frame_hash(i);
+}
+
+// Finish loading frame i; on failure the frame is dropped. The caller holds cache_lock.
+static void frame_loaded_done(int i, int ok) {
+    frame_t *f = &frames[i];
+    f->pins--;
+    if (ok) {
+        f->state = FRAME_VALID;
+    } else {
+        frame_unhash(i);
+        f->state = FRAME_FREE;
+    }
+    pthread_cond_broadcast(&frame_loaded);
+}
+
+// Write back a run of pinned frames for a flush, see bcache_flush().
+static int write_run(const io_job_t *job) {
+    struct iovec iov[BCACHE_MAX_IOV];
+    assert(job->count <= BCACHE_MAX_IOV);
+    for (int j = 0; j < job->count; j++) {
+        iov[j].iov_base = frame_data(job->frames[j]);
+        iov[j].iov_len = frame_size;
+    }
+    ssize_t done = pwritev(cache_fd, iov, job->count, (off_t)job->bnum * frame_size);
+    if (done != (ssize_t)job->count * frame_size) {
+        perror("bcache_flush: pwritev");
+        return -1;
+    }
+    return 0;
+}
+
+// Body of the I/O threads: run queued jobs until bcache_free().
+static void *io_thread(void *arg) {
+    pthread_mutex_lock(&io_lock);
+    for (;;) {
+        while (io_count == 0 && !io_stop) {
+            pthread_cond_wait(&io_work, &io_lock);
+        }
+        if (io_count == 0) {
+            break;
+        }
+        io_job_t job = io_queue[io_head];
+        io_head = (io_head + 1) % BCACHE_QUEUE_SIZE;
+        io_count--;
+        pthread_cond_signal(&io_space);
+        pthread_mutex_unlock(&io_lock);
+
+        int rv = 0;
+        if (job.batch) {
+            rv = write_run(&job);
+        } else {
+            bcache_prefetch(job.bnum, job.count);
+        }
+
+        pthread_mutex_lock(&io_lock);
+        if (job.batch) {
+            if (rv < 0) {
+                job.batch->failed = 1;
+            }
+            job.batch->remaining--;
+            pthread_cond_broadcast(&io_done);
+        }
+    }
+    pthread_mutex_unlock(&io_lock);
+    return NULL;
+}
+
+/**
+ * Queue a job for the I/O threads.
+ *
+ * @param job The job; copied into the queue.
+ * @param wait 1 to wait for room if the queue is full, 0 to drop the job instead.
+ *
+ * @return 0 if the job was queued, -1 if it was dropped.
+ */
+static int io_submit(const io_job_t *job, int wait) {
+    pthread_mutex_lock(&io_lock);
+    while (io_count == BCACHE_QUEUE_SIZE) {
+        if (!wait) {
+            pthread_mutex_unlock(&io_lock);
+            return -1;
+        }
+        pthread_cond_wait(&io_space, &io_lock);
+    }
+    io_queue[(io_head + io_count) % BCACHE_QUEUE_SIZE] = *job;
+    io_count++;
+    if (job->batch) {
+        job->batch->remaining++;
+    }
+    pthread_cond_signal(&io_work);
+    pthread_mutex_unlock(&io_lock);
+    return 0;
+}
+
+/**
+ * Set up the cache.
+ *
+ * @param fd File descriptor of the disk image.
+ * @param block_size Bytes per block.
+ * @param bytes Memory budget for the frames; at least a few frames are always allocated.
+ */
+void bcache_init(int fd, int block_size, size_t bytes) {
+    bcache_free();
+    cache_fd = fd;
+    frame_size = block_size;
+    frame_count = bytes / block_size;
+    if (frame_count < BCACHE_MIN_FRAMES) {
+        frame_count = BCACHE_MIN_FRAMES;
+    }
+
+    int bucket_count = 1;
+    while (bucket_count < frame_count) {
+        bucket_count *= 2;
+    }
+    bucket_mask = bucket_count - 1;
+
+    int rv = posix_memalign((void **)&pool, BCACHE_POOL_ALIGN, (size_t)frame_count * frame_size);
+    assert(rv == 0);
+    frames = calloc(frame_count, sizeof(frame_t));
+    buckets = malloc(bucket_count * sizeof(int));
+    flush_order = malloc(frame_count * sizeof(int));
+    assert(frames && buckets && flush_order);
+    memset(buckets, -1, bucket_count * sizeof(int));
+    for (int i = 0; i < frame_count; i++) {
+        frames[i].next = -1;
+    }
+    clock_hand = 0;
+
+    LOG_INFO("bcache: %d frames of %d bytes\n", frame_count, frame_size);
+}
+
+/**
+ * Start the I/O threads. Until then, flushes write their runs themselves and
+ * prefetches are skipped.
+ */
+void bcache_start_io() {
+    if (io_thread_count > 0) {
+        return;
+    }
+    io_stop = 0;
+    for (io_thread_count = 0; io_thread_count < BCACHE_IO_THREADS; io_thread_count++) {
+        if (pthread_create(&io_threads[io_thread_count], NULL, io_thread, NULL) != 0) {
+            perror("bcache_start_io: pthread_create");
+            break;
+        }
+    }
+    LOG_INFO("bcache: %d I/O threads\n", io_thread_count);
+}
+
+/**
+ * Release the cache. Dirty blocks are dropped, so flush first.
+ */
+void bcache_free() {
+    // Let the I/O threads finish the queued jobs, then stop them
+    pthread_mutex_lock(&io_lock);
+    io_stop = 1;
+    pthread_cond_broadcast(&io_work);
+    pthread_mutex_unlock(&io_lock);
+    for (int i = 0; i < io_thread_count; i++) {
+        pthread_join(io_threads[i], NULL);
+    }
+    io_thread_count = 0;
+
+    free(pool);
+    free(frames);
+    free(buckets);
+    free(flush_order);
+    pool = NULL;
+    frames = NULL;
+    buckets = NULL;
+    flush_order = NULL;
+    frame_count = 0;
+    cache_fd = -1;
+}
+
+/**
+ * Get a block, reading it from the image if it is not cached, and pin it.
+ *
+ * @param bnum Block number (index).
+ * @param fill 0 if the caller overwrites the whole block, so a miss need not read it.
+ *
+ * @return Pointer to the block's frame, or NULL if it could not be read or every frame is pinned.
+ */
+void *bcache_get(int bnum, int fill) {
+    pthread_mutex_lock(&cache_lock);
+    int i = frame_lookup(bnum);
+    if (i >= 0) {
+        frame_t *f = &frames[i];
+        f->pins++;
+        f->ref = 1;
+        while (f->state == FRAME_LOADING) {
+            pthread_cond_wait(&frame_loaded, &cache_lock);
+        }
+        if (f->state != FRAME_VALID || f->bnum != bnum) {
+            // The read failed
+            f->pins--;
+            pthread_mutex_unlock(&cache_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return frame_data(i);
+    }
+
+    i = frame_evict();
+    if (i < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        LOG_ERROR("bcache_get: all %d frames are pinned, block %d not loaded\n", frame_count, bnum);
+        return NULL;
+    }
+    frame_claim(i, bnum);
+    pthread_mutex_unlock(&cache_lock);
+
+    // Read without the lock, so hits on other blocks are not held up
+    ssize_t got = frame_size;
+    if (fill) {
+        got = pread(cache_fd, frame_data(i), frame_size, (off_t)bnum * frame_size);
+        if (got != frame_size) {
+            perror("bcache_get: pread");
+        }
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int ok = got == frame_size;
+    if (ok) {
+        frames[i].pins++; // Keep the caller's pin across frame_loaded_done()
+    }
+    frame_loaded_done(i, ok);
+    pthread_mutex_unlock(&cache_lock);
+    return ok ? frame_data(i) : NULL;
+}
+
+/**
+ * Unpin a block returned by bcache_get().
+ *
+ * @param block Pointer returned by bcache_get().
+ */
+void bcache_put(void *block) {
+    int i = ((uint8_t *)block - pool) / frame_size;
+    pthread_mutex_lock(&cache_lock);
+    assert(frames[i].pins > 0);
+    frames[i].pins--;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Check whether a pointer points into a frame.
+ *
+ * @param ptr Any pointer.
+ *
+ * @return 1 if ptr is inside the frame pool, 0 otherwise.
+ */
+int bcache_owns(const void *ptr) {
+    const uint8_t *p = ptr;
+    return pool && p >= pool && p < pool + (size_t)frame_count * frame_size;
+}
+
+/**
+ * Get the image offset a pointer into a frame stands for.
+ *
+ * @param ptr Pointer into a pinned frame.
+ *
+ * @return Byte offset in the disk image.
+ */
+size_t bcache_offset(const void *ptr) {
+    size_t delta = (const uint8_t *)ptr - pool;
+    int i = delta / frame_size;
+    // A pinned frame keeps its block, so no lock is needed
+    return (size_t)frames[i].bnum * frame_size + delta % frame_size;
+}
+
+/**
+ * Mark a cached block as modified. The block must be pinned.
+ *
+ * @param bnum Block number (index).
+ */
+void bcache_dirty(int bnum) {
+    pthread_mutex_lock(&cache_lock);
+    int i = frame_lookup(bnum);
+    if (i >= 0) {
+        frames[i].dirty = 1;
+    } else {
+        LOG_ERROR("bcache_dirty: block %d is not cached\n", bnum);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Order frame indices by block number.
+static int compare_frames(const void *a, const void *b) {
+    int x = frames[*(const int *)a].bnum;
+    int y = frames[*(const int *)b].bnum;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write all dirty blocks back to the image (without syncing the file).
+ * Adjacent dirty blocks are written with a single pwritev call; the I/O
+ * threads write separate runs in parallel. Blocks must not be modified while
+ * the flush runs.
+ *
+ * @return 0 on success, -1 if any write failed.
+ */
+int bcache_flush() {
+    pthread_mutex_lock(&cache_lock);
+    int n = 0;
+    for (int i = 0; i < frame_count; i++) {
+        if (frames[i].state == FRAME_VALID && frames[i].dirty) {
+            frames[i].pins++;
+            frames[i].dirty = 0;
+            flush_order[n++] = i;
+        }
+    }
+    // Pinned, so they stay put while cache_lock is released for the writes
+    pthread_mutex_unlock(&cache_lock);
+    qsort(flush_order, n, sizeof(int), compare_frames);
+
+    io_batch_t batch = { 0, 0 };
+    int k = 0;
+    while (k < n) {
+        io_job_t job = { frames[flush_order[k]].bnum, 0, &flush_order[k], &batch };
+        while (k + job.count < n && job.count < BCACHE_MAX_IOV &&
+               frames[flush_order[k + job.count]].bnum == job.bnum + job.count) {
+            job.count++;
+        }
+        if (io_thread_count == 0) {
+            batch.failed |= write_run(&job) < 0;
+        } else {
+            io_submit(&job, 1);
+        }
+        k += job.count;
+    }
+
+    pthread_mutex_lock(&io_lock);
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&io_done, &io_lock);
+    }
+    pthread_mutex_unlock(&io_lock);
+
+    pthread_mutex_lock(&cache_lock);
+    for (k = 0; k < n; k++) {
+        frames[flush_order[k]].pins--;
+        if (batch.failed) {
+            // Keep everything dirty, so the next flush tries again
+            frames[flush_order[k]].dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return batch.failed ? -1 : 0;
+}
+
+/**
+ * Read a run of blocks into the cache ahead of use, with one preadv call per
+ * run of blocks that are not cached yet. The blocks are not pinned.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void bcache_prefetch(int bnum, int count) {
+    pthread_mutex_lock(&cache_lock);
+    int done = 0;
+    while (done < count) {
+        if (frame_lookup(bnum + done) >= 0) {
+            done++;
+            continue;
+        }
+
+        // Claim frames for the blocks up to the next cached one
+        int claimed[BCACHE_MAX_IOV];
+        struct iovec iov[BCACHE_MAX_IOV];
+        int n = 0;
+        while (done + n < count && n < BCACHE_MAX_IOV && frame_lookup(bnum + done + n) < 0) {
+            int i = frame_evict();
+            if (i < 0) {
+                break;
+            }
+            frame_claim(i, bnum + done + n);
+            claimed[n] = i;
+            iov[n].iov_base = frame_data(i);
+            iov[n].iov_len = frame_size;
+            n++;
+        }
+        if (n == 0) {
+            break; // Every frame is pinned
+        }
+
+        pthread_mutex_unlock(&cache_lock);
+        ssize_t got = preadv(cache_fd, iov, n, (off_t)(bnum + done) * frame_size);
+        if (got < 0) {
+            perror("bcache_prefetch: preadv");
+        }
+        pthread_mutex_lock(&cache_lock);
+
+        for (int j = 0; j < n; j++) {
+            frame_loaded_done(claimed[j], got >= (ssize_t)(j + 1) * frame_size);
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Queue a run of blocks to be read into the cache by the I/O threads, see
+ * bcache_prefetch(). The request is dropped if the queue is full.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void bcache_prefetch_async(int bnum, int count) {
+    io_job_t job = { bnum, count, NULL, NULL };
+    if (io_thread_count > 0) {
+        io_submit(&job, 0);
+    }
+}
+
+// Drop frame i, which holds a freed block. The caller holds cache_lock.
+static void frame_discard(int i) {
+    frame_t *f = &frames[i];
+    if (f->state != FRAME_VALID) {
+        return;
+    }
+    f->dirty = 0;
+    if (f->pins > 0) {
+        memset(frame_data(i), 0, frame_size);
+    } else {
+        frame_unhash(i);
+        f->state = FRAME_FREE;
+    }
+}
+
+/**
+ * Drop a run of blocks that were freed. Frames still pinned are cleared
+ * instead, so they read as zeros like the punched out range of the image.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void bcache_discard(int bnum, int count) {
+    pthread_mutex_lock(&cache_lock);
+    if (count > frame_count) {
+        // Cheaper to look at every frame than at every block
+        for (int i = 0; i < frame_count; i++) {
+            if (frames[i].state != FRAME_FREE && frames[i].bnum >= bnum && frames[i].bnum < bnum + count) {
+                frame_discard(i);
+            }
+        }
+    } else {
+        for (int b = bnum; b < bnum + count; b++) {
+            int i = frame_lookup(b);
+            if (i >= 0) {
+                frame_discard(i);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,113 @@
+// A bounded cache of disk image blocks, used by blocks.c when the image is not mmapped.
+//
+// Blocks live in frames of a fixed pool. A block returned by bcache_get() is
+// pinned and stays in its frame until bcache_put(); unpinned frames are
+// reused in CLOCK order, writing them back first if they are dirty.
+// The frames are aligned for direct I/O, so the image may be opened with O_DIRECT.
+// All functions are thread safe.
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stddef.h>
+
+/**
+ * Set up the cache.
+ *
+ * @param fd File descriptor of the disk image, possibly opened with O_DIRECT.
+ * @param block_size Bytes per block.
+ * @param bytes Memory budget for the frames; at least a few frames are always allocated.
+ */
+void bcache_init(int fd, int block_size, size_t bytes);
+
+/**
+ * Start the I/O threads. Until then, flushes write their runs themselves and
+ * prefetches are skipped. Call in the process that serves the mount: threads
+ * started before FUSE forks into the background do not exist in the child.
+ */
+void bcache_start_io();
+
+/**
+ * Release the cache and stop its I/O threads. Dirty blocks are dropped, so flush first.
+ */
+void bcache_free();
+
+/**
+ * Get a block, reading it from the image if it is not cached, and pin it.
+ *
+ * @param bnum Block number (index).
+ * @param fill 0 if the caller overwrites the whole block, so a miss need not read it.
+ *
+ * @return Pointer to the block's frame, or NULL if it could not be read or every frame is pinned.
+ */
+void *bcache_get(int bnum, int fill);
+
+/**
+ * Unpin a block returned by bcache_get().
+ *
+ * @param block Pointer returned by bcache_get().
+ */
+void bcache_put(void *block);
+
+/**
+ * Check whether a pointer points into a frame.
+ *
+ * @param ptr Any pointer.
+ *
+ * @return 1 if ptr is inside the frame pool, 0 otherwise.
+ */
+int bcache_owns(const void *ptr);
+
+/**
+ * Get the image offset a pointer into a frame stands for.
+ *
+ * @param ptr Pointer into a pinned frame.
+ *
+ * @return Byte offset in the disk image.
+ */
+size_t bcache_offset(const void *ptr);
+
+/**
+ * Mark a cached block as modified. The block must be pinned.
+ *
+ * @param bnum Block number (index).
+ */
+void bcache_dirty(int bnum);
+
+/**
+ * Write all dirty blocks back to the image (without syncing the file).
+ * Adjacent dirty blocks are written with a single pwritev call; the I/O
+ * threads write separate runs in parallel. Blocks must not be modified while
+ * the flush runs.
+ *
+ * @return 0 on success, -1 if any write failed.
+ */
+int bcache_flush();
+
+/**
+ * Read a run of blocks into the cache ahead of use, with one preadv call per
+ * run of blocks that are not cached yet. The blocks are not pinned.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void bcache_prefetch(int bnum, int count);
+
+/**
+ * Queue a run of blocks to be read into the cache by the I/O threads, see
+ * bcache_prefetch(). The request is dropped if the queue is full.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void bcache_prefetch_async(int bnum, int count);
+
+/**
+ * Drop a run of blocks that were freed. Frames still pinned are cleared
+ * instead, so they read as zeros like the punched out range of the image.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void bcache_discard(int bnum, int count);
+
+#endif
@@ -0,0 +1,39 @@
+#!/usr/bin/perl
+# Compare two results files of `make bench` and flag the benchmarks that got
+# slower by more than a threshold (default 10%).
+#
+# usage: perl bench/compare.pl OLD.jsonl NEW.jsonl [PERCENT]
+use 5.16.0;
+use warnings FATAL => 'all';
+
+my ($old_file, $new_file, $threshold) = @ARGV;
+die "usage: $0 OLD.jsonl NEW.jsonl [PERCENT]\n" unless $new_file;
+$threshold //= 10;
+
+# Map "bench/inodes" to its cost: ns per operation (micro) or seconds (macro).
+sub load {
+    my ($file) = @_;
+    my %cost;
+    open my $fh, "<", $file or die "compare: $file: $!";
+    while (<$fh>) {
+        my ($name) = /"bench": "([^"]+)"/ or next;
+        my ($inodes) = /"inodes": (\d+)/;
+        my ($cost) = /"ns_per_op": ([\d.]+)/;
+        ($cost) = /"seconds": ([\d.]+)/ unless defined $cost;
+        $cost{defined $inodes ? "$name/$inodes" : $name} = $cost;
+    }
+    close $fh;
+    return \%cost;
+}
+
+my $old = load($old_file);
+my $new = load($new_file);
+my $regressions = 0;
+for my $name (sort keys %$new) {
+    next unless defined $old->{$name} && $old->{$name} > 0;
+    my $change = ($new->{$name} - $old->{$name}) / $old->{$name} * 100;
+    my $flag = $change > $threshold ? "  REGRESSION" : "";
+    $regressions++ if $flag;
+    printf("%-36s %12.2f %12.2f %+7.1f%%%s\n", $name, $old->{$name}, $new->{$name}, $change, $flag);
+}
+exit($regressions ? 1 : 0);
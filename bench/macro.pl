@@ -0,0 +1,150 @@
+#!/usr/bin/perl
+# Macro benchmarks: workloads run through a mounted nufs. Prints one JSON object
+# per workload on stdout, followed by the file system's own per-operation
+# statistics from /.nufs/stats. Run by `make bench`, from the repository root.
+#
+# usage: perl bench/macro.pl [MOUNT_OPTIONS]
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Fcntl qw(O_RDONLY O_WRONLY O_RDWR O_CREAT SEEK_SET);
+use Time::HiRes qw(time sleep);
+use IO::Handle;
+
+my $options = shift // "";
+my $mnt = "bench/mnt";
+my $image = "bench/bench.nufs";
+my $file_mb = 64;   # Size of the file of the read and write workloads
+my $files = 2000;   # Files of the create/stat/unlink and readdir workloads
+
+STDOUT->autoflush(1);
+srand(42);
+
+sub mount {
+    my $opts = "blocks=131072" . ($options ? ",$options" : "");
+    system("./nufs -f -o $opts $mnt $image >> bench/bench.log 2>&1 &");
+    for (1 .. 50) {
+        return if -d "$mnt/.nufs";
+        sleep 0.1;
+    }
+    die "bench: $image did not mount on $mnt";
+}
+
+sub unmount {
+    system("fusermount -u $mnt");
+    sleep 0.5;
+}
+
+# Print a result; rate is per second.
+sub result {
+    my ($bench, $ops, $bytes, $seconds) = @_;
+    printf("{\"bench\": \"%s\", \"ops\": %d, \"bytes\": %d, \"seconds\": %.4f, \"ops_per_s\": %.1f, \"mb_per_s\": %.2f}\n",
+           $bench, $ops, $bytes, $seconds, $ops / $seconds, $bytes / $seconds / 1048576);
+}
+
+# Write the test file sequentially in chunks of $size bytes.
+sub seq_write {
+    my ($name, $size) = @_;
+    my $data = "x" x $size;
+    my $count = $file_mb * 1048576 / $size;
+    my $start = time;
+    sysopen(my $fh, "$mnt/big", O_WRONLY | O_CREAT) or die "bench: open: $!";
+    syswrite($fh, $data) == $size or die "bench: write: $!" for 1 .. $count;
+    close $fh;
+    result($name, $count, $count * $size, time - $start);
+}
+
+# Read the test file sequentially in chunks of $size bytes.
+sub seq_read {
+    my ($name, $size) = @_;
+    my ($data, $count) = ("", 0);
+    my $start = time;
+    sysopen(my $fh, "$mnt/big", O_RDONLY) or die "bench: open: $!";
+    $count++ while sysread($fh, $data, $size) > 0;
+    close $fh;
+    result($name, $count, $count * $size, time - $start);
+}
+
+# Read or write $count random 4K blocks of the test file.
+sub random_io {
+    my ($name, $write, $count) = @_;
+    my $blocks = $file_mb * 256;
+    my $data = "y" x 4096;
+    my $start = time;
+    sysopen(my $fh, "$mnt/big", $write ? O_RDWR : O_RDONLY) or die "bench: open: $!";
+    for (1 .. $count) {
+        sysseek($fh, int(rand($blocks)) * 4096, SEEK_SET);
+        if ($write) {
+            syswrite($fh, $data) == 4096 or die "bench: write: $!";
+        } else {
+            sysread($fh, $data, 4096) == 4096 or die "bench: read: $!";
+        }
+    }
+    close $fh;
+    result($name, $count, $count * 4096, time - $start);
+}
+
+system("rm -f $image bench/bench.log");
+mkdir $mnt;
+mount();
+
+# Metadata storms in one directory
+mkdir "$mnt/storm" or die "bench: mkdir: $!";
+my $start = time;
+for my $i (1 .. $files) {
+    open my $fh, ">", "$mnt/storm/f$i" or die "bench: create: $!";
+    close $fh;
+}
+result("create", $files, 0, time - $start);
+
+$start = time;
+for my $i (1 .. $files) {
+    stat("$mnt/storm/f$i") or die "bench: stat: $!";
+}
+result("stat", $files, 0, time - $start);
+
+$start = time;
+stat("$mnt/storm/missing$_") for 1 .. $files;
+result("stat_missing", $files, 0, time - $start);
+
+$start = time;
+my $listings = 20;
+for (1 .. $listings) {
+    opendir my $dh, "$mnt/storm" or die "bench: opendir: $!";
+    my @names = readdir $dh;
+    closedir $dh;
+    @names == $files + 2 or die "bench: readdir returned " . scalar(@names) . " names";
+}
+result("readdir_wide", $listings, 0, time - $start);
+
+$start = time;
+unlink("$mnt/storm/f$_") or die "bench: unlink: $!" for 1 .. $files;
+result("unlink", $files, 0, time - $start);
+
+# Data, with a remount before each read so it comes from the image, not the kernel's cache
+seq_write("seq_write_4k", 4096);
+unmount();
+mount();
+seq_read("seq_read_4k", 4096);
+unlink("$mnt/big");
+seq_write("seq_write_1m", 1048576);
+unmount();
+mount();
+seq_read("seq_read_1m", 1048576);
+random_io("random_write_4k", 1, 4096);
+unmount();
+mount();
+random_io("random_read_4k", 0, 4096);
+
+# The file system's own view of the same run
+open my $sh, "<", "$mnt/.nufs/stats" or die "bench: stats: $!";
+while (<$sh>) {
+    next if /^#/;
+    my ($op, $calls, $errors, $bytes, $mean, $p50, $p90, $p99, $p999, $max) = split;
+    print "{\"stat\": \"$op\", \"calls\": $calls, \"errors\": $errors, \"bytes\": $bytes, \"mean_us\": $mean, "
+        . "\"p50_us\": $p50, \"p90_us\": $p90, \"p99_us\": $p99, \"p999_us\": $p999, \"max_us\": $max}\n";
+}
+close $sh;
+
+unmount();
+system("rm -f $image");
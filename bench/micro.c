@@ -0,0 +1,212 @@
+// Microbenchmarks of the hot paths below the FUSE layer: bitmap access, block allocation, inode and name lookup,
+// save_inodes() and mounting. Runs against a fresh image with the given number of inodes and prints one JSON object per
+// benchmark on stdout, with the median time per operation over several runs. Run by `make bench`.
+//
+// usage: micro INODES [IMAGE]
+
+// necessary libraries
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "blocks.h"
+#include "directory.h"
+#include "inode.h"
+#include "journal.h"
+#include "log.h"
+
+#define RUNS 5 // Runs of each benchmark; the median is reported.
+
+static int inode_count;
+static volatile int64_t sink; // Keeps results alive, so the compiler cannot drop the work
+
+// A fixed-seed xorshift generator, so every run touches the same indexes.
+static uint64_t rng_state;
+
+static uint32_t rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Run a benchmark RUNS times and print its median time per operation.
+ *
+ * @param name Name of the benchmark.
+ * @param fn Runs the benchmark once; returns the number of operations it did.
+ */
+static void bench(const char *name, long (*fn)()) {
+    uint64_t times[RUNS];
+    long ops = 0;
+    for (int run = 0; run < RUNS; run++) {
+        rng_state = 0x9e3779b97f4a7c15ull;
+        uint64_t start = now_ns();
+        ops = fn();
+        times[run] = now_ns() - start;
+    }
+    qsort(times, RUNS, sizeof(uint64_t), compare_u64);
+    printf("{\"bench\": \"%s\", \"inodes\": %d, \"ops\": %ld, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f}\n",
+           name, inode_count, ops, (double)times[RUNS / 2] / ops, (double)times[0] / ops);
+    fflush(stdout);
+}
+
+static long bench_bitmap_get() {
+    void *bm = get_blocks_bitmap();
+    int64_t sum = 0;
+    for (long i = 0; i < 1000000; i++) {
+        sum += bitmap_get(bm, rng_next() % BLOCK_COUNT);
+    }
+    sink = sum;
+    return 1000000;
+}
+
+static long bench_bitmap_put() {
+    // A scratch bitmap, so the image's bitmaps stay as they are
+    uint8_t scratch[4096];
+    memset(scratch, 0, sizeof(scratch));
+    for (long i = 0; i < 1000000; i++) {
+        int bit = rng_next() % (sizeof(scratch) * 8);
+        bitmap_put(scratch, bit, !bitmap_get(scratch, bit));
+    }
+    sink = scratch[0];
+    return 1000000;
+}
+
+// One operation is an allocation and the matching free.
+static long bench_alloc_block() {
+    int count = BLOCK_COUNT / 4;
+    int *blocks = malloc(count * sizeof(int));
+    int done = 0;
+    while (done < count && (blocks[done] = alloc_block()) >= 0) {
+        done++;
+    }
+    for (int i = 0; i < done; i++) {
+        free_block(blocks[i]);
+    }
+    free(blocks);
+    return done;
+}
+
+static long bench_get_inode() {
+    int64_t sum = 0;
+    for (long i = 0; i < 1000000; i++) {
+        sum += get_inode(rng_next() % inode_count)->size;
+    }
+    sink = sum;
+    return 1000000;
+}
+
+static long bench_directory_lookup() {
+    inode_t *root = get_inode(ROOT_INUM);
+    char name[DIR_NAME_LENGTH];
+    int64_t sum = 0;
+    for (long i = 0; i < 1000000; i++) {
+        snprintf(name, sizeof(name), "f%u", rng_next() % (inode_count / 2));
+        sum += directory_lookup(root, name);
+    }
+    sink = sum;
+    return 1000000;
+}
+
+static long bench_directory_lookup_missing() {
+    inode_t *root = get_inode(ROOT_INUM);
+    char name[DIR_NAME_LENGTH];
+    int64_t sum = 0;
+    for (long i = 0; i < 1000000; i++) {
+        snprintf(name, sizeof(name), "missing%u", rng_next() % inode_count);
+        sum += directory_lookup(root, name);
+    }
+    sink = sum;
+    return 1000000;
+}
+
+// A mount of the image as storage_init() does it, up to the first inode access.
+static long bench_mount() {
+    load_inodes();
+    directory_init();
+    sink = get_inode(ROOT_INUM)->size;
+    return 1;
+}
+
+static long bench_save_inodes_few() {
+    for (int i = 0; i < 100; i++) {
+        get_inode(ROOT_INUM)->mtime++;
+        inode_dirty(get_inode(ROOT_INUM));
+        save_inodes();
+    }
+    return 100;
+}
+
+static long bench_save_inodes_all() {
+    for (int i = 0; i < 5; i++) {
+        for (int inum = 0; inum < inode_count; inum++) {
+            if (inode_in_use(inum)) {
+                inode_dirty(get_inode(inum));
+            }
+        }
+        save_inodes();
+    }
+    return 5;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s INODES [IMAGE]\n", argv[0]);
+        return 1;
+    }
+    inode_count = atoi(argv[1]);
+    const char *image = argc > 2 ? argv[2] : "bench.img";
+    log_init(LOG_LEVEL_WARN, 0);
+
+    // A fresh image with half of the inodes in use, as files in the root directory
+    unlink(image);
+    blocks_geometry_t geometry = {
+        .block_count = 2 * inode_count + 8192, .inode_count = inode_count, .inode_size = sizeof(inode_t)
+    };
+    blocks_init(image, &geometry);
+    journal_init(JOURNAL_FIRST_BLOCK, JOURNAL_BLOCKS);
+    load_inodes();
+    alloc_inode(S_IFDIR | 0755);
+    directory_init();
+    inode_t *root = get_inode(ROOT_INUM);
+    char name[DIR_NAME_LENGTH];
+    for (int i = 0; i < inode_count / 2; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        int inum = alloc_inode(S_IFREG | 0644);
+        if (inum < 0 || directory_put(root, name, inum) < 0) {
+            fprintf(stderr, "micro: cannot create file %d\n", i);
+            return 1;
+        }
+    }
+    save_inodes();
+
+    bench("bitmap_get", bench_bitmap_get);
+    bench("bitmap_put", bench_bitmap_put);
+    bench("alloc_block", bench_alloc_block);
+    bench("get_inode", bench_get_inode);
+    bench("directory_lookup", bench_directory_lookup);
+    bench("directory_lookup_missing", bench_directory_lookup_missing);
+    bench("save_inodes_one_dirty", bench_save_inodes_few);
+    bench("save_inodes_all_dirty", bench_save_inodes_all);
+    bench("mount", bench_mount);
+
+    blocks_free();
+    unlink(image);
+    return 0;
+}
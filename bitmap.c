@@ -4,11 +4,14 @@
 // Uses byte-level operations to manipulate individual bits
 // Supports efficient bit tracking with minimal memory overhead
 // Provides a simple interface for bit manipulation
+// Searches and counts a whole 64-bit word at a time. Bit i lives in byte i / 8, so on a little-endian machine
+//    it is also bit i % 64 of word i / 64.
 
 // neccesaru libraries
 #include <stdint.h>
 #include <stdio.h>
 #include "bitmap.h"
+#include "log.h"
 
 // Helper macros for bit manipulation
 #define nth_bit_mask(n) (1 << (n))
@@ -26,7 +29,7 @@
  */
 int bitmap_get(void *bm, int i) {
     if (i < 0) {
-        fprintf(stderr, "bitmap_get: invalid index %d\n", i);
+        LOG_ERROR("bitmap_get: invalid index %d\n", i);
         return 0;
     }
     uint8_t *base = (uint8_t *)bm;
@@ -43,7 +46,7 @@ int bitmap_get(void *bm, int i) {
  */
 void bitmap_put(void *bm, int i, int v) {
     if (i < 0) {
-        fprintf(stderr, "bitmap_put: invalid index %d\n", i);
+        LOG_ERROR("bitmap_put: invalid index %d\n", i);
         return;
     }
     uint8_t *base = (uint8_t *)bm;
@@ -55,6 +58,54 @@ void bitmap_put(void *bm, int i, int v) {
     }
 }
 
+/**
+ * Find the first bit with the given value in a range of the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param v Value to look for (0 or 1).
+ * @param from First bit index to consider.
+ * @param size Number of bits in the bitmap; bits from here on are ignored.
+ *
+ * @return Index of the first matching bit at or after from, or -1 if there is none.
+ */
+int bitmap_find(void *bm, int v, int from, int size) {
+    if (from < 0) {
+        from = 0;
+    }
+    const uint64_t *words = (const uint64_t *)bm;
+    for (int w = from / 64; w * 64 < size; w++) {
+        uint64_t word = v ? words[w] : ~words[w];
+        if (w == from / 64) {
+            word &= ~0ULL << (from % 64); // Ignore the bits before from
+        }
+        if (word) {
+            int i = w * 64 + __builtin_ctzll(word);
+            return i < size ? i : -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Count the bits that are set in the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size Number of bits in the bitmap.
+ *
+ * @return The number of bits set to 1.
+ */
+int bitmap_count(void *bm, int size) {
+    const uint64_t *words = (const uint64_t *)bm;
+    int count = 0;
+    for (int w = 0; w < size / 64; w++) {
+        count += __builtin_popcountll(words[w]);
+    }
+    if (size % 64) {
+        count += __builtin_popcountll(words[size / 64] & ((1ULL << (size % 64)) - 1));
+    }
+    return count;
+}
+
 /**
  * Pretty-print a bitmap. 
  *
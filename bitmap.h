@@ -26,6 +26,31 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first bit with the given value in a range of the bitmap.
+ *
+ * The bitmap is scanned 64 bits at a time, so it must be 8-byte aligned and
+ * readable up to the end of the 64-bit word holding bit size - 1.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param v Value to look for (0 or 1).
+ * @param from First bit index to consider.
+ * @param size Number of bits in the bitmap; bits from here on are ignored.
+ *
+ * @return Index of the first matching bit at or after from, or -1 if there is none.
+ */
+int bitmap_find(void *bm, int v, int from, int size);
+
+/**
+ * Count the bits that are set in the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap (same requirements as bitmap_find).
+ * @param size Number of bits in the bitmap.
+ *
+ * @return The number of bits set to 1.
+ */
+int bitmap_count(void *bm, int size);
+
 /**
  * Pretty-print a bitmap. 
  *
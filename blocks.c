@@ -1,28 +1,90 @@
 // This file manages a disk image by providing functions for block allocation, deallocation, and access. 
-// It implements a block-based storage system with a fixed number of blocks and a configurable block size.
+// It implements a block-based storage system whose block size, block count and metadata layout are read from
+// a superblock, written when a new image is formatted. The image is either mmapped as a whole, or its metadata
+// regions are kept in memory and its data blocks go through the block cache in bcache.c.
 
 // importing neccesary libraries
+#define _GNU_SOURCE // fallocate(), madvise()
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "bcache.h"
 #include "bitmap.h"
 #include "blocks.h"
+#include "log.h"
+#include "stats.h"
 
-// Neccesary constraints/variables
-const int BLOCK_COUNT = 256; // Number of blocks
-const int BLOCK_SIZE = 4096; // Block size = 4KB
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // Total size = 1MB
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8; // Size of the block bitmap in bytes
+// Geometry of the mounted image, read from its superblock
+int BLOCK_COUNT = 0;       // Number of blocks
+int BLOCK_SIZE = 0;        // Block size in bytes
+size_t NUFS_SIZE = 0;      // Total size of the image in bytes
+int BLOCK_BITMAP_SIZE = 0; // Size of the block bitmap in bytes
+
+// Defaults for formatting a new image
+#define DEFAULT_BLOCK_SIZE 4096 // 4KB blocks
+#define DEFAULT_BLOCK_COUNT 256 // 1MB image
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+#define MIN_JOURNAL_BLOCKS 8
+#define MAX_JOURNAL_BLOCKS 1024
+
+#define DEFAULT_CACHE_BYTES (64 << 20)
 
 static int blocks_fd = -1;
-void *blocks_base = NULL;
+static int direct_fd = -1; // The image opened with O_DIRECT, for BLOCKS_BACKEND_DIRECT.
+static int backend = BLOCKS_BACKEND_MMAP;
+static int read_only = 0; // Map the whole image privately and never write to it, see blocks_set_read_only().
+static size_t cache_bytes = DEFAULT_CACHE_BYTES;
+void *blocks_base = NULL;   // The mapped image, or the in-memory metadata regions with the block cache.
+static size_t base_size = 0; // Bytes at blocks_base.
+static size_t private_size = 0; // Bytes at the start of the mapping mapped privately, with BLOCKS_BACKEND_MMAP.
+superblock_t *blocks_super = NULL;
+static uint8_t *dirty_bitmap = NULL; // In-memory bitmap of blocks modified since the last flush.
+// Data blocks holding directory entries or extents, which BLOCKS_BACKEND_MMAP accesses through the block cache,
+// see blocks_mark_metadata(); NULL with the other backends.
+static uint8_t *metadata_blocks = NULL;
+
+// Allocator state, rebuilt from the block bitmap by alloc_init(). alloc_lock protects it
+// together with the block bitmap.
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *free_words = NULL; // Bit w is set when word w of the block bitmap has a free block.
+static int bitmap_words = 0;        // Number of 64-bit words in the block bitmap.
+static int free_count = 0;          // Number of free blocks.
+static int alloc_cursor = 0;        // Next-fit position: where the last allocation ended.
+static int punch_warned = 0;        // Set once hole punching failed, to report it only once.
+
+// A run of blocks: pinned by a thread, see blocks_pin(), or waiting for the pins on it to go.
+typedef struct {
+    pthread_t owner;
+    int start;
+    int count;
+} pin_t;
+
+// Pinned runs and the runs whose release they hold back, both under alloc_lock.
+static pin_t *pins = NULL;
+static int pin_count = 0;
+static int pin_capacity = 0;
+static pin_t *deferred = NULL;
+static int deferred_count = 0;
+static int deferred_capacity = 0;
+
+// Freed runs waiting for the transaction that frees them to commit, see blocks_release_freed(). Under alloc_lock.
+static pin_t *freed = NULL;
+static int freed_count = 0;
+static int freed_capacity = 0;
+static int freed_blocks = 0;
+static __thread int thread_pins = 0;      // Pins held by the calling thread.
+static pthread_key_t pin_key;             // Unpins a thread's runs when it exits.
+static pthread_once_t pin_key_once = PTHREAD_ONCE_INIT;
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -35,99 +97,833 @@ int bytes_to_blocks(int bytes) {
     return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
 
+// @return Number of blocks of the given size needed for the given number of bytes.
+static uint32_t blocks_for(uint64_t bytes, uint32_t block_size) {
+    return (bytes + block_size - 1) / block_size;
+}
+
+/**
+ * Lay out a new image and fill in its superblock.
+ *
+ * @param sb Superblock to fill in.
+ * @param geometry Requested geometry (0 fields get defaults).
+ * @param file_size Current size of the image file in bytes.
+ */
+static void blocks_mkfs_layout(superblock_t *sb, const blocks_geometry_t *geometry, off_t file_size) {
+    uint32_t block_size = geometry->block_size ? geometry->block_size : DEFAULT_BLOCK_SIZE;
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1))) {
+        LOG_ERROR("blocks_init: block size %u must be a power of two between %d and %d\n",
+                block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        exit(1);
+    }
+
+    uint32_t block_count = geometry->block_count;
+    if (block_count == 0) {
+        block_count = file_size >= block_size ? file_size / block_size : DEFAULT_BLOCK_COUNT;
+    }
+    uint32_t inode_count = geometry->inode_count ? geometry->inode_count : block_count / 2;
+    uint32_t journal_blocks = geometry->journal_blocks ? geometry->journal_blocks : block_count / 32;
+    if (journal_blocks < MIN_JOURNAL_BLOCKS) {
+        journal_blocks = MIN_JOURNAL_BLOCKS;
+    }
+    if (journal_blocks > MAX_JOURNAL_BLOCKS) {
+        journal_blocks = MAX_JOURNAL_BLOCKS;
+    }
+    assert(geometry->inode_size > 0 && geometry->inode_size <= block_size);
+
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = NUFS_MAGIC;
+    sb->version = NUFS_VERSION;
+    sb->block_size = block_size;
+    sb->block_count = block_count;
+    sb->inode_count = inode_count;
+    sb->inode_size = geometry->inode_size;
+
+    // Block 0 holds the superblock; the regions follow it in order.
+    uint32_t bits_per_block = block_size * 8;
+    sb->block_bitmap_start = 1;
+    sb->block_bitmap_blocks = blocks_for(block_count, bits_per_block);
+    sb->refcount_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+    sb->refcount_blocks = blocks_for((uint64_t)block_count * sizeof(uint16_t), block_size);
+    sb->inode_bitmap_start = sb->refcount_start + sb->refcount_blocks;
+    sb->inode_bitmap_blocks = blocks_for(inode_count, bits_per_block);
+    sb->inode_table_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+    sb->inode_table_blocks = blocks_for(inode_count, block_size / geometry->inode_size);
+    sb->journal_start = sb->inode_table_start + sb->inode_table_blocks;
+    sb->journal_blocks = journal_blocks;
+    sb->data_start = sb->journal_start + sb->journal_blocks;
+
+    if (sb->data_start >= block_count) {
+        LOG_ERROR("blocks_init: %u blocks are too few for %u inodes\n", block_count, inode_count);
+        exit(1);
+    }
+}
+
+// @return 1 if the first n bytes of the file are all zero.
+static int blocks_file_is_blank(int fd, size_t n) {
+    uint8_t buf[DEFAULT_BLOCK_SIZE];
+    ssize_t got = pread(fd, buf, n < sizeof(buf) ? n : sizeof(buf), 0);
+    for (ssize_t i = 0; i < got; i++) {
+        if (buf[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// @return 1 if a block is accessed through the block cache rather than at blocks_base.
+static int block_cached(int bnum) {
+    if (bnum < FIRST_DATA_BLOCK || bnum >= BLOCK_COUNT) {
+        return 0;
+    }
+    if (backend != BLOCKS_BACKEND_MMAP) {
+        return 1;
+    }
+    return metadata_blocks && (__atomic_load_n(&metadata_blocks[bnum / 8], __ATOMIC_RELAXED) >> (bnum % 8) & 1);
+}
+
+/**
+ * Choose how the image is accessed. Must be called before blocks_init().
+ *
+ * @param kind One of the BLOCKS_BACKEND_* values.
+ * @param bytes Memory budget of the block cache, which holds only the directory and extent blocks with
+ *              BLOCKS_BACKEND_MMAP (0 for the default).
+ */
+void blocks_set_backend(int kind, size_t bytes) {
+    backend = kind;
+    cache_bytes = bytes ? bytes : DEFAULT_CACHE_BYTES;
+}
+
+/**
+ * Open the image read-only, with the whole of it mapped privately: changes,
+ * such as a journal replay, stay in memory and are never written back.
+ * Must be called before blocks_init(); the backend is BLOCKS_BACKEND_MMAP.
+ *
+ * @param on 1 to open the image read-only, 0 for the default.
+ */
+void blocks_set_read_only(int on) {
+    read_only = on;
+}
+
+// Read the metadata regions of the image into memory, for the block cache.
+static void blocks_load_metadata(size_t size) {
+    int rv = posix_memalign(&blocks_base, 4096, size);
+    assert(rv == 0);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(blocks_fd, (uint8_t *)blocks_base + done, size - done, done);
+        if (got <= 0) {
+            perror("blocks_init: pread");
+            exit(1);
+        }
+        done += got;
+    }
+}
+
+/**
+ * Open the image for direct I/O and check that the file system takes block
+ * sized, block aligned requests.
+ *
+ * @param image_path Path to the disk image file.
+ *
+ * @return A file descriptor opened with O_DIRECT, or blocks_fd if direct I/O is not supported.
+ */
+static int blocks_open_direct(const char *image_path) {
+    int fd = open(image_path, O_RDWR | O_DIRECT);
+    if (fd == -1) {
+        perror("blocks_init: O_DIRECT");
+        return blocks_fd;
+    }
+    void *probe;
+    int rv = posix_memalign(&probe, 4096, BLOCK_SIZE);
+    assert(rv == 0);
+    ssize_t got = pread(fd, probe, BLOCK_SIZE, 0);
+    free(probe);
+    if (got != BLOCK_SIZE) {
+        LOG_WARN("blocks_init: direct I/O of %d byte blocks is not supported, using buffered I/O\n", BLOCK_SIZE);
+        close(fd);
+        return blocks_fd;
+    }
+    return fd;
+}
+
+// Write a range of the in-memory metadata regions back to the image, for the block cache.
+static int blocks_write_metadata(size_t offset, size_t len) {
+    assert(offset + len <= base_size);
+    while (len > 0) {
+        ssize_t done = pwrite(blocks_fd, (uint8_t *)blocks_base + offset, len, offset);
+        if (done <= 0) {
+            perror("blocks_write_metadata: pwrite");
+            return -1;
+        }
+        offset += done;
+        len -= done;
+    }
+    return 0;
+}
+
 /**
  * Load and initialize the given disk image.
  *
  * @param image_path Path to the disk image file.
+ * @param geometry Geometry for formatting a new image, or NULL to only mount formatted images.
  */
-void blocks_init(const char *image_path) {
-    blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
+void blocks_init(const char *image_path, const blocks_geometry_t *geometry) {
+    blocks_fd = read_only ? open(image_path, O_RDONLY) : open(image_path, O_CREAT | O_RDWR, 0644);
     assert(blocks_fd != -1);
+    if (read_only) {
+        backend = BLOCKS_BACKEND_MMAP;
+    }
 
     // Check current file size
     struct stat st;
     int rv = fstat(blocks_fd, &st);
     assert(rv == 0);
 
-    if (st.st_size != NUFS_SIZE) {
+    superblock_t sb;
+    int format = 0;
+    if (pread(blocks_fd, &sb, sizeof(sb), 0) != sizeof(sb) || sb.magic != NUFS_MAGIC) {
+        // mkfs: only a new or zero-filled file may be formatted
+        if (!blocks_file_is_blank(blocks_fd, DEFAULT_BLOCK_SIZE)) {
+            LOG_ERROR("blocks_init: %s is not a nufs image\n", image_path);
+            exit(1);
+        }
+        if (!geometry || read_only) {
+            LOG_ERROR("blocks_init: %s is not formatted and no geometry was given\n", image_path);
+            exit(1);
+        }
+        blocks_mkfs_layout(&sb, geometry, st.st_size);
+        format = 1;
+    } else if (sb.version != NUFS_VERSION) {
+        LOG_ERROR("blocks_init: %s has format version %u, expected %u\n", image_path, sb.version, NUFS_VERSION);
+        exit(1);
+    } else if (geometry && geometry->inode_size && sb.inode_size != (uint32_t)geometry->inode_size) {
+        LOG_ERROR("blocks_init: %s has %u-byte inodes, expected %d\n", image_path, sb.inode_size, geometry->inode_size);
+        exit(1);
+    }
+
+    BLOCK_SIZE = sb.block_size;
+    BLOCK_COUNT = sb.block_count;
+    NUFS_SIZE = (size_t)BLOCK_SIZE * BLOCK_COUNT;
+    BLOCK_BITMAP_SIZE = (BLOCK_COUNT + 7) / 8;
+
+    if ((size_t)st.st_size < NUFS_SIZE && read_only) {
+        LOG_ERROR("blocks_init: %s is shorter than its %d blocks\n", image_path, BLOCK_COUNT);
+        exit(1);
+    } else if ((size_t)st.st_size < NUFS_SIZE) {
         rv = ftruncate(blocks_fd, NUFS_SIZE);
         assert(rv == 0);
     }
 
-    blocks_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-    assert(blocks_base != MAP_FAILED);
+    if (backend != BLOCKS_BACKEND_MMAP) {
+        base_size = (size_t)sb.data_start * BLOCK_SIZE;
+        blocks_load_metadata(base_size);
+        direct_fd = backend == BLOCKS_BACKEND_DIRECT ? blocks_open_direct(image_path) : -1;
+        bcache_init(direct_fd != -1 ? direct_fd : blocks_fd, BLOCK_SIZE, cache_bytes);
+    } else {
+        base_size = NUFS_SIZE;
+        blocks_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, read_only ? MAP_PRIVATE : MAP_SHARED, blocks_fd, 0);
+        assert(blocks_base != MAP_FAILED);
+        if (!read_only) {
+            // The regions before the journal are remapped privately: the bitmaps and reference counts are changed
+            // in place before their transaction commits, and the kernel could write a shared page back at any time.
+            // As with the block cache, they reach the image only when blocks_flush() writes them back. Blocks smaller
+            // than a page can take the first blocks of the journal along, which blocks_sync_range() writes back too.
+            size_t page = sysconf(_SC_PAGESIZE);
+            private_size = ((size_t)sb.journal_start * BLOCK_SIZE + page - 1) & ~(page - 1);
+            private_size = private_size < NUFS_SIZE ? private_size : NUFS_SIZE;
+            void *meta =
+                mmap(blocks_base, private_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, blocks_fd, 0);
+            assert(meta == blocks_base);
 
-    // Reserve block 0 for the block and inode bitmaps only if this is a fresh image
-    // If file was newly created or truncated, we need to set bitmap for block 0
-    // If it already existed and was correct size, assume metadata is intact
-    if (st.st_size == 0) {
+            // Directory and extent blocks lie among the data blocks, in the shared part: they go through the
+            // block cache instead, where the journal keeps them pinned until their transaction commits
+            metadata_blocks = calloc(BLOCK_BITMAP_SIZE, 1);
+            assert(metadata_blocks != NULL);
+            bcache_init(blocks_fd, BLOCK_SIZE, cache_bytes);
+        }
+    }
+    blocks_super = blocks_base;
+
+    dirty_bitmap = calloc(BLOCK_BITMAP_SIZE, 1);
+    assert(dirty_bitmap != NULL);
+
+    if (format) {
+        // Clear the metadata regions, write the superblock and reserve the metadata blocks
+        memset(blocks_base, 0, (size_t)sb.data_start * BLOCK_SIZE);
+        memcpy(blocks_super, &sb, sizeof(sb));
         void *bbm = get_blocks_bitmap();
-        bitmap_put(bbm, 0, 1);
+        for (uint32_t i = 0; i < sb.data_start; i++) {
+            bitmap_put(bbm, i, 1);
+        }
+        rv = blocks_sync_range(0, (size_t)sb.data_start * BLOCK_SIZE);
+        assert(rv == 0);
+        LOG_INFO("Formatted %s: %d blocks of %d bytes, %u inodes\n", image_path, BLOCK_COUNT, BLOCK_SIZE, sb.inode_count);
+    }
+
+    alloc_init();
+}
+
+/**
+ * Start the background I/O of the block cache, if the image goes through it.
+ * Call in the process that serves the mount, after FUSE may have forked.
+ */
+void blocks_start_io() {
+    if (blocks_base && backend != BLOCKS_BACKEND_MMAP) {
+        bcache_start_io();
     }
 }
 
 // Free the disk image and unmap memory.
 void blocks_free() {
-    if (blocks_base) {
+    if (blocks_base && backend != BLOCKS_BACKEND_MMAP) {
+        bcache_free();
+        free(blocks_base);
+        blocks_base = NULL;
+    } else if (blocks_base) {
+        if (metadata_blocks) {
+            bcache_free();
+            free(metadata_blocks);
+            metadata_blocks = NULL;
+        }
         int rv = munmap(blocks_base, NUFS_SIZE);
         assert(rv == 0);
         blocks_base = NULL;
+        private_size = 0;
+    }
+    if (direct_fd != -1 && direct_fd != blocks_fd) {
+        close(direct_fd);
     }
+    direct_fd = -1;
     if (blocks_fd != -1) {
         close(blocks_fd);
         blocks_fd = -1;
     }
+    free(dirty_bitmap);
+    dirty_bitmap = NULL;
+    free(free_words);
+    free_words = NULL;
+    free(pins);
+    free(deferred);
+    free(freed);
+    pins = deferred = freed = NULL;
+    pin_count = pin_capacity = deferred_count = deferred_capacity = 0;
+    freed_count = freed_capacity = freed_blocks = 0;
+}
+
+/**
+ * Get the file descriptor of the disk image, for I/O that bypasses the mapping.
+ * With BLOCKS_BACKEND_MMAP, data written through it is visible through the
+ * mapping and vice versa; the block cache does not see such I/O.
+ *
+ * @return The file descriptor, or -1 if no image is open.
+ */
+int blocks_get_fd() {
+    return blocks_fd;
+}
+
+/**
+ * Flush a byte range of the disk image to the backing file.
+ *
+ * @param offset Byte offset of the range in the image.
+ * @param len Length of the range in bytes.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_sync_range(size_t offset, size_t len) {
+    if (read_only) {
+        return 0;
+    }
+    if (backend != BLOCKS_BACKEND_MMAP) {
+        if (blocks_write_metadata(offset, len) < 0) {
+            return -1;
+        }
+        if (fdatasync(blocks_fd) == -1) {
+            perror("blocks_sync_range: fdatasync");
+            return -1;
+        }
+        return 0;
+    }
+
+    // The private part of the mapping is written back, the rest synced in place
+    if (offset < private_size) {
+        size_t n = len < private_size - offset ? len : private_size - offset;
+        if (blocks_write_metadata(offset, n) < 0) {
+            return -1;
+        }
+        if (fdatasync(blocks_fd) == -1) {
+            perror("blocks_sync_range: fdatasync");
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page - 1);
+    if (msync((uint8_t *)blocks_base + start, offset + len - start, MS_SYNC) == -1) {
+        perror("blocks_sync_range: msync");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write bytes straight to the backing file, leaving the image in memory (and
+ * the block cache) alone, which may hold newer contents for the range. Used to
+ * write committed journal records home; sync with blocks_sync_file().
+ *
+ * @param offset Byte offset of the range in the image.
+ * @param data The bytes to write.
+ * @param len Length of the range in bytes.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_write_through(size_t offset, const void *data, size_t len) {
+    if (read_only) {
+        return 0;
+    }
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t done = pwrite(blocks_fd, p, len, offset);
+        if (done <= 0) {
+            perror("blocks_write_through: pwrite");
+            return -1;
+        }
+        p += done;
+        offset += done;
+        len -= done;
+    }
+    return 0;
+}
+
+/**
+ * Sync what was written to the backing file with blocks_write_through().
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_sync_file() {
+    if (!read_only && fdatasync(blocks_fd) == -1) {
+        perror("blocks_sync_file: fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Mark a block as modified, so the next blocks_flush() writes it back.
+ *
+ * @param bnum Block number (index).
+ */
+void blocks_dirty(int bnum) {
+    if (bnum < 0 || bnum >= BLOCK_COUNT) {
+        LOG_ERROR("blocks_dirty: invalid block number %d\n", bnum);
+        return;
+    }
+    if (block_cached(bnum)) {
+        bcache_dirty(bnum);
+        return;
+    }
+    // Blocks sharing a byte of the bitmap can be dirtied by different threads
+    __atomic_fetch_or(&dirty_bitmap[bnum / 8], 1 << (bnum % 8), __ATOMIC_RELAXED);
+}
+
+/**
+ * Flush all blocks marked dirty to the backing file.
+ *
+ * @return 0 on success, -1 if any range failed to sync.
+ */
+int blocks_flush() {
+    uint64_t stats_start = stats_now();
+    int rv = 0;
+    if (read_only) {
+        memset(dirty_bitmap, 0, BLOCK_BITMAP_SIZE);
+        return 0;
+    }
+    int written = backend != BLOCKS_BACKEND_MMAP || metadata_blocks; // Whether the fdatasync() below is needed
+    if (written && bcache_flush() < 0) {
+        rv = -1;
+    }
+
+    int bnum = 0;
+    while (bnum < BLOCK_COUNT) {
+        // Skip whole clean bytes of the bitmap at once.
+        if (bnum % 8 == 0 && dirty_bitmap[bnum / 8] == 0) {
+            bnum += 8;
+            continue;
+        }
+        if (!bitmap_get(dirty_bitmap, bnum)) {
+            bnum++;
+            continue;
+        }
+
+        int start = bnum;
+        while (bnum < BLOCK_COUNT && bitmap_get(dirty_bitmap, bnum)) {
+            bitmap_put(dirty_bitmap, bnum, 0);
+            bnum++;
+        }
+        size_t offset = (size_t)start * BLOCK_SIZE;
+        size_t len = (size_t)(bnum - start) * BLOCK_SIZE;
+        // The in-memory metadata and the private part of a mapping are written here, synced once below
+        size_t n = len;
+        if (backend == BLOCKS_BACKEND_MMAP) {
+            n = offset >= private_size ? 0 : len < private_size - offset ? len : private_size - offset;
+        }
+        if (n > 0) {
+            written = 1;
+            if (blocks_write_metadata(offset, n) < 0) {
+                rv = -1;
+            }
+        }
+        if (n < len && blocks_sync_range(offset + n, len - n) < 0) {
+            rv = -1;
+        }
+    }
+
+    if (written && fdatasync(blocks_fd) == -1) {
+        perror("blocks_flush: fdatasync");
+        rv = -1;
+    }
+    stats_record(STATS_BLOCKS_FLUSH, stats_start, rv, 0);
+    return rv;
+}
+
+/**
+ * Record that a data block holds metadata: directory entries or extents.
+ * With BLOCKS_BACKEND_MMAP such a block is accessed through the block cache
+ * from then on until it is freed, like every data block with the other
+ * backends, so it reaches the image only when it is written back. Call
+ * before getting the block to change it.
+ *
+ * @param bnum Block number (index).
+ */
+void blocks_mark_metadata(int bnum) {
+    if (metadata_blocks && bnum >= FIRST_DATA_BLOCK && bnum < BLOCK_COUNT) {
+        __atomic_fetch_or(&metadata_blocks[bnum / 8], 1 << (bnum % 8), __ATOMIC_RELAXED);
+    }
+}
+
+// Map a run of freed blocks at blocks_base again, after bcache_discard() dropped their frames.
+static void forget_metadata(int start, int count) {
+    if (!metadata_blocks) {
+        return;
+    }
+    for (int bnum = start; bnum < start + count; bnum++) {
+        __atomic_fetch_and(&metadata_blocks[bnum / 8], ~(1 << (bnum % 8)), __ATOMIC_RELAXED);
+    }
 }
 
 /**
  * Get the block with the given index, returning a pointer to its start.
+ * The block stays at that address until blocks_put_block().
  *
  * @param bnum Block number (index).
  *
- * @return Pointer to the beginning of the block in memory.
+ * @return Pointer to the beginning of the block in memory, or NULL if it could not be loaded.
  */
 void *blocks_get_block(int bnum) {
     if (bnum < 0 || bnum >= BLOCK_COUNT) {
-        fprintf(stderr, "blocks_get_block: invalid block number %d\n", bnum);
+        LOG_ERROR("blocks_get_block: invalid block number %d\n", bnum);
         return NULL;
     }
-    return blocks_base + BLOCK_SIZE * bnum;
+    if (block_cached(bnum)) {
+        return bcache_get(bnum, 1);
+    }
+    return (uint8_t *)blocks_base + (size_t)BLOCK_SIZE * bnum;
+}
+
+/**
+ * Get a block the caller is about to overwrite completely. Same as
+ * blocks_get_block(), except that a cached backend does not read the old
+ * contents from the image.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in memory, or NULL if it could not be loaded.
+ */
+void *blocks_overwrite_block(int bnum) {
+    if (block_cached(bnum)) {
+        return bcache_get(bnum, 0);
+    }
+    return blocks_get_block(bnum);
+}
+
+/**
+ * Release a block returned by blocks_get_block().
+ *
+ * @param block Pointer returned by blocks_get_block(); NULL is ignored.
+ */
+void blocks_put_block(void *block) {
+    if (block && bcache_owns(block)) {
+        bcache_put(block);
+    }
+}
+
+/**
+ * Get how many blocks of a run can be accessed through one pointer.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return How many blocks from bnum on are contiguous in memory after
+ *         blocks_get_block(bnum): count when mapped, 1 for cached blocks.
+ */
+int blocks_span(int bnum, int count) {
+    if (backend != BLOCKS_BACKEND_MMAP && bnum + count > FIRST_DATA_BLOCK) {
+        return bnum < FIRST_DATA_BLOCK ? FIRST_DATA_BLOCK - bnum : 1;
+    }
+    return count;
+}
+
+/**
+ * Get the image offset of a pointer into a block.
+ *
+ * @param ptr Pointer into a block returned by blocks_get_block(), or into the metadata regions.
+ *
+ * @return Byte offset in the disk image.
+ */
+size_t blocks_offset(const void *ptr) {
+    if (bcache_owns(ptr)) {
+        return bcache_offset(ptr);
+    }
+    return (const uint8_t *)ptr - (const uint8_t *)blocks_base;
+}
+
+/**
+ * Read a run of blocks that is about to be accessed block by block, so the
+ * blocks that are not in memory yet are read with one request per run.
+ * Does nothing when the image is mapped.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_load(int bnum, int count) {
+    if (backend != BLOCKS_BACKEND_MMAP && bnum >= FIRST_DATA_BLOCK && count > 1 && bnum + count <= BLOCK_COUNT) {
+        bcache_prefetch(bnum, count);
+    }
+}
+
+/**
+ * Start reading a run of blocks that will be used soon, without waiting for it.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_prefetch(int bnum, int count) {
+    if (bnum < 0 || count < 1 || bnum + count > BLOCK_COUNT) {
+        return;
+    }
+    if (backend != BLOCKS_BACKEND_MMAP) {
+        bcache_prefetch_async(bnum, count);
+        return;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = ((size_t)bnum * BLOCK_SIZE) & ~(page - 1);
+    size_t end = (size_t)(bnum + count) * BLOCK_SIZE;
+    madvise((uint8_t *)blocks_base + start, end - start, MADV_WILLNEED);
 }
 
 // @return A pointer to the beginning of the free blocks bitmap.
 void *get_blocks_bitmap() {
-    return blocks_get_block(0);
+    return blocks_get_block(blocks_super->block_bitmap_start);
 }
 
 // @return A pointer to the beginning of the free inode bitmap.
 void *get_inode_bitmap() {
-    uint8_t *block = blocks_get_block(0);
-    return block + BLOCK_BITMAP_SIZE;
+    return blocks_get_block(blocks_super->inode_bitmap_start);
+}
+
+// @return A pointer to the first entry of the table of block reference counts.
+uint16_t *get_block_refs() {
+    return blocks_get_block(blocks_super->refcount_start);
+}
+
+// @return The block of the reference count table that holds the entry of the given block.
+static int refcount_block(int bnum) {
+    return blocks_super->refcount_start + bnum / (BLOCK_SIZE / sizeof(uint16_t));
+}
+
+// @return The block of the block bitmap that holds the bit for the given block.
+static int block_bitmap_block(int bnum) {
+    return blocks_super->block_bitmap_start + bnum / (BLOCK_SIZE * 8);
+}
+
+// Refresh the bit of free_words covering the given block.
+static void free_word_update(int bnum) {
+    int w = bnum / 64;
+    int end = (w + 1) * 64 < BLOCK_COUNT ? (w + 1) * 64 : BLOCK_COUNT;
+    bitmap_put(free_words, w, bitmap_find(get_blocks_bitmap(), 0, w * 64, end) >= 0);
+}
+
+// @return The first free block at or after from, or -1 if there is none.
+static int find_free(int from) {
+    void *bbm = get_blocks_bitmap();
+    // Skip the words of the block bitmap that are full without looking at them
+    int w = from / 64;
+    while ((w = bitmap_find(free_words, 1, w, bitmap_words)) >= 0) {
+        int lo = w * 64 > from ? w * 64 : from;
+        int end = (w + 1) * 64 < BLOCK_COUNT ? (w + 1) * 64 : BLOCK_COUNT;
+        int bnum = bitmap_find(bbm, 0, lo, end);
+        if (bnum >= 0) {
+            return bnum;
+        }
+        w++;
+    }
+    return -1;
+}
+
+/**
+ * Build the allocator's free space summary from the block bitmap.
+ *
+ * Called by blocks_init(), and again whenever the bitmap was changed behind the
+ * allocator's back (e.g. by journal replay).
+ */
+void alloc_init() {
+    void *bbm = get_blocks_bitmap();
+    bitmap_words = (BLOCK_COUNT + 63) / 64;
+    free(free_words);
+    free_words = calloc((bitmap_words + 63) / 64, sizeof(uint64_t));
+    assert(free_words != NULL);
+    for (int w = 0; w < bitmap_words; w++) {
+        free_word_update(w * 64);
+    }
+    free_count = BLOCK_COUNT - bitmap_count(bbm, BLOCK_COUNT);
+    alloc_cursor = FIRST_DATA_BLOCK;
+}
+
+/**
+ * Get the number of free blocks.
+ *
+ * @return The number of blocks that can still be allocated.
+ */
+int blocks_free_count() {
+    pthread_mutex_lock(&alloc_lock);
+    int count = free_count;
+    pthread_mutex_unlock(&alloc_lock);
+    return count;
+}
+
+/**
+ * Get the number of blocks freed but not released yet, which become free at
+ * the next commit, see blocks_release_freed().
+ *
+ * @return The number of blocks waiting for the commit.
+ */
+int blocks_freed_count() {
+    pthread_mutex_lock(&alloc_lock);
+    int count = freed_blocks;
+    pthread_mutex_unlock(&alloc_lock);
+    return count;
+}
+
+// Allocate a run of blocks, see alloc_run(). The caller holds alloc_lock.
+static int take_run(int goal, int want, int *got) {
+    if (free_count == 0) {
+        LOG_WARN("alloc_run: no free blocks available\n");
+        return -ENOSPC;
+    }
+    if (goal < FIRST_DATA_BLOCK || goal >= BLOCK_COUNT) {
+        goal = alloc_cursor;
+    }
+
+    // Start from the goal, then wrap around; metadata blocks are always marked used.
+    int start = find_free(goal);
+    if (start < 0) {
+        start = find_free(FIRST_DATA_BLOCK);
+    }
+    assert(start >= 0);
+
+    // The run ends at the next used block
+    void *bbm = get_blocks_bitmap();
+    int limit = start + want < BLOCK_COUNT ? start + want : BLOCK_COUNT;
+    int end = bitmap_find(bbm, 1, start, limit);
+    if (end < 0) {
+        end = limit;
+    }
+
+    // The blocks are not cleared here: file data is written over them right
+    // away, and callers that need zeroed blocks clear them themselves.
+    for (int i = start; i < end; i++) {
+        bitmap_put(bbm, i, 1);
+        blocks_dirty(block_bitmap_block(i));
+    }
+    for (int w = start / 64; w <= (end - 1) / 64; w++) {
+        free_word_update(w * 64);
+    }
+    free_count -= end - start;
+    alloc_cursor = end < BLOCK_COUNT ? end : FIRST_DATA_BLOCK;
+
+    TRACE("+ alloc_run(%d, %d) -> %d (%d blocks)\n", goal, want, start, end - start);
+    *got = end - start;
+    return start;
 }
 
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the next unused block after the previous allocation and marks it as allocated.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block() {
-    void *bbm = get_blocks_bitmap();
-    // Start from FIRST_DATA_BLOCK to avoid overwriting inode metadata blocks.
-    for (int i = FIRST_DATA_BLOCK; i < BLOCK_COUNT; ++i) {
-        if (!bitmap_get(bbm, i)) {
-            bitmap_put(bbm, i, 1);
-            void *block = blocks_get_block(i);
-            if (block) {
-                memset(block, 0, BLOCK_SIZE);
-            }
-            printf("+ alloc_block() -> %d\n", i);
-            return i;
+    int got;
+    return alloc_run(-1, 1, &got);
+}
+
+/**
+ * Allocate a number of blocks, not necessarily contiguous.
+ *
+ * @param n Number of blocks to allocate.
+ * @param out Receives the block numbers, in allocation order.
+ *
+ * @return n on success, or -ENOSPC (allocating nothing) if fewer than n blocks are free.
+ */
+int alloc_blocks(int n, int *out) {
+    uint64_t stats_start = stats_now();
+    pthread_mutex_lock(&alloc_lock);
+    if (n > free_count) {
+        int available = free_count;
+        pthread_mutex_unlock(&alloc_lock);
+        LOG_WARN("alloc_blocks: %d blocks requested, %d free\n", n, available);
+        stats_record(STATS_ALLOC, stats_start, -ENOSPC, 0);
+        return -ENOSPC;
+    }
+    int done = 0;
+    while (done < n) {
+        int got;
+        int start = take_run(-1, n - done, &got);
+        assert(start >= 0);
+        for (int i = 0; i < got; i++) {
+            out[done++] = start + i;
         }
     }
-    fprintf(stderr, "alloc_block: no free blocks available\n");
-    return -ENOSPC;
+    pthread_mutex_unlock(&alloc_lock);
+    stats_record(STATS_ALLOC, stats_start, n, (uint64_t)n * BLOCK_SIZE);
+    return n;
+}
+
+/**
+ * Allocate a run of contiguous blocks.
+ *
+ * Takes the first free block at or after goal (wrapping around to
+ * FIRST_DATA_BLOCK), then extends the run over the free blocks that follow it.
+ *
+ * @param goal Block to try first, e.g. the block after a file's last block,
+ *             or -1 to continue after the previous allocation.
+ * @param want Maximum number of blocks to allocate.
+ * @param got Receives the number of blocks allocated (between 1 and want).
+ *
+ * @return The first block of the run, or -ENOSPC if no block is free.
+ */
+int alloc_run(int goal, int want, int *got) {
+    uint64_t stats_start = stats_now();
+    pthread_mutex_lock(&alloc_lock);
+    int start = take_run(goal, want, got);
+    pthread_mutex_unlock(&alloc_lock);
+    stats_record(STATS_ALLOC, stats_start, start, start >= 0 ? (uint64_t)*got * BLOCK_SIZE : 0);
+    return start;
 }
 
 /**
@@ -136,20 +932,315 @@ int alloc_block() {
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum) {
-    if (bnum <= 0 || bnum >= BLOCK_COUNT) {
-        fprintf(stderr, "free_block: invalid block number %d\n", bnum);
+    free_run(bnum, 1);
+}
+
+/**
+ * Get whether another file also uses a block, so it must be copied before it is changed.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return 1 if the block has more than one reference, 0 otherwise.
+ */
+int blocks_shared(int bnum) {
+    // A file only asks about its own blocks, whose count no other thread can drop to 0 meanwhile. Acquire pairs
+    // with the release in free_run(): once the count reads 0, the other file is done reading the block.
+    return __atomic_load_n(&get_block_refs()[bnum], __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * Add a reference to each block of a run of allocated blocks, for a file that
+ * shares them with the files already using them.
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, or -EMLINK (changing nothing) if a block has the maximum number of references.
+ */
+int blocks_share_run(int start, int count) {
+    if (start < FIRST_DATA_BLOCK || count < 1 || start + count > BLOCK_COUNT) {
+        LOG_ERROR("blocks_share_run: invalid block run %d+%d\n", start, count);
+        return -EINVAL;
+    }
+    uint16_t *refs = get_block_refs();
+    pthread_mutex_lock(&alloc_lock);
+    for (int bnum = start; bnum < start + count; bnum++) {
+        if (refs[bnum] == UINT16_MAX) {
+            pthread_mutex_unlock(&alloc_lock);
+            LOG_WARN("blocks_share_run: block %d has too many references\n", bnum);
+            return -EMLINK;
+        }
+    }
+    for (int bnum = start; bnum < start + count; bnum++) {
+        __atomic_store_n(&refs[bnum], refs[bnum] + 1, __ATOMIC_RELAXED);
+        blocks_dirty(refcount_block(bnum));
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    TRACE("+ blocks_share_run(%d, %d)\n", start, count);
+    return 0;
+}
+
+// Append a run to a list of runs, growing it as needed. The caller holds alloc_lock.
+static int pin_append(pin_t **list, int *count, int *capacity, int start, int n) {
+    if (*count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 16;
+        pin_t *bigger = realloc(*list, grown * sizeof(pin_t));
+        if (!bigger) {
+            return -ENOMEM;
+        }
+        *list = bigger;
+        *capacity = grown;
+    }
+    (*list)[*count].owner = pthread_self();
+    (*list)[*count].start = start;
+    (*list)[*count].count = n;
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// @return Whether a pin covers a block of the run. The caller holds alloc_lock.
+static int pinned(int start, int count) {
+    for (int i = 0; i < pin_count; i++) {
+        if (pins[i].start < start + count && start < pins[i].start + pins[i].count) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void release_run(int start, int count);
+
+// pthread_key_t destructor: drop the pins of a thread that exits.
+static void pin_key_destroy(void *value) {
+    blocks_unpin(0);
+}
+
+static void pin_key_create() {
+    int rv = pthread_key_create(&pin_key, pin_key_destroy);
+    assert(rv == 0);
+}
+
+/**
+ * Keep a run of blocks from being released until the calling thread unpins it.
+ * Freeing the run still takes it out of its file, but leaves it allocated, so
+ * its data stays in place and no other file gets the blocks meanwhile. This is
+ * for a zero-copy read, whose buffer vector FUSE reads only after it returned.
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, or -ENOMEM.
+ */
+int blocks_pin(int start, int count) {
+    pthread_once(&pin_key_once, pin_key_create);
+    pthread_mutex_lock(&alloc_lock);
+    int rv = pin_append(&pins, &pin_count, &pin_capacity, start, count);
+    pthread_mutex_unlock(&alloc_lock);
+    if (rv == 0 && thread_pins++ == 0) {
+        pthread_setspecific(pin_key, &pin_key);
+    }
+    return rv;
+}
+
+/**
+ * Drop the pins of the calling thread, or of all threads, and release the runs
+ * that were freed meanwhile and are no longer pinned.
+ *
+ * @param all_threads 0 for the pins of the calling thread, 1 for all pins.
+ */
+void blocks_unpin(int all_threads) {
+    if (!all_threads && thread_pins == 0) {
         return;
     }
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&alloc_lock);
+    int kept = 0;
+    for (int i = 0; i < pin_count; i++) {
+        if (!all_threads && !pthread_equal(pins[i].owner, self)) {
+            pins[kept++] = pins[i];
+        }
+    }
+    __atomic_store_n(&pin_count, kept, __ATOMIC_RELAXED);
+    thread_pins = 0;
+    for (int i = 0; i < deferred_count;) {
+        pin_t run = deferred[i];
+        if (pinned(run.start, run.count)) {
+            i++;
+            continue;
+        }
+        deferred[i] = deferred[--deferred_count];
+        pthread_mutex_unlock(&alloc_lock);
+        release_run(run.start, run.count);
+        pthread_mutex_lock(&alloc_lock);
+        i = 0; // Other threads may have changed the list meanwhile
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Discard a run of freed blocks and mark them free in the bitmap, see blocks_release_freed().
+static void discard_run(int start, int count) {
+    // Discard the data while the blocks are still allocated, so no other thread reuses them first
+    if (backend != BLOCKS_BACKEND_MMAP || metadata_blocks) {
+        bcache_discard(start, count);
+        forget_metadata(start, count);
+    }
+    if (fallocate(blocks_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)start * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) == -1 && !punch_warned) {
+        perror("free_run: fallocate(PUNCH_HOLE)");
+        punch_warned = 1;
+    }
 
+    pthread_mutex_lock(&alloc_lock);
     void *bbm = get_blocks_bitmap();
-    if (bitmap_get(bbm, bnum)) {
+    for (int bnum = start; bnum < start + count; bnum++) {
+        if (!bitmap_get(bbm, bnum)) {
+            LOG_ERROR("free_run: block %d is already free\n", bnum);
+            continue;
+        }
         bitmap_put(bbm, bnum, 0); // Mark block as free in the bitmap
-        void *block = blocks_get_block(bnum);
-        if (block) {
-            memset(block, 0, BLOCK_SIZE); // Clear the block
+        blocks_dirty(block_bitmap_block(bnum));
+        bitmap_put(free_words, bnum / 64, 1);
+        free_count++;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Deallocate a run of unshared blocks, see free_run().
+static void release_run(int start, int count) {
+    // A pinned run waits for blocks_unpin(); if the list cannot grow, it is released anyway. No file uses the
+    // run any more, so no thread can pin it meanwhile, and without any pins the lock is not needed to see that.
+    if (__atomic_load_n(&pin_count, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&alloc_lock);
+        int wait = pinned(start, count) &&
+                   pin_append(&deferred, &deferred_count, &deferred_capacity, start, count) == 0;
+        pthread_mutex_unlock(&alloc_lock);
+        if (wait) {
+            return;
         }
-        printf("+ free_block(%d)\n", bnum);
-    } else {
-        fprintf(stderr, "free_block: block %d is already free\n", bnum);
     }
-}
\ No newline at end of file
+
+    // Until the free commits, a crash brings back the file that still uses the run, so it keeps its data and is
+    // not reused. If the list cannot grow, the run is released right away.
+    pthread_mutex_lock(&alloc_lock);
+    int wait = pin_append(&freed, &freed_count, &freed_capacity, start, count) == 0;
+    if (wait) {
+        freed_blocks += count;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (!wait) {
+        discard_run(start, count);
+    }
+}
+
+/**
+ * Release one of the runs freed since the last call. Call this only after the
+ * transaction that freed them has committed (see journal_commit()): until
+ * then the runs stay allocated and keep their data. Releasing a run clears
+ * its bits in the block bitmap, which the caller logs.
+ *
+ * @param start Set to the first block of the released run.
+ * @param count Set to the number of blocks in the run.
+ *
+ * @return 1 if a run was released, 0 if there was none.
+ */
+int blocks_release_freed(int *start, int *count) {
+    pthread_mutex_lock(&alloc_lock);
+    if (freed_count == 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        return 0;
+    }
+    pin_t run = freed[--freed_count];
+    freed_blocks -= run.count;
+    pthread_mutex_unlock(&alloc_lock);
+
+    discard_run(run.start, run.count);
+    *start = run.start;
+    *count = run.count;
+    return 1;
+}
+
+/**
+ * Check whether the freed runs waiting for a commit hold back as many blocks
+ * as are still free, so committing soon would give the space back.
+ *
+ * @return 1 if so, 0 otherwise.
+ */
+int blocks_release_due() {
+    pthread_mutex_lock(&alloc_lock);
+    int due = freed_blocks > 0 && freed_blocks >= free_count;
+    pthread_mutex_unlock(&alloc_lock);
+    return due;
+}
+
+/**
+ * Deallocate a run of contiguous blocks.
+ *
+ * Blocks that are shared only lose a reference. The others are discarded
+ * rather than cleared: their range of the image is punched out of the backing
+ * file, so the kernel drops the pages and later reads see zeros. If the file
+ * system does not support hole punching, the blocks keep their old contents;
+ * allocating them again does not clear them either (see alloc_run()). Both
+ * wait until the free has committed, see blocks_release_freed().
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void free_run(int start, int count) {
+    if (start < FIRST_DATA_BLOCK || count < 1 || start + count > BLOCK_COUNT) {
+        LOG_ERROR("free_run: invalid block run %d+%d\n", start, count);
+        return;
+    }
+
+    // Split the run into pieces that are all shared or all unshared
+    uint16_t *refs = get_block_refs();
+    int bnum = start;
+    while (bnum < start + count) {
+        pthread_mutex_lock(&alloc_lock);
+        int shared = refs[bnum] != 0;
+        int end = bnum;
+        while (end < start + count && (refs[end] != 0) == shared) {
+            if (shared) {
+                __atomic_store_n(&refs[end], refs[end] - 1, __ATOMIC_RELEASE);
+                blocks_dirty(refcount_block(end));
+            }
+            end++;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        if (!shared) {
+            release_run(bnum, end - bnum);
+        }
+        bnum = end;
+    }
+    TRACE("+ free_run(%d, %d)\n", start, count);
+}
+
+/**
+ * Clear a run of allocated blocks. Their range of the image is punched out of
+ * the backing file, which is cheaper than writing zeros and keeps the image
+ * sparse; if the file system does not support that, zeros are written.
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, or -EIO if a block could not be written.
+ */
+int blocks_zero_run(int start, int count) {
+    if (backend != BLOCKS_BACKEND_MMAP || metadata_blocks) {
+        bcache_discard(start, count);
+        forget_metadata(start, count);
+    }
+    if (!punch_warned && fallocate(blocks_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                   (off_t)start * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) == 0) {
+        return 0;
+    }
+    for (int bnum = start; bnum < start + count; bnum++) {
+        void *block = blocks_overwrite_block(bnum);
+        if (!block) {
+            return -EIO;
+        }
+        memset(block, 0, BLOCK_SIZE);
+        blocks_dirty(bnum);
+        blocks_put_block(block);
+    }
+    return 0;
+}
@@ -4,24 +4,87 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * Block data is accessed using pointers, through one of two backends:
+ *  - BLOCKS_BACKEND_MMAP: the whole disk image is mmapped; the data blocks
+ *    holding directory entries or extents go through the block cache (see
+ *    blocks_mark_metadata()).
+ *  - BLOCKS_BACKEND_CACHE: the metadata regions (superblock to journal) are read
+ *    into memory at mount, and data blocks go through a bounded block cache (see bcache.h).
+ *  - BLOCKS_BACKEND_DIRECT: like BLOCKS_BACKEND_CACHE, but the cache reads and
+ *    writes data blocks with O_DIRECT, bypassing the kernel's page cache.
+ * Every pointer returned by blocks_get_block() must be given back with
+ * blocks_put_block(), which lets the cache reuse its memory.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
-const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-const int BLOCK_SIZE;  // default = 4K
-const int NUFS_SIZE;   // default = 1MB
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 6        // Bumped whenever the on-disk format changes.
 
-const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+// Backends, see blocks_set_backend().
+#define BLOCKS_BACKEND_MMAP 0  // Map the whole image (default)
+#define BLOCKS_BACKEND_CACHE 1 // Keep the metadata in memory and cache data blocks
+#define BLOCKS_BACKEND_DIRECT 2 // Same, with direct I/O for the data blocks
+
+/**
+ * The superblock, stored at the start of block 0.
+ *
+ * It is written when an image is formatted and records the geometry and the
+ * location of every metadata region, so images of any size can be mounted.
+ */
+typedef struct superblock {
+  uint32_t magic;               // NUFS_MAGIC
+  uint32_t version;             // NUFS_VERSION
+  uint32_t block_size;          // Bytes per block
+  uint32_t block_count;         // Blocks in the image
+  uint32_t inode_count;         // Slots in the inode table
+  uint32_t inode_size;          // Bytes per inode slot
+  uint32_t block_bitmap_start;  // First block of the free block bitmap
+  uint32_t block_bitmap_blocks;
+  uint32_t refcount_start;      // First block of the block reference counts
+  uint32_t refcount_blocks;
+  uint32_t inode_bitmap_start;  // First block of the inode bitmap
+  uint32_t inode_bitmap_blocks;
+  uint32_t inode_table_start;   // First block of the inode table
+  uint32_t inode_table_blocks;
+  uint32_t journal_start;       // First block of the metadata journal (see journal.h)
+  uint32_t journal_blocks;
+  uint32_t data_start;          // First block available for file data
+} superblock_t;
+
+/**
+ * Geometry used by blocks_init() when it formats a new image.
+ *
+ * Fields left at 0 get a default.
+ */
+typedef struct blocks_geometry {
+  int block_size;     // default = 4K
+  int block_count;    // default = size of the image file, or 256 if it is empty
+  int inode_count;    // default = block_count / 2
+  int inode_size;     // must be set by the caller
+  int journal_blocks; // default = block_count / 32, between 8 and 1024
+} blocks_geometry_t;
+
+// Geometry of the mounted image, filled in from the superblock by blocks_init().
+extern int BLOCK_COUNT;       // we split the "disk" into blocks (default = 256)
+extern int BLOCK_SIZE;        // default = 4K
+extern size_t NUFS_SIZE;      // default = 1MB
+extern int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
 
-#define INODE_META_BLOCK 1
-#define FIRST_INODE_BLOCK 2
-#define LAST_INODE_BLOCK 27
-#define FIRST_DATA_BLOCK 28
 extern void *blocks_base;
+extern superblock_t *blocks_super; // Superblock of the mounted image (start of block 0)
+
+// Layout of the mounted image, as recorded in the superblock.
+#define INODE_COUNT ((int)blocks_super->inode_count)
+#define FIRST_INODE_BLOCK ((int)blocks_super->inode_table_start)
+#define LAST_INODE_BLOCK (FIRST_INODE_BLOCK + (int)blocks_super->inode_table_blocks - 1)
+#define JOURNAL_FIRST_BLOCK ((int)blocks_super->journal_start)
+#define JOURNAL_BLOCKS ((int)blocks_super->journal_blocks)
+#define FIRST_DATA_BLOCK ((int)blocks_super->data_start)
 
 // Compute how many inodes fit in a single block
 #define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode_t))
@@ -35,27 +98,180 @@ extern void *blocks_base;
  */
 int bytes_to_blocks(int bytes);
 
+/**
+ * Choose how the image is accessed. Must be called before blocks_init().
+ *
+ * @param kind One of the BLOCKS_BACKEND_* values.
+ * @param bytes Memory budget of the block cache, which holds only the directory and extent blocks with
+ *              BLOCKS_BACKEND_MMAP (0 for the default).
+ */
+void blocks_set_backend(int kind, size_t bytes);
+
+/**
+ * Open the image read-only, with the whole of it mapped privately: changes,
+ * such as a journal replay, stay in memory and are never written back.
+ * Must be called before blocks_init(); the backend is BLOCKS_BACKEND_MMAP.
+ *
+ * @param on 1 to open the image read-only, 0 for the default.
+ */
+void blocks_set_read_only(int on);
+
 /**
  * Load and initialize the given disk image.
  *
+ * An image without a superblock (a new or all-zero file) is formatted first.
+ *
  * @param image_path Path to the disk image file.
+ * @param geometry Geometry for formatting a new image, or NULL to only mount formatted images.
  */
-void blocks_init(const char *image_path);
+void blocks_init(const char *image_path, const blocks_geometry_t *geometry);
+
+/**
+ * Start the background I/O of the block cache, if the image goes through it.
+ * Call in the process that serves the mount, after FUSE may have forked.
+ */
+void blocks_start_io();
 
 /**
  * Close the disk image.
  */
 void blocks_free();
 
+/**
+ * Get the file descriptor of the disk image, for I/O that bypasses the mapping.
+ * With BLOCKS_BACKEND_MMAP, data written through it is visible through the
+ * mapping and vice versa; the block cache does not see such I/O.
+ *
+ * @return The file descriptor, or -1 if no image is open.
+ */
+int blocks_get_fd();
+
+/**
+ * Flush a byte range of the disk image to the backing file.
+ *
+ * The range is widened to page boundaries as required by msync. With the block
+ * cache, the range must lie in the metadata regions.
+ *
+ * @param offset Byte offset of the range in the image.
+ * @param len Length of the range in bytes.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_sync_range(size_t offset, size_t len);
+
+/**
+ * Write bytes straight to the backing file, leaving the image in memory (and
+ * the block cache) alone, which may hold newer contents for the range. Used to
+ * write committed journal records home; sync with blocks_sync_file().
+ *
+ * @param offset Byte offset of the range in the image.
+ * @param data The bytes to write.
+ * @param len Length of the range in bytes.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_write_through(size_t offset, const void *data, size_t len);
+
+/**
+ * Sync what was written to the backing file with blocks_write_through().
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_sync_file();
+
+/**
+ * Mark a block as modified, so the next blocks_flush() writes it back.
+ *
+ * @param bnum Block number (index).
+ */
+void blocks_dirty(int bnum);
+
+/**
+ * Flush all blocks marked dirty to the backing file.
+ *
+ * Adjacent dirty blocks are synced with a single msync or pwritev call.
+ *
+ * @return 0 on success, -1 if any range failed to sync.
+ */
+int blocks_flush();
+
+/**
+ * Record that a data block holds metadata: directory entries or extents.
+ * With BLOCKS_BACKEND_MMAP such a block is accessed through the block cache
+ * from then on until it is freed, like every data block with the other
+ * backends, so it reaches the image only when it is written back. Call
+ * before getting the block to change it.
+ *
+ * @param bnum Block number (index).
+ */
+void blocks_mark_metadata(int bnum);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
+ * The block stays at that address until blocks_put_block().
  *
  * @param bnum Block number (index).
  *
- * @return Pointer to the beginning of the block in memory.
+ * @return Pointer to the beginning of the block in memory, or NULL if it could not be loaded.
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a block the caller is about to overwrite completely. Same as
+ * blocks_get_block(), except that a cached backend does not read the old
+ * contents from the image.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in memory, or NULL if it could not be loaded.
+ */
+void *blocks_overwrite_block(int bnum);
+
+/**
+ * Release a block returned by blocks_get_block().
+ *
+ * @param block Pointer returned by blocks_get_block(); NULL is ignored.
+ */
+void blocks_put_block(void *block);
+
+/**
+ * Get how many blocks of a run can be accessed through one pointer.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return How many blocks from bnum on are contiguous in memory after
+ *         blocks_get_block(bnum): count when mapped, 1 for cached blocks.
+ */
+int blocks_span(int bnum, int count);
+
+/**
+ * Get the image offset of a pointer into a block.
+ *
+ * @param ptr Pointer into a block returned by blocks_get_block(), or into the metadata regions.
+ *
+ * @return Byte offset in the disk image.
+ */
+size_t blocks_offset(const void *ptr);
+
+/**
+ * Read a run of blocks that is about to be accessed block by block, so the
+ * blocks that are not in memory yet are read with one request per run.
+ * Does nothing when the image is mapped.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_load(int bnum, int count);
+
+/**
+ * Start reading a run of blocks that will be used soon, without waiting for it.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_prefetch(int bnum, int count);
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -70,15 +286,76 @@ void *get_blocks_bitmap();
  */
 void *get_inode_bitmap();
 
+/**
+ * Return a pointer to the table of block reference counts.
+ *
+ * Entry b counts the references to block b beyond the first, so a block that
+ * only one file uses has 0 there. The table is changed under the allocator's
+ * lock, see blocks_share_run() and free_run().
+ *
+ * @return A pointer to the first entry.
+ */
+uint16_t *get_block_refs();
+
+/**
+ * Build the allocator's free space summary from the block bitmap.
+ *
+ * Called by blocks_init(), and again whenever the bitmap was changed behind the
+ * allocator's back (e.g. by journal replay).
+ */
+void alloc_init();
+
+/**
+ * Get the number of free blocks.
+ *
+ * @return The number of blocks that can still be allocated.
+ */
+int blocks_free_count();
+
+/**
+ * Get the number of blocks freed but not released yet, which become free at
+ * the next commit, see blocks_release_freed().
+ *
+ * @return The number of blocks waiting for the commit.
+ */
+int blocks_freed_count();
+
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the next unused block after the previous allocation and marks it as allocated.
+ * Like alloc_run(), it does not clear the block.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
+/**
+ * Allocate a number of blocks, not necessarily contiguous.
+ *
+ * @param n Number of blocks to allocate.
+ * @param out Receives the block numbers, in allocation order.
+ *
+ * @return n on success, or -ENOSPC (allocating nothing) if fewer than n blocks are free.
+ */
+int alloc_blocks(int n, int *out);
+
+/**
+ * Allocate a run of contiguous blocks.
+ *
+ * Takes the first free block at or after goal (wrapping around to
+ * FIRST_DATA_BLOCK), then extends the run over the free blocks that follow it.
+ * The blocks are not cleared and may hold the data of a freed file.
+ *
+ * @param goal Block to try first, e.g. the block after a file's last block,
+ *             or -1 to continue after the previous allocation.
+ * @param want Maximum number of blocks to allocate.
+ * @param got Receives the number of blocks allocated (between 1 and want).
+ *
+ * @return The first block of the run, or -ENOSPC if no block is free.
+ */
+int alloc_run(int goal, int want, int *got);
+
 /**
  * Deallocate the block with the given number.
  *
@@ -86,4 +363,91 @@ int alloc_block();
  */
 void free_block(int bnum);
 
+/**
+ * Get whether another file also uses a block, so it must be copied before it is changed.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return 1 if the block has more than one reference, 0 otherwise.
+ */
+int blocks_shared(int bnum);
+
+/**
+ * Add a reference to each block of a run of allocated blocks, for a file that
+ * shares them with the files already using them.
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, or -EMLINK (changing nothing) if a block has the maximum number of references.
+ */
+int blocks_share_run(int start, int count);
+
+/**
+ * Deallocate a run of contiguous blocks.
+ *
+ * Blocks that are shared only lose a reference. The others are discarded
+ * rather than cleared: their range of the image is punched out of the backing
+ * file, so the kernel drops the pages and later reads see zeros. Both wait
+ * until the free has committed, see blocks_release_freed().
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void free_run(int start, int count);
+
+/**
+ * Release one of the runs freed since the last call. Call this only after the
+ * transaction that freed them has committed (see journal_commit()): until
+ * then the runs stay allocated and keep their data. Releasing a run clears
+ * its bits in the block bitmap, which the caller logs.
+ *
+ * @param start Set to the first block of the released run.
+ * @param count Set to the number of blocks in the run.
+ *
+ * @return 1 if a run was released, 0 if there was none.
+ */
+int blocks_release_freed(int *start, int *count);
+
+/**
+ * Check whether the freed runs waiting for a commit hold back as many blocks
+ * as are still free, so committing soon would give the space back.
+ *
+ * @return 1 if so, 0 otherwise.
+ */
+int blocks_release_due();
+
+/**
+ * Keep a run of blocks from being released until the calling thread unpins it.
+ * Freeing the run still takes it out of its file, but leaves it allocated, so
+ * its data stays in place and no other file gets the blocks meanwhile. This is
+ * for a zero-copy read, whose buffer vector FUSE reads only after it returned.
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, or -ENOMEM.
+ */
+int blocks_pin(int start, int count);
+
+/**
+ * Drop the pins of the calling thread, or of all threads, and release the runs
+ * that were freed meanwhile and are no longer pinned.
+ *
+ * @param all_threads 0 for the pins of the calling thread, 1 for all pins.
+ */
+void blocks_unpin(int all_threads);
+
+/**
+ * Clear a run of allocated blocks. Their range of the image is punched out of
+ * the backing file, which is cheaper than writing zeros and keeps the image
+ * sparse; if the file system does not support that, zeros are written.
+ *
+ * @param start First block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, or -EIO if a block could not be written.
+ */
+int blocks_zero_run(int start, int count);
+
 #endif
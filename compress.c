@@ -0,0 +1,375 @@
+// Implements the LZ4 block format and the clusters of compressed files. The encoder is a greedy single-pass matcher
+// over a hash table of the last position of each 4-byte prefix; it skips ahead faster the longer it finds no match,
+// so data that does not compress costs little time. Decompressed clusters are cached by the number of their first
+// disk block: only compress_write_cluster() makes a block the first of a compressed cluster, and it refreshes the
+// entry, so the entry a read finds always matches the blocks.
+
+// necessary libraries
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blocks.h"
+#include "compress.h"
+#include "inode.h"
+#include "log.h"
+
+#define MIN_MATCH 4      // Shortest match a sequence encodes
+#define LAST_LITERALS 5  // The last bytes of the data are always literals
+#define MATCH_LIMIT 12   // Nor does a match start closer than this to the end
+#define MAX_OFFSET 65535 // Farthest back a match can be
+#define HASH_BITS 12
+
+#define HEADER_SIZE ((int)sizeof(uint32_t)) // Length of the compressed data, before it in a cluster's first block
+
+#define CACHE_BYTES (1 << 20) // Memory budget of the cluster cache
+#define CACHE_MAX_SLOTS 64
+
+typedef struct {
+    int bnum;      // First disk block of the cluster
+    int mapped;    // Blocks the compressed cluster takes; 0 marks an empty slot
+    uint64_t used; // Value of cache_clock when last used
+    char *data;    // COMPRESS_CLUSTER_SIZE bytes
+} cache_slot_t;
+
+static cache_slot_t cache[CACHE_MAX_SLOTS];
+static uint64_t cache_clock = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Bytes a length field takes past the 4 bits of the token, for a length of at least 15.
+static int length_bytes(int len) {
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+// Write the bytes of a length field past the token.
+static char *put_length(char *op, int len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        *op++ = (char)255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/**
+ * Compress data into the LZ4 block format.
+ *
+ * @param src Data to compress.
+ * @param len Length of the data.
+ * @param dst Buffer for the compressed data.
+ * @param capacity Size of dst.
+ *
+ * @return Length of the compressed data, or 0 if it does not fit in capacity bytes.
+ */
+int compress_encode(const char *src, int len, char *dst, int capacity) {
+    int table[1 << HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    const char *ip = src, *anchor = src, *end = src + len;
+    const char *match_limit = len > MATCH_LIMIT ? end - MATCH_LIMIT : src;
+    char *op = dst, *op_end = dst + capacity;
+    int misses = 0;
+
+    while (ip < match_limit) {
+        uint32_t v = read32(ip);
+        int h = hash32(v);
+        int ref = table[h];
+        table[h] = ip - src;
+        if (ref < 0 || ip - src - ref > MAX_OFFSET || read32(src + ref) != v) {
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+        const char *match = src + ref;
+        const char *p = ip + MIN_MATCH, *q = match + MIN_MATCH;
+        while (p < end - LAST_LITERALS && *p == *q) {
+            p++;
+            q++;
+        }
+
+        int literals = ip - anchor;
+        int match_len = p - ip - MIN_MATCH;
+        if (op_end - op < 1 + length_bytes(literals) + literals + 2 + length_bytes(match_len)) {
+            return 0;
+        }
+        char *token = op++;
+        *token = (literals < 15 ? literals : 15) << 4 | (match_len < 15 ? match_len : 15);
+        if (literals >= 15) {
+            op = put_length(op, literals);
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+        int offset = ip - match;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (match_len >= 15) {
+            op = put_length(op, match_len);
+        }
+        ip = anchor = p;
+    }
+
+    // The last sequence has only literals
+    int literals = end - anchor;
+    if (op_end - op < 1 + length_bytes(literals) + literals) {
+        return 0;
+    }
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+        op = put_length(op, literals);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+// Read the bytes of a length field past the token, adding them to *len; 0 on success, -1 if src ends.
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * Decompress data in the LZ4 block format.
+ *
+ * @param src Compressed data.
+ * @param len Length of the compressed data.
+ * @param dst Buffer for the data.
+ * @param capacity Size of dst.
+ *
+ * @return Length of the data, or -EIO if src is not valid or does not fit in capacity bytes.
+ */
+int compress_decode(const char *src, int len, char *dst, int capacity) {
+    const uint8_t *ip = (const uint8_t *)src, *end = ip + len;
+    char *op = dst, *op_end = dst + capacity;
+    while (ip < end) {
+        int token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && get_length(&ip, end, &literals) < 0) {
+            return -EIO;
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) {
+            return -EIO;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -EIO;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, end, &match_len) < 0) {
+            return -EIO;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(op_end - op)) {
+            return -EIO;
+        }
+        const char *match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+        } else {
+            // The match overlaps what it produces, repeating the last offset bytes
+            for (size_t i = 0; i < match_len; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += match_len;
+    }
+    return op - dst;
+}
+
+// Number of slots of the cluster cache for the block size.
+static int cache_slots() {
+    int slots = CACHE_BYTES / COMPRESS_CLUSTER_SIZE;
+    return slots < 4 ? 4 : slots > CACHE_MAX_SLOTS ? CACHE_MAX_SLOTS : slots;
+}
+
+// Copy a cached cluster to buf; 1 if it was cached, 0 if not.
+static int cache_get(int bnum, int mapped, char *buf) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < cache_slots(); i++) {
+        if (cache[i].mapped == mapped && cache[i].bnum == bnum) {
+            memcpy(buf, cache[i].data, COMPRESS_CLUSTER_SIZE);
+            cache[i].used = ++cache_clock;
+            pthread_mutex_unlock(&cache_lock);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// Cache the data of a cluster, replacing its old entry or the least recently used one; NULL data only drops it.
+static void cache_put(int bnum, int mapped, const char *data) {
+    pthread_mutex_lock(&cache_lock);
+    int victim = -1;
+    for (int i = 0; i < cache_slots(); i++) {
+        if (cache[i].bnum == bnum && cache[i].mapped) {
+            cache[i].mapped = 0;
+            victim = i;
+            break;
+        }
+        if (victim < 0 || cache[i].used < cache[victim].used) {
+            victim = i;
+        }
+    }
+    cache_slot_t *slot = &cache[victim];
+    if (data && !slot->data) {
+        slot->data = malloc(COMPRESS_CLUSTER_SIZE);
+    }
+    if (data && slot->data) {
+        memcpy(slot->data, data, COMPRESS_CLUSTER_SIZE);
+        slot->bnum = bnum;
+        slot->mapped = mapped;
+        slot->used = ++cache_clock;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Number of blocks mapped from the start of a cluster on, and their disk blocks.
+static int cluster_map(inode_t *node, int cluster, int *bnums) {
+    int mapped = 0;
+    while (mapped < COMPRESS_CLUSTER_BLOCKS) {
+        bnums[mapped] = inode_get_bnum(node, cluster * COMPRESS_CLUSTER_BLOCKS + mapped);
+        if (bnums[mapped] < 0) {
+            break;
+        }
+        mapped++;
+    }
+    return mapped;
+}
+
+// Copy blocks of the image to or from a buffer; 0 on success, -EIO if a block could not be read.
+static int cluster_copy(const int *bnums, int count, char *buf, const char *data) {
+    for (int b = 0; b < count; b++) {
+        char *block = data ? blocks_overwrite_block(bnums[b]) : blocks_get_block(bnums[b]);
+        if (!block) {
+            LOG_ERROR("compress: failed to get block %d\n", bnums[b]);
+            return -EIO;
+        }
+        if (data) {
+            memcpy(block, data + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+            blocks_dirty(bnums[b]);
+        } else {
+            memcpy(buf + (size_t)b * BLOCK_SIZE, block, BLOCK_SIZE);
+        }
+        blocks_put_block(block);
+    }
+    return 0;
+}
+
+/**
+ * Read a cluster of a compressed file.
+ *
+ * @param node Pointer to the inode, with INODE_COMPRESSED set.
+ * @param cluster Index of the cluster within the file.
+ * @param buf Receives the data, COMPRESS_CLUSTER_SIZE bytes.
+ *
+ * @return 0 on success, or -EIO if a block could not be read or does not decompress.
+ */
+int compress_read_cluster(inode_t *node, int cluster, char *buf) {
+    int bnums[COMPRESS_CLUSTER_BLOCKS];
+    int mapped = cluster_map(node, cluster, bnums);
+    if (mapped == 0) {
+        memset(buf, 0, COMPRESS_CLUSTER_SIZE);
+        return 0;
+    }
+    if (mapped == COMPRESS_CLUSTER_BLOCKS) {
+        return cluster_copy(bnums, mapped, buf, NULL);
+    }
+    if (cache_get(bnums[0], mapped, buf)) {
+        return 0;
+    }
+
+    char *packed = malloc((size_t)mapped * BLOCK_SIZE);
+    if (!packed) {
+        return -EIO;
+    }
+    int rv = cluster_copy(bnums, mapped, packed, NULL);
+    if (rv == 0) {
+        uint32_t len = read32(packed);
+        if (len > (uint32_t)(mapped * BLOCK_SIZE - HEADER_SIZE) ||
+            compress_decode(packed + HEADER_SIZE, len, buf, COMPRESS_CLUSTER_SIZE) != COMPRESS_CLUSTER_SIZE) {
+            LOG_ERROR("compress: cluster %d of inode %d at block %d does not decompress\n",
+                      cluster, inode_get_inum(node), bnums[0]);
+            rv = -EIO;
+        }
+    }
+    free(packed);
+    if (rv == 0) {
+        cache_put(bnums[0], mapped, buf);
+    }
+    return rv;
+}
+
+/**
+ * Write a cluster of a compressed file, replacing its blocks if it needs a
+ * different number of them or shares them with other files. A cluster of
+ * zeros becomes a hole.
+ *
+ * @param node Pointer to the inode, with INODE_COMPRESSED set.
+ * @param cluster Index of the cluster within the file.
+ * @param buf The data, COMPRESS_CLUSTER_SIZE bytes.
+ *
+ * @return 0 on success, -ENOSPC with the cluster left as it was, or -EIO.
+ */
+int compress_write_cluster(inode_t *node, int cluster, const char *buf) {
+    int first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    int zeros = buf[0] == 0 && memcmp(buf, buf + 1, COMPRESS_CLUSTER_SIZE - 1) == 0;
+    if (zeros) {
+        return inode_free_range(node, first, COMPRESS_CLUSTER_BLOCKS);
+    }
+
+    // A cluster is stored compressed only if that saves at least a block
+    char *packed = calloc(COMPRESS_CLUSTER_BLOCKS - 1, BLOCK_SIZE);
+    if (!packed) {
+        return -EIO;
+    }
+    uint32_t len = compress_encode(buf, COMPRESS_CLUSTER_SIZE, packed + HEADER_SIZE,
+                                   (COMPRESS_CLUSTER_BLOCKS - 1) * BLOCK_SIZE - HEADER_SIZE);
+    memcpy(packed, &len, sizeof(len));
+    int want = len ? (HEADER_SIZE + len + BLOCK_SIZE - 1) / BLOCK_SIZE : COMPRESS_CLUSTER_BLOCKS;
+
+    // Blocks of the right number that only this file uses are overwritten in place
+    int bnums[COMPRESS_CLUSTER_BLOCKS];
+    int mapped = cluster_map(node, cluster, bnums);
+    int in_place = mapped == want;
+    for (int b = 0; in_place && b < mapped; b++) {
+        in_place = !blocks_shared(bnums[b]);
+    }
+    int rv = in_place ? 0 : inode_replace_range(node, first, COMPRESS_CLUSTER_BLOCKS, want);
+    if (rv == 0 && !in_place) {
+        cluster_map(node, cluster, bnums);
+    }
+    if (rv == 0) {
+        rv = cluster_copy(bnums, want, NULL, len ? packed : buf);
+    }
+    if (rv != -ENOSPC) {
+        cache_put(bnums[0], want, rv == 0 && len ? buf : NULL);
+    }
+    free(packed);
+    TRACE("compress: cluster %d of inode %d written to %d blocks at %d\n", cluster, inode_get_inum(node), want, bnums[0]);
+    return rv;
+}
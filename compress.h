@@ -0,0 +1,73 @@
+// Transparent compression of file data, in clusters of COMPRESS_CLUSTER_BLOCKS blocks.
+//
+// A file with INODE_COMPRESSED set divides its block indexes into clusters and
+// stores the data of each cluster in the first blocks of the cluster's own
+// range: a cluster with no block mapped is a hole, one with all of its blocks
+// mapped holds its data as is (it did not compress), and one with fewer holds
+// a compressed copy, a 32-bit length followed by the data in the LZ4 block
+// format. Clusters are read and written whole, so a write to part of one
+// decompresses it first. The data of recently decompressed clusters is kept
+// in a small cache, so reads that go through a cluster in small pieces
+// decompress it only once.
+//
+// Each compressed cluster is an extent of its own in the block map, so a
+// compressed file holds at most as many of them as a file has extents.
+//
+// The cluster functions do not take the inode's lock; their callers hold it.
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+#define COMPRESS_CLUSTER_BLOCKS 16 // Blocks per cluster
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE) // Bytes of file data per cluster
+
+/**
+ * Compress data into the LZ4 block format.
+ *
+ * @param src Data to compress.
+ * @param len Length of the data.
+ * @param dst Buffer for the compressed data.
+ * @param capacity Size of dst.
+ *
+ * @return Length of the compressed data, or 0 if it does not fit in capacity bytes.
+ */
+int compress_encode(const char *src, int len, char *dst, int capacity);
+
+/**
+ * Decompress data in the LZ4 block format.
+ *
+ * @param src Compressed data.
+ * @param len Length of the compressed data.
+ * @param dst Buffer for the data.
+ * @param capacity Size of dst.
+ *
+ * @return Length of the data, or -EIO if src is not valid or does not fit in capacity bytes.
+ */
+int compress_decode(const char *src, int len, char *dst, int capacity);
+
+/**
+ * Read a cluster of a compressed file.
+ *
+ * @param node Pointer to the inode, with INODE_COMPRESSED set.
+ * @param cluster Index of the cluster within the file.
+ * @param buf Receives the data, COMPRESS_CLUSTER_SIZE bytes.
+ *
+ * @return 0 on success, or -EIO if a block could not be read or does not decompress.
+ */
+int compress_read_cluster(inode_t *node, int cluster, char *buf);
+
+/**
+ * Write a cluster of a compressed file, replacing its blocks if it needs a
+ * different number of them or shares them with other files. A cluster of
+ * zeros becomes a hole.
+ *
+ * @param node Pointer to the inode, with INODE_COMPRESSED set.
+ * @param cluster Index of the cluster within the file.
+ * @param buf The data, COMPRESS_CLUSTER_SIZE bytes.
+ *
+ * @return 0 on success, -ENOSPC with the cluster left as it was, or -EIO.
+ */
+int compress_write_cluster(inode_t *node, int cluster, const char *buf);
+
+#endif
@@ -0,0 +1,127 @@
+// Implements the directory lookup cache as a direct-mapped table of (parent inode, name) pairs. Slots are protected
+// by a set of striped locks, so lookups in different slots do not contend.
+
+// necessary libraries
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "dcache.h"
+#include "directory.h"
+
+#define DCACHE_LOCKS 64 // Stripes of slot locks.
+
+typedef struct {
+    uint32_t hash;
+    int parent;       // Inode number of the directory; -1 marks an empty slot
+    int result;       // Inode number or -ENOENT
+    int len;          // Length of the name
+    char name[DIR_NAME_LENGTH];
+} dcache_entry_t;
+
+static dcache_entry_t entries[DCACHE_ENTRIES];
+static pthread_mutex_t locks[DCACHE_LOCKS];
+
+// FNV-1a hash of a name in a directory.
+static uint32_t name_hash(int parent, const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 4; i++) {
+        hash ^= (uint8_t)(parent >> (8 * i));
+        hash *= 16777619u;
+    }
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Set up the cache, or empty it.
+ */
+void dcache_init() {
+    static int locks_ready = 0;
+    if (!locks_ready) {
+        for (int i = 0; i < DCACHE_LOCKS; i++) {
+            pthread_mutex_init(&locks[i], NULL);
+        }
+        locks_ready = 1;
+    }
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        entries[i].parent = -1;
+    }
+}
+
+/**
+ * Look up a name in the cache.
+ *
+ * @param parent Inode number of the directory.
+ * @param name The name, not necessarily NUL-terminated at len.
+ * @param len Length of the name, less than DIR_NAME_LENGTH.
+ * @param result Receives the cached inode number or -ENOENT.
+ *
+ * @return 1 if the name was cached, 0 otherwise.
+ */
+int dcache_lookup(int parent, const char *name, size_t len, int *result) {
+    uint32_t hash = name_hash(parent, name, len);
+    int slot = hash & (DCACHE_ENTRIES - 1);
+    dcache_entry_t *entry = &entries[slot];
+
+    pthread_mutex_t *lock = &locks[slot % DCACHE_LOCKS];
+    pthread_mutex_lock(lock);
+    int hit = entry->parent == parent && entry->hash == hash && entry->len == (int)len &&
+              memcmp(entry->name, name, len) == 0;
+    if (hit) {
+        *result = entry->result;
+    }
+    pthread_mutex_unlock(lock);
+    return hit;
+}
+
+/**
+ * Remember what a name in a directory resolved to, replacing whatever its slot held.
+ *
+ * @param parent Inode number of the directory.
+ * @param name The name, not necessarily NUL-terminated at len.
+ * @param len Length of the name, less than DIR_NAME_LENGTH.
+ * @param result Inode number the name refers to, or -ENOENT.
+ */
+void dcache_insert(int parent, const char *name, size_t len, int result) {
+    if (len >= DIR_NAME_LENGTH) {
+        return;
+    }
+    uint32_t hash = name_hash(parent, name, len);
+    int slot = hash & (DCACHE_ENTRIES - 1);
+    dcache_entry_t *entry = &entries[slot];
+
+    pthread_mutex_t *lock = &locks[slot % DCACHE_LOCKS];
+    pthread_mutex_lock(lock);
+    entry->hash = hash;
+    entry->parent = parent;
+    entry->result = result;
+    entry->len = len;
+    memcpy(entry->name, name, len);
+    pthread_mutex_unlock(lock);
+}
+
+/**
+ * Forget a name in a directory, after adding or removing its entry.
+ * Called with no lookups running.
+ *
+ * @param parent Inode number of the directory.
+ * @param name The name, NUL-terminated.
+ */
+void dcache_forget(int parent, const char *name) {
+    size_t len = strlen(name);
+    uint32_t hash = name_hash(parent, name, len);
+    int slot = hash & (DCACHE_ENTRIES - 1);
+    dcache_entry_t *entry = &entries[slot];
+
+    pthread_mutex_t *lock = &locks[slot % DCACHE_LOCKS];
+    pthread_mutex_lock(lock);
+    if (entry->parent == parent && entry->hash == hash && entry->len == (int)len &&
+        memcmp(entry->name, name, len) == 0) {
+        entry->parent = -1;
+    }
+    pthread_mutex_unlock(lock);
+}
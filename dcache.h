@@ -0,0 +1,56 @@
+// A cache of directory lookups.
+//
+// Maps a name in a directory, as a (parent inode, name) pair, to the inode it
+// names, so the components of a path that is resolved again (build tools stat
+// the same include paths over and over, most of which do not exist) are
+// answered without probing the directory index. Failed lookups are cached as
+// negative entries.
+//
+// A change to a directory makes only the entries for the names it adds or
+// removes wrong, and those are forgotten one by one with dcache_forget(). All
+// functions are thread safe; callers serialize forgetting against lookups
+// (see namespace_lock in nufs.c).
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+
+#define DCACHE_ENTRIES 4096 // Slots in the cache, a power of two.
+
+/**
+ * Set up the cache, or empty it.
+ */
+void dcache_init();
+
+/**
+ * Look up a name in the cache.
+ *
+ * @param parent Inode number of the directory.
+ * @param name The name, not necessarily NUL-terminated at len.
+ * @param len Length of the name, less than DIR_NAME_LENGTH.
+ * @param result Receives the cached inode number or -ENOENT.
+ *
+ * @return 1 if the name was cached, 0 otherwise.
+ */
+int dcache_lookup(int parent, const char *name, size_t len, int *result);
+
+/**
+ * Remember what a name in a directory resolved to, replacing whatever its slot held.
+ *
+ * @param parent Inode number of the directory.
+ * @param name The name, not necessarily NUL-terminated at len.
+ * @param len Length of the name, less than DIR_NAME_LENGTH.
+ * @param result Inode number the name refers to, or -ENOENT.
+ */
+void dcache_insert(int parent, const char *name, size_t len, int result);
+
+/**
+ * Forget a name in a directory, after adding or removing its entry.
+ * Called with no lookups running.
+ *
+ * @param parent Inode number of the directory.
+ * @param name The name, NUL-terminated.
+ */
+void dcache_forget(int parent, const char *name);
+
+#endif
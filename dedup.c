@@ -0,0 +1,211 @@
+// Implements the deduplication index as a direct-mapped table of block hashes, sized by the image and protected by a
+// set of striped locks like the path resolution cache. Blocks are hashed with XXH64, which reads 32 bytes per round
+// in four independent lanes and so runs at memory speed; its words are read in the machine's byte order, which only
+// matters within a mount, since the index is never stored.
+
+// necessary libraries
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "blocks.h"
+#include "dedup.h"
+#include "inode.h"
+#include "log.h"
+
+#define DEDUP_LOCKS 64 // Stripes of slot locks.
+
+// XXH64 primes.
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+typedef struct {
+    uint64_t hash;
+    int bnum;       // Block the data was written to; 0 marks an empty slot
+    int inum;       // File it was written to
+    int file_block; // Index of the block within that file
+} dedup_entry_t;
+
+static dedup_entry_t *entries = NULL;
+static int entry_mask = 0; // Number of slots minus one, a power of two less one
+static pthread_mutex_t locks[DEDUP_LOCKS];
+
+/**
+ * Set up the index for the mounted image, or empty it.
+ *
+ * @param block_count Number of blocks of the image.
+ */
+void dedup_init(int block_count) {
+    static int locks_ready = 0;
+    if (!locks_ready) {
+        for (int i = 0; i < DEDUP_LOCKS; i++) {
+            pthread_mutex_init(&locks[i], NULL);
+        }
+        locks_ready = 1;
+    }
+    int slots = DEDUP_LOCKS;
+    while (slots < block_count && slots < DEDUP_MAX_ENTRIES) {
+        slots *= 2;
+    }
+    free(entries);
+    entries = calloc(slots, sizeof(dedup_entry_t));
+    if (!entries) {
+        LOG_ERROR("dedup_init: no memory for %d index slots, deduplication is off\n", slots);
+        return;
+    }
+    entry_mask = slots - 1;
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// One XXH64 round: mix an input word into a lane.
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+// Fold a lane into the hash after the last round.
+static uint64_t xxh_merge(uint64_t hash, uint64_t lane) {
+    hash ^= xxh_round(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+// XXH64 of len bytes, with seed 0.
+static uint64_t xxh64(const void *data, size_t len) {
+    const unsigned char *p = data, *end = p + len;
+    uint64_t hash;
+    if (len >= 32) {
+        uint64_t v1 = PRIME1 + PRIME2, v2 = PRIME2, v3 = 0, v4 = -PRIME1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+        }
+        hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        hash = xxh_merge(hash, v1);
+        hash = xxh_merge(hash, v2);
+        hash = xxh_merge(hash, v3);
+        hash = xxh_merge(hash, v4);
+    } else {
+        hash = PRIME5;
+    }
+    hash += len;
+
+    for (; p + 8 <= end; p += 8) {
+        hash ^= xxh_round(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        hash ^= v * PRIME1;
+        hash = rotl64(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * PRIME5;
+        hash = rotl64(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Hash the data of a block with XXH64.
+ *
+ * @param data BLOCK_SIZE bytes of data.
+ *
+ * @return The hash of the data.
+ */
+uint64_t dedup_hash(const void *data) {
+    return xxh64(data, BLOCK_SIZE);
+}
+
+/**
+ * Map a block of a file to a block that already holds the same data, if the
+ * index knows one. The file's lock is held exclusively by the caller; that of
+ * the file the other block was written to is taken only if it is free.
+ *
+ * @param node Pointer to the inode of a regular file without INODE_INLINE or INODE_COMPRESSED.
+ * @param file_bnum Index of the block within the file.
+ * @param data The data about to be written to the block, BLOCK_SIZE bytes.
+ * @param hash dedup_hash() of the data.
+ *
+ * @return 1 if the block now holds the data, 0 if the caller has to write it.
+ */
+int dedup_write_block(inode_t *node, int file_bnum, const void *data, uint64_t hash) {
+    if (!entries) {
+        return 0;
+    }
+    int slot = hash & entry_mask;
+    pthread_mutex_t *lock = &locks[slot % DEDUP_LOCKS];
+    pthread_mutex_lock(lock);
+    dedup_entry_t e = entries[slot];
+    pthread_mutex_unlock(lock);
+    if (e.bnum == 0 || e.hash != hash) {
+        return 0;
+    }
+
+    // While the other file is locked and maps the block, only a write to a
+    // shared block could change it, and that copies the block first
+    inode_t *owner = get_inode(e.inum);
+    int locked = owner != node;
+    if (!owner || (locked && !inode_tryrdlock(owner))) {
+        return 0;
+    }
+    int found = 0;
+    if (inode_in_use(e.inum) && S_ISREG(owner->mode) && !(owner->flags & (INODE_INLINE | INODE_COMPRESSED)) &&
+        inode_get_bnum(owner, e.file_block) == e.bnum) {
+        void *block = blocks_get_block(e.bnum);
+        if (block && memcmp(block, data, BLOCK_SIZE) == 0) {
+            found = inode_get_bnum(node, file_bnum) == e.bnum || inode_share_block(node, file_bnum, e.bnum) == 0;
+        }
+        blocks_put_block(block);
+    }
+    if (locked) {
+        inode_unlock(owner);
+    }
+    if (found) {
+        TRACE("dedup_write_block: block %d of inode %d has the data of block %d\n",
+              file_bnum, inode_get_inum(node), e.bnum);
+    }
+    return found;
+}
+
+/**
+ * Remember that a block of a file was just written with the given data.
+ *
+ * @param hash dedup_hash() of the data.
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ * @param bnum The disk block the data went to.
+ */
+void dedup_insert(uint64_t hash, inode_t *node, int file_bnum, int bnum) {
+    if (!entries) {
+        return;
+    }
+    int slot = hash & entry_mask;
+    pthread_mutex_t *lock = &locks[slot % DEDUP_LOCKS];
+    pthread_mutex_lock(lock);
+    entries[slot] = (dedup_entry_t){ .hash = hash, .bnum = bnum, .inum = inode_get_inum(node), .file_block = file_bnum };
+    pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,64 @@
+// Deduplication of file data blocks by content.
+//
+// An index maps the hash of a block's data to a block that was written with
+// that data, and to the file block that maps it. A write of a whole block
+// looks its data up first: if a block with the same data exists, the file is
+// mapped to it with one more reference (see inode_share_block()) instead of
+// getting a block of its own, so the data is neither written nor stored twice.
+// Later writes to either file copy the shared block first, as for clones.
+//
+// The index is a direct-mapped table in memory: a block that hashes to the
+// slot of another replaces it, and the index starts out empty at every mount,
+// so only data written since the mount is found. Entries are never trusted:
+// before a block is shared, the file it was written to must still map it
+// there and its data must compare equal. All functions are thread safe.
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+#define DEDUP_MAX_ENTRIES (1 << 20) // Largest index, in slots; smaller images get one slot per block
+
+/**
+ * Set up the index for the mounted image, or empty it.
+ *
+ * @param block_count Number of blocks of the image.
+ */
+void dedup_init(int block_count);
+
+/**
+ * Hash the data of a block with XXH64.
+ *
+ * @param data BLOCK_SIZE bytes of data.
+ *
+ * @return The hash of the data.
+ */
+uint64_t dedup_hash(const void *data);
+
+/**
+ * Map a block of a file to a block that already holds the same data, if the
+ * index knows one. The file's lock is held exclusively by the caller; that of
+ * the file the other block was written to is taken only if it is free.
+ *
+ * @param node Pointer to the inode of a regular file without INODE_INLINE or INODE_COMPRESSED.
+ * @param file_bnum Index of the block within the file.
+ * @param data The data about to be written to the block, BLOCK_SIZE bytes.
+ * @param hash dedup_hash() of the data.
+ *
+ * @return 1 if the block now holds the data, 0 if the caller has to write it.
+ */
+int dedup_write_block(inode_t *node, int file_bnum, const void *data, uint64_t hash);
+
+/**
+ * Remember that a block of a file was just written with the given data.
+ *
+ * @param hash dedup_hash() of the data.
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ * @param bnum The disk block the data went to.
+ */
+void dedup_insert(uint64_t hash, inode_t *node, int file_bnum, int bnum);
+
+#endif
@@ -0,0 +1,387 @@
+// Implements directories as arrays of fixed-size entries stored in the directory's data blocks. Every inode has at
+// most one name, so the in-memory index records each inode's parent, name and entry slot, and a hash table keyed on
+// (parent, name) points at those records. Lookups and deletes therefore never scan a directory, and inserts start
+// at a per-directory hint below which no entry is free. A directory's entries are read into the index when it is
+// first used, so mounting does not read any directory.
+
+// necessary libraries
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "directory.h"
+#include "log.h"
+
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(dirent_t))
+
+// Where an inode is named: filled in for every inode that has an entry in an indexed directory.
+typedef struct {
+    int parent; // Directory holding the entry plus one, 0 if the inode has no name (that is known)
+    int slot;   // Index of the entry within the parent's entries
+    char name[DIR_NAME_LENGTH];
+} dir_name_t;
+
+static dir_name_t *names = NULL; // INODE_COUNT records, indexed by inode number
+
+// For each directory, a slot number below which all entries are in use, indexed by inode number.
+static int *free_hint = NULL;
+
+// Whether each directory's entries are in the index, indexed by inode number. Set with release order once they
+// all are, under index_lock, which serializes indexing directories that lookups running in parallel find unindexed.
+static uint8_t *dir_indexed = NULL;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hash index over (parent, name), open addressing with linear probing.
+// Slots hold an inode number + 1; 0 marks an empty slot and -1 a deleted one. Slots are read with acquire order,
+// since indexing a directory fills them while lookups in other directories probe the table.
+#define NAME_INDEX_EMPTY 0
+#define NAME_INDEX_DELETED -1
+
+static int name_index_size = 0; // Power of two of at least 2 * INODE_COUNT, keeps the load factor at or below 1/2.
+static int *name_index = NULL;
+static uint32_t *name_index_hashes = NULL; // Cached hashes, so probes rarely touch names[].
+static int name_index_deleted = 0;         // Number of deleted slots, used to decide when to rebuild.
+
+/**
+ * Hash a (parent, name) pair (32-bit FNV-1a).
+ *
+ * @param parent Inode number of the directory
+ * @param name Entry name
+ * @return Hash value
+ */
+static uint32_t name_hash(int parent, const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < (int)sizeof(parent); i++) {
+        hash ^= (uint8_t)(parent >> (8 * i));
+        hash *= 16777619u;
+    }
+    for (const char *p = name; *p; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the index slot holding the given (parent, name) pair.
+ *
+ * @return Slot number, or -1 if the pair is not indexed
+ */
+static int name_index_find(int parent, const char *name, uint32_t hash) {
+    for (int probe = 0; probe < name_index_size; probe++) {
+        int slot = (hash + probe) & (name_index_size - 1);
+        int entry = __atomic_load_n(&name_index[slot], __ATOMIC_ACQUIRE);
+        if (entry == NAME_INDEX_EMPTY) {
+            return -1;
+        }
+        if (entry == NAME_INDEX_DELETED || name_index_hashes[slot] != hash) {
+            continue;
+        }
+
+        dir_name_t *candidate = &names[entry - 1];
+        if (candidate->parent == parent + 1 && strcmp(candidate->name, name) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static void name_index_add(int inum);
+
+// Rebuild the hash index from names[]. Only while no lookups run.
+static void name_index_build() {
+    memset(name_index, 0, name_index_size * sizeof(int));
+    name_index_deleted = 0;
+    for (int inum = 0; inum < INODE_COUNT; inum++) {
+        if (names[inum].parent > 0) {
+            name_index_add(inum);
+        }
+    }
+}
+
+// Put the name recorded in names[inum] in a free slot of the hash index, publishing the slot last.
+static void name_index_add(int inum) {
+    uint32_t hash = name_hash(names[inum].parent - 1, names[inum].name);
+    for (int probe = 0; probe < name_index_size; probe++) {
+        int slot = (hash + probe) & (name_index_size - 1);
+        if (name_index[slot] == NAME_INDEX_EMPTY || name_index[slot] == NAME_INDEX_DELETED) {
+            if (name_index[slot] == NAME_INDEX_DELETED) {
+                name_index_deleted--;
+            }
+            name_index_hashes[slot] = hash;
+            __atomic_store_n(&name_index[slot], inum + 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    LOG_ERROR("name_index_insert: index full\n");
+}
+
+// Add the name recorded in names[inum] to the hash index, while no lookups run.
+static void name_index_insert(int inum) {
+    // Too many deleted slots make probe chains long; start over with a clean table.
+    if (name_index_deleted > name_index_size / 4) {
+        name_index_build();
+        return;
+    }
+    name_index_add(inum);
+}
+
+// Remove the name recorded in names[inum] from the hash index.
+static void name_index_remove(int inum) {
+    int parent = names[inum].parent - 1;
+    int slot = name_index_find(parent, names[inum].name, name_hash(parent, names[inum].name));
+    if (slot >= 0) {
+        name_index[slot] = NAME_INDEX_DELETED;
+        name_index_deleted++;
+    }
+}
+
+/**
+ * Get a directory entry by its slot number. Release it with dirent_put().
+ *
+ * @param di Pointer to the directory's inode
+ * @param slot Index of the entry
+ * @return Pointer to the entry in the image, or NULL past the end of the directory
+ */
+static dirent_t *dirent_at(inode_t *di, int slot) {
+    int bnum = inode_get_bnum(di, slot / DIRENTS_PER_BLOCK);
+    if (bnum < 0) {
+        return NULL;
+    }
+    blocks_mark_metadata(bnum);
+    dirent_t *entries = blocks_get_block(bnum);
+    assert(entries != NULL);
+    return &entries[slot % DIRENTS_PER_BLOCK];
+}
+
+// Release an entry returned by dirent_at(), given its slot.
+static void dirent_put(dirent_t *entry, int slot) {
+    blocks_put_block(entry - slot % DIRENTS_PER_BLOCK);
+}
+
+/**
+ * Set up an empty name index for the mounted image. Each directory's entries
+ * are added to it when the directory is first used.
+ */
+void directory_init() {
+    free(names);
+    free(free_hint);
+    free(dir_indexed);
+    // Zeroed allocations are mapped lazily, so mounting touches none of their pages
+    names = calloc(INODE_COUNT, sizeof(dir_name_t));
+    free_hint = calloc(INODE_COUNT, sizeof(int));
+    dir_indexed = calloc(INODE_COUNT, 1);
+    assert(names && free_hint && dir_indexed);
+
+    name_index_size = 1;
+    while (name_index_size < 2 * INODE_COUNT) {
+        name_index_size *= 2;
+    }
+    free(name_index);
+    free(name_index_hashes);
+    name_index = calloc(name_index_size, sizeof(int));
+    name_index_hashes = malloc(name_index_size * sizeof(uint32_t));
+    assert(name_index && name_index_hashes);
+    name_index_deleted = 0;
+}
+
+// Add the entries of a directory to the index, unless they are in it already. Lookups may run meanwhile.
+static void directory_index(inode_t *di) {
+    int dir = inode_get_inum(di);
+    if (__atomic_load_n(&dir_indexed[dir], __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&index_lock);
+    if (!dir_indexed[dir]) {
+        int slots = di->block_count * DIRENTS_PER_BLOCK;
+        int hint = 0;
+        for (int slot = 0; slot < slots; slot++) {
+            dirent_t entry;
+            slot = directory_next(di, slot, &entry);
+            if (slot < 0) {
+                break;
+            }
+            if (slot == hint) {
+                hint++;
+            }
+            if (!inode_in_use(entry.inum)) {
+                continue;
+            }
+            names[entry.inum].parent = dir + 1;
+            names[entry.inum].slot = slot;
+            strncpy(names[entry.inum].name, entry.name, DIR_NAME_LENGTH - 1);
+            names[entry.inum].name[DIR_NAME_LENGTH - 1] = '\0';
+            name_index_add(entry.inum);
+        }
+        free_hint[dir] = hint;
+        __atomic_store_n(&dir_indexed[dir], 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+/**
+ * Look up a name in a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name of the entry.
+ *
+ * @return The inode number of the entry, or -ENOENT.
+ */
+int directory_lookup(inode_t *di, const char *name) {
+    directory_index(di);
+    int slot = name_index_find(inode_get_inum(di), name, name_hash(inode_get_inum(di), name));
+    if (slot < 0) {
+        return -ENOENT;
+    }
+    return name_index[slot] - 1;
+}
+
+/**
+ * Add an entry to a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name of the new entry.
+ * @param inum Inode number the entry refers to.
+ *
+ * @return 0 on success, -ENAMETOOLONG or -ENOSPC on failure.
+ */
+int directory_put(inode_t *di, const char *name, int inum) {
+    if (strlen(name) >= DIR_NAME_LENGTH) {
+        LOG_DEBUG("directory_put: name %s is too long\n", name);
+        return -ENAMETOOLONG;
+    }
+
+    // Reuse the first free entry, or grow the directory by a block
+    directory_index(di);
+    int dir = inode_get_inum(di);
+    int slots = di->block_count * DIRENTS_PER_BLOCK;
+    int slot = free_hint[dir];
+    dirent_t *entry = NULL;
+    for (; slot < slots; slot++) {
+        entry = dirent_at(di, slot);
+        if (entry->name[0] == '\0') {
+            break;
+        }
+        dirent_put(entry, slot);
+    }
+    if (slot == slots) {
+        int bnum = inode_add_block(di);
+        if (bnum < 0) {
+            return -ENOSPC;
+        }
+        // New blocks are not cleared by the allocator, and an empty name marks a free entry
+        blocks_mark_metadata(bnum);
+        void *block = blocks_overwrite_block(bnum);
+        if (!block) {
+            return -EIO;
+        }
+        memset(block, 0, BLOCK_SIZE);
+        metadata_dirty(block, BLOCK_SIZE);
+        blocks_put_block(block);
+        di->size += BLOCK_SIZE;
+        entry = dirent_at(di, slot);
+    }
+
+    memset(entry, 0, sizeof(dirent_t));
+    strcpy(entry->name, name);
+    entry->inum = inum;
+    metadata_dirty(entry, sizeof(dirent_t));
+    dirent_put(entry, slot);
+
+    names[inum].parent = dir + 1;
+    names[inum].slot = slot;
+    strcpy(names[inum].name, name);
+    name_index_insert(inum);
+    free_hint[dir] = slot + 1;
+
+    time_t now = time(NULL);
+    di->mtime = di->ctime = now;
+    inode_dirty(di);
+    return 0;
+}
+
+/**
+ * Remove an entry from a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name of the entry.
+ *
+ * @return 0 on success, -ENOENT if there is no such entry.
+ */
+int directory_delete(inode_t *di, const char *name) {
+    int inum = directory_lookup(di, name);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+
+    int slot = names[inum].slot;
+    dirent_t *entry = dirent_at(di, slot);
+    memset(entry, 0, sizeof(dirent_t));
+    metadata_dirty(entry, sizeof(dirent_t));
+    dirent_put(entry, slot);
+    if (slot < free_hint[inode_get_inum(di)]) {
+        free_hint[inode_get_inum(di)] = slot;
+    }
+
+    name_index_remove(inum);
+    names[inum].parent = 0;
+
+    time_t now = time(NULL);
+    di->mtime = di->ctime = now;
+    inode_dirty(di);
+    return 0;
+}
+
+/**
+ * Find the next entry in use in a directory, for listing it in slot order.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot to start the search at.
+ * @param entry Receives a copy of the entry.
+ *
+ * @return The slot of the first entry in use at or after slot, or -1 if there is none.
+ */
+int directory_next(inode_t *di, int slot, dirent_t *entry) {
+    int slots = di->block_count * DIRENTS_PER_BLOCK;
+    dirent_t *entries = NULL;
+    for (; slot < slots; slot++) {
+        // Get each block once instead of once per entry
+        if (!entries || slot % DIRENTS_PER_BLOCK == 0) {
+            blocks_put_block(entries);
+            entries = blocks_get_block(inode_get_bnum(di, slot / DIRENTS_PER_BLOCK));
+            if (!entries) {
+                return -1;
+            }
+        }
+        dirent_t *candidate = &entries[slot % DIRENTS_PER_BLOCK];
+        if (candidate->name[0] != '\0') {
+            *entry = *candidate;
+            blocks_put_block(entries);
+            return slot;
+        }
+    }
+    blocks_put_block(entries);
+    return -1;
+}
+
+/**
+ * Get the directory that holds the entry for an inode. Known once that
+ * directory has been used since the mount, as every directory on a path that
+ * was looked up has.
+ *
+ * @param inum Inode number.
+ *
+ * @return The inode number of the parent directory, or -1 for the root or an
+ *         inode without a known name.
+ */
+int directory_parent(int inum) {
+    if (inum < 0 || inum >= INODE_COUNT) {
+        return -1;
+    }
+    return names[inum].parent - 1;
+}
@@ -0,0 +1,91 @@
+// Directory manipulation functions.
+//
+// A directory's data blocks hold an array of fixed-size directory entries.
+// An in-memory index maps (directory, name) pairs to inode numbers, so a
+// lookup does not scan the directory. A directory is read into the index the
+// first time it is used.
+//
+// None of these functions lock: callers serialize changes to directories and
+// the index against lookups (see namespace_lock in nufs.c). Lookups may run in
+// parallel, even when they index directories.
+
+// Based on cs3650 starter code
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#define DIR_NAME_LENGTH 48
+#define ROOT_INUM 0 // Inode number of the root directory
+
+#include "blocks.h"
+#include "inode.h"
+
+typedef struct nufs_dirent {
+  char name[DIR_NAME_LENGTH]; // NUL-terminated; an empty name marks a free entry
+  int inum;
+  char _reserved[12];
+} dirent_t;
+
+/**
+ * Set up an empty name index for the mounted image. Each directory's entries
+ * are added to it when the directory is first used.
+ */
+void directory_init();
+
+/**
+ * Look up a name in a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name of the entry.
+ *
+ * @return The inode number of the entry, or -ENOENT.
+ */
+int directory_lookup(inode_t *di, const char *name);
+
+/**
+ * Add an entry to a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name of the new entry.
+ * @param inum Inode number the entry refers to.
+ *
+ * @return 0 on success, -ENAMETOOLONG or -ENOSPC on failure.
+ */
+int directory_put(inode_t *di, const char *name, int inum);
+
+/**
+ * Remove an entry from a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name of the entry.
+ *
+ * @return 0 on success, -ENOENT if there is no such entry.
+ */
+int directory_delete(inode_t *di, const char *name);
+
+/**
+ * Find the next entry in use in a directory, for listing it in slot order.
+ *
+ * Slot numbers of existing entries do not change when other entries are
+ * added or removed, so they can serve as readdir offsets.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot to start the search at.
+ * @param entry Receives a copy of the entry.
+ *
+ * @return The slot of the first entry in use at or after slot, or -1 if there is none.
+ */
+int directory_next(inode_t *di, int slot, dirent_t *entry);
+
+/**
+ * Get the directory that holds the entry for an inode. Known once that
+ * directory has been used since the mount, as every directory on a path that
+ * was looked up has.
+ *
+ * @param inum Inode number.
+ *
+ * @return The inode number of the parent directory, or -1 for the root or an
+ *         inode without a known name.
+ */
+int directory_parent(int inum);
+
+#endif
@@ -6,7 +6,8 @@
 #define TEST_NAME "block_test.img"
 
 int main(int argc, char **argv) {
-  blocks_init(TEST_NAME);
+  blocks_geometry_t geometry = {.inode_size = 64};
+  blocks_init(TEST_NAME, &geometry);
 
   printf("Block bitmap at the beginning:\n");
   bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
@@ -30,6 +31,7 @@ int main(int argc, char **argv) {
   }
   putchar('\n');
 
+  blocks_put_block(block);
   blocks_free();
 
   return 0;
@@ -0,0 +1,954 @@
+// Manages the inode table: loading it into memory a block at a time on first use, writing changed inodes back incrementally, allocating and
+// freeing inodes through the inode bitmap and an in-memory stack of free inode numbers, and mapping file blocks to disk blocks through extents: runs of
+// contiguous blocks, the first few stored in the inode and the rest in a single extent block. Extents may leave gaps: file
+// blocks no extent maps are holes, which read as zeros and take no space. Files can share data blocks, which are
+// reference counted by blocks.c and copied on write. New regular files start
+// out with their data inline in the inode and get a block map once they outgrow it.
+
+// necessary libraries
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "bitmap.h"
+#include "blocks.h"
+#include "inode.h"
+#include "journal.h"
+#include "log.h"
+#include "stats.h"
+
+static inode_t *inodes = NULL; // INODE_COUNT slots, allocated by load_inodes() and filled from the table on first use.
+
+// Whether each block of the inode table has been copied into inodes[], one byte per block. Set with release order
+// once the copy is complete, under load_lock, so get_inode() can test it without taking the lock.
+static uint8_t *block_loaded = NULL;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Inodes not yet written back to the inode table by save_inodes(), one bit per slot.
+// Set atomically, since inodes sharing a byte can be changed by different threads.
+static uint8_t *inode_dirty_bits = NULL;
+
+static pthread_rwlock_t *inode_locks = NULL; // One reader/writer lock per inode slot, set up with its block.
+
+// Stack of the inode numbers freed since the mount, most recent on top, and the lowest inode number that may be
+// free in the inode bitmap without being on the stack. alloc_inode() pops the stack, or else searches the bitmap
+// from the cursor, so neither it nor free_inode() scans the whole bitmap.
+static int *free_inums = NULL;
+static int free_inum_count = 0;
+static int free_cursor = 0;
+static int free_total = 0; // Inodes free in the bitmap
+
+// Number of extents that fit in the extent block.
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(extent_t))
+
+/**
+ * Load the inode table of the mounted image into memory.
+ *
+ * Only sets up the in-memory table: each block of the on-disk table is copied
+ * in when get_inode() first asks for one of its inodes, so mounting does not
+ * depend on the size of the table.
+ */
+void load_inodes() {
+    free(inodes);
+    free(block_loaded);
+    free(inode_dirty_bits);
+    free(inode_locks);
+    free(free_inums);
+    // Large zeroed allocations are mapped lazily, so pages of slots never used cost nothing
+    inodes = calloc(INODE_COUNT, sizeof(inode_t));
+    block_loaded = calloc(LAST_INODE_BLOCK - FIRST_INODE_BLOCK + 1, 1);
+    inode_dirty_bits = calloc((INODE_COUNT + 7) / 8, 1);
+    inode_locks = calloc(INODE_COUNT, sizeof(pthread_rwlock_t));
+    free_inums = malloc(INODE_COUNT * sizeof(int));
+    assert(inodes && block_loaded && inode_dirty_bits && inode_locks && free_inums);
+
+    free_inum_count = 0;
+    free_cursor = 0;
+    free_total = INODE_COUNT - bitmap_count(get_inode_bitmap(), INODE_COUNT);
+
+    LOG_INFO("Mounted an inode table of %d slots, %d free.\n", INODE_COUNT, free_total);
+}
+
+// Copy a block of the inode table into inodes[] and set up the locks of its slots, unless that is done already.
+static void inode_load_block(int index) {
+    pthread_mutex_lock(&load_lock);
+    if (!block_loaded[index]) {
+        int first = index * INODES_PER_BLOCK;
+        int count = INODE_COUNT - first < (int)INODES_PER_BLOCK ? INODE_COUNT - first : (int)INODES_PER_BLOCK;
+        void *b = blocks_get_block(FIRST_INODE_BLOCK + index);
+        if (b) {
+            memcpy(&inodes[first], b, count * sizeof(inode_t));
+            blocks_put_block(b);
+        } else {
+            LOG_ERROR("load_inodes: Failed to access inode block %d\n", FIRST_INODE_BLOCK + index);
+        }
+        for (int i = first; i < first + count; i++) {
+            pthread_rwlock_init(&inode_locks[i], NULL);
+        }
+        __atomic_store_n(&block_loaded[index], 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&load_lock);
+}
+
+/**
+ * Write the inodes changed since the last call back to the inode table and
+ * sync the changed blocks. Resets the journal afterwards. This writes the
+ * metadata home in place, so call it only when everything logged has been
+ * committed (see journal_commit()).
+ */
+void save_inodes() {
+    uint64_t start = stats_now();
+    // Copy the dirty inodes into their slots, marking the inode blocks they live in
+    int written = 0;
+    for (int byte = 0; byte < (INODE_COUNT + 7) / 8; byte++) {
+        if (inode_dirty_bits[byte] == 0) {
+            continue;
+        }
+        for (int i = byte * 8; i < byte * 8 + 8 && i < INODE_COUNT; i++) {
+            if (!bitmap_get(inode_dirty_bits, i)) {
+                continue;
+            }
+            bitmap_put(inode_dirty_bits, i, 0);
+
+            int block_num = FIRST_INODE_BLOCK + i / INODES_PER_BLOCK;
+            inode_t *b = blocks_get_block(block_num);
+            if (!b) {
+                LOG_ERROR("save_inodes: Failed to access inode block %d\n", block_num);
+                stats_record(STATS_SAVE_INODES, start, -EIO, 0);
+                return;
+            }
+            memcpy(&b[i % INODES_PER_BLOCK], &inodes[i], sizeof(inode_t));
+            blocks_dirty(block_num);
+            blocks_put_block(b);
+            written++;
+        }
+    }
+
+    // Ensure data is written to disk
+    if (blocks_flush() < 0) {
+        stats_record(STATS_SAVE_INODES, start, -EIO, 0);
+        return;
+    }
+    journal_reset();
+    stats_record(STATS_SAVE_INODES, start, 0, (uint64_t)written * sizeof(inode_t));
+
+    LOG_INFO("Saved %d inodes to disk.\n", written);
+}
+
+/**
+ * Get the inode with the given number.
+ *
+ * @param inum Inode number.
+ *
+ * @return Pointer to the inode, or NULL if inum is out of range.
+ */
+inode_t *get_inode(int inum) {
+    if (inum < 0 || inum >= INODE_COUNT) {
+        return NULL;
+    }
+    int index = inum / INODES_PER_BLOCK;
+    if (!__atomic_load_n(&block_loaded[index], __ATOMIC_ACQUIRE)) {
+        inode_load_block(index);
+    }
+    return &inodes[inum];
+}
+
+/**
+ * Get the number of an inode.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return Its inode number.
+ */
+int inode_get_inum(inode_t *node) {
+    return node - inodes;
+}
+
+/**
+ * Check whether an inode number is in use.
+ *
+ * @param inum Inode number.
+ *
+ * @return 1 if the inode is allocated, 0 otherwise.
+ */
+int inode_in_use(int inum) {
+    if (inum < 0 || inum >= INODE_COUNT) {
+        return 0;
+    }
+    return bitmap_get(get_inode_bitmap(), inum);
+}
+
+/**
+ * Lock an inode for reading: its size, times and block map stay unchanged
+ * until inode_unlock().
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_rdlock(inode_t *node) {
+    pthread_rwlock_rdlock(&inode_locks[inode_get_inum(node)]);
+}
+
+/**
+ * Lock an inode for reading if no other thread holds it for writing.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return 1 if the lock was taken, 0 if not.
+ */
+int inode_tryrdlock(inode_t *node) {
+    return pthread_rwlock_tryrdlock(&inode_locks[inode_get_inum(node)]) == 0;
+}
+
+/**
+ * Lock an inode for writing.
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_wrlock(inode_t *node) {
+    pthread_rwlock_wrlock(&inode_locks[inode_get_inum(node)]);
+}
+
+/**
+ * Release a lock taken by inode_rdlock() or inode_wrlock().
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_unlock(inode_t *node) {
+    pthread_rwlock_unlock(&inode_locks[inode_get_inum(node)]);
+}
+
+/**
+ * Log a range of the image that was changed in place in the journal and mark
+ * the blocks it spans dirty.
+ *
+ * @param ptr Start of the range inside a block returned by blocks_get_block().
+ * @param len Length of the range in bytes.
+ */
+void metadata_dirty(void *ptr, size_t len) {
+    size_t offset = blocks_offset(ptr);
+    journal_log(offset, ptr, len);
+    for (size_t b = offset / BLOCK_SIZE; b <= (offset + len - 1) / BLOCK_SIZE; b++) {
+        blocks_dirty(b);
+    }
+}
+
+// Log the 64-bit word of a bitmap that holds bit i.
+static void bitmap_word_dirty(void *bitmap, int i) {
+    metadata_dirty((uint64_t *)bitmap + i / 64, sizeof(uint64_t));
+}
+
+/**
+ * Mark an inode as changed: log its slot in the journal and flag it for the
+ * next save_inodes().
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_dirty(inode_t *node) {
+    int inum = inode_get_inum(node);
+    __atomic_fetch_or(&inode_dirty_bits[inum / 8], 1 << (inum % 8), __ATOMIC_RELAXED);
+    size_t offset = (size_t)(FIRST_INODE_BLOCK + inum / INODES_PER_BLOCK) * BLOCK_SIZE +
+                    (inum % INODES_PER_BLOCK) * sizeof(inode_t);
+    journal_log(offset, node, sizeof(inode_t));
+}
+
+/**
+ * Allocate and initialize a new inode.
+ *
+ * Takes the most recently freed inode number, or the lowest free one.
+ * Regular files start out with inline data.
+ *
+ * @param mode Permissions and type of the new inode.
+ *
+ * @return The new inode number, or -ENOSPC if the inode table is full.
+ */
+int alloc_inode(int mode) {
+    if (free_total == 0) {
+        LOG_WARN("alloc_inode: no free inodes available\n");
+        return -ENOSPC;
+    }
+    void *ibm = get_inode_bitmap();
+    int inum;
+    if (free_inum_count > 0) {
+        inum = free_inums[--free_inum_count];
+    } else {
+        inum = bitmap_find(ibm, 0, free_cursor, INODE_COUNT);
+        assert(inum >= 0);
+        free_cursor = inum + 1;
+    }
+    free_total--;
+
+    assert(!bitmap_get(ibm, inum));
+    bitmap_put(ibm, inum, 1);
+    bitmap_word_dirty(ibm, inum);
+
+    // Through get_inode(), so the slot's block is loaded before the slot is filled in
+    inode_t *node = get_inode(inum);
+    assert(node);
+    memset(node, 0, sizeof(inode_t));
+    node->refs = 1;
+    node->mode = mode;
+    if (S_ISREG(mode)) {
+        node->flags = INODE_INLINE;
+    }
+    time_t now = time(NULL);
+    node->atime = node->mtime = node->ctime = now;
+    inode_dirty(node);
+    return inum;
+}
+
+/**
+ * Get the number of free inodes.
+ *
+ * @return The number of inodes that can still be allocated.
+ */
+int inode_free_count() {
+    return free_total;
+}
+
+// Get a copy of the i-th extent of a file, from the inode or from its extent block.
+static extent_t inode_extent(inode_t *node, int i) {
+    if (i < INODE_EXTENTS) {
+        return node->extents[i];
+    }
+    extent_t *spill = blocks_get_block(node->extent_block);
+    assert(spill != NULL);
+    extent_t e = spill[i - INODE_EXTENTS];
+    blocks_put_block(spill);
+    return e;
+}
+
+// Store and log the i-th extent of a file.
+static void inode_set_extent(inode_t *node, int i, const extent_t *e) {
+    if (i < INODE_EXTENTS) {
+        node->extents[i] = *e;
+        inode_dirty(node);
+        return;
+    }
+    blocks_mark_metadata(node->extent_block);
+    extent_t *spill = blocks_get_block(node->extent_block);
+    assert(spill != NULL);
+    spill[i - INODE_EXTENTS] = *e;
+    metadata_dirty(&spill[i - INODE_EXTENTS], sizeof(extent_t));
+    blocks_put_block(spill);
+}
+
+// Mark a run of blocks as allocated or free in the bitmap and log the bitmap words it spans.
+static void bitmap_run_dirty(int start, int length) {
+    void *bbm = get_blocks_bitmap();
+    for (int w = start / 64; w <= (start + length - 1) / 64; w++) {
+        bitmap_word_dirty(bbm, w * 64);
+    }
+}
+
+// Reference counts logged together, like the words of a bitmap.
+#define REFS_PER_LOG 64
+
+// Log the groups of reference counts that hold a shared block of a run, the only ones free_run() and
+// blocks_share_run() change. Called before free_run(), which may make the blocks unshared.
+static void refs_run_dirty(int start, int length) {
+    uint16_t *refs = get_block_refs();
+    for (int g = start / REFS_PER_LOG; g <= (start + length - 1) / REFS_PER_LOG; g++) {
+        int lo = g * REFS_PER_LOG > start ? g * REFS_PER_LOG : start;
+        int hi = (g + 1) * REFS_PER_LOG < start + length ? (g + 1) * REFS_PER_LOG : start + length;
+        for (int bnum = lo; bnum < hi; bnum++) {
+            if (__atomic_load_n(&refs[bnum], __ATOMIC_RELAXED)) {
+                metadata_dirty(&refs[g * REFS_PER_LOG], REFS_PER_LOG * sizeof(uint16_t));
+                break;
+            }
+        }
+    }
+}
+
+// Drop a file's reference to a run of its blocks, freeing the ones no other file shares, and log the change.
+static void inode_release_run(int start, int length) {
+    refs_run_dirty(start, length);
+    free_run(start, length);
+    bitmap_run_dirty(start, length);
+}
+
+/**
+ * Free an inode and all of its data blocks.
+ *
+ * @param inum Inode number.
+ */
+void free_inode(int inum) {
+    inode_t *node = get_inode(inum);
+    if (!node || !inode_in_use(inum)) {
+        LOG_ERROR("free_inode: inode %d is not in use\n", inum);
+        return;
+    }
+
+    // Free data blocks, one extent at a time; inline data goes with the inode
+    if (!(node->flags & INODE_INLINE)) {
+        for (int i = 0; i < node->extent_count; i++) {
+            extent_t e = inode_extent(node, i);
+            inode_release_run(e.start, e.length);
+        }
+        if (node->extent_block) {
+            free_block(node->extent_block);
+            bitmap_run_dirty(node->extent_block, 1);
+        }
+    }
+
+    memset(node, 0, sizeof(inode_t));
+    inode_dirty(node);
+
+    void *ibm = get_inode_bitmap();
+    bitmap_put(ibm, inum, 0);
+    bitmap_word_dirty(ibm, inum);
+    free_inums[free_inum_count++] = inum;
+    free_total++;
+}
+
+/**
+ * Give the blocks freed since the last call back to the allocator and log
+ * their bits of the block bitmap. Call it right after a commit, while no
+ * operation can free blocks, so the transactions that freed them are all in.
+ */
+void inode_release_freed() {
+    int start, count;
+    while (blocks_release_freed(&start, &count)) {
+        bitmap_run_dirty(start, count);
+    }
+}
+
+// Index of the last extent starting at or before file_bnum, or -1 if there is none.
+static int extent_find(inode_t *node, int file_bnum) {
+    if (node->extent_count == 0 || node->extents[0].file_block > file_bnum) {
+        return -1;
+    }
+    int lo = 0, hi = node->extent_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (inode_extent(node, mid).file_block <= file_bnum) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Index of the block after the file's last mapped block.
+static int inode_block_end(inode_t *node) {
+    if (node->extent_count == 0) {
+        return 0;
+    }
+    extent_t last = inode_extent(node, node->extent_count - 1);
+    return last.file_block + last.length;
+}
+
+// Make sure a file has room for n more extents, allocating its extent block if they do not fit in the inode.
+static int inode_reserve_extents(inode_t *node, int n) {
+    if (node->extent_count + n > INODE_EXTENTS + EXTENTS_PER_BLOCK) {
+        LOG_WARN("inode_insert_extent: max extents reached for inode\n");
+        return -ENOSPC;
+    }
+    // Past the inline extents, the file needs an extent block
+    if (node->extent_count + n > INODE_EXTENTS && node->extent_block == 0) {
+        int extent_block = alloc_block();
+        if (extent_block < 0) {
+            LOG_ERROR("inode_insert_extent: failed to allocate extent block\n");
+            return -ENOSPC;
+        }
+        bitmap_run_dirty(extent_block, 1);
+        node->extent_block = extent_block;
+    }
+    return 0;
+}
+
+// Insert an extent at index i, moving the ones from i on up by one.
+static int inode_insert_extent(inode_t *node, int i, const extent_t *e) {
+    int rv = inode_reserve_extents(node, 1);
+    if (rv < 0) {
+        return rv;
+    }
+    for (int j = node->extent_count; j > i; j--) {
+        extent_t moved = inode_extent(node, j - 1);
+        inode_set_extent(node, j, &moved);
+    }
+    inode_set_extent(node, i, e);
+    node->extent_count++;
+    inode_dirty(node);
+    return 0;
+}
+
+// Remove the extent at index i, moving the ones after it down by one. Frees the extent block once the rest fit in the inode.
+static void inode_remove_extent(inode_t *node, int i) {
+    for (int j = i; j + 1 < node->extent_count; j++) {
+        extent_t moved = inode_extent(node, j + 1);
+        inode_set_extent(node, j, &moved);
+    }
+    node->extent_count--;
+    if (node->extent_count <= INODE_EXTENTS && node->extent_block) {
+        free_block(node->extent_block);
+        bitmap_run_dirty(node->extent_block, 1);
+        node->extent_block = 0;
+    }
+    inode_dirty(node);
+}
+
+/**
+ * Map a run of disk blocks into a hole of a file, extending the extents next
+ * to the hole where the run is contiguous with them on disk.
+ *
+ * @param node Pointer to the inode.
+ * @param bnum Index of the first block of the run within the file.
+ * @param start First disk block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, or -ENOSPC if the file has no room for another extent.
+ */
+static int inode_add_extent(inode_t *node, int bnum, int start, int count) {
+    int i = extent_find(node, bnum);
+    extent_t prev = {0};
+    if (i >= 0) {
+        prev = inode_extent(node, i);
+    }
+    extent_t next = {0};
+    int has_next = i + 1 < node->extent_count;
+    if (has_next) {
+        next = inode_extent(node, i + 1);
+    }
+    if (i >= 0 && prev.file_block + prev.length == bnum && prev.start + prev.length == start) {
+        // The run continues the extent before the hole, and may close the gap to the one after it
+        prev.length += count;
+        if (has_next && next.file_block == bnum + count && next.start == start + count) {
+            prev.length += next.length;
+            inode_set_extent(node, i, &prev);
+            inode_remove_extent(node, i + 1);
+        } else {
+            inode_set_extent(node, i, &prev);
+        }
+    } else if (has_next && next.file_block == bnum + count && next.start == start + count) {
+        // The run ends right where the extent after the hole starts, on disk too
+        next.file_block = bnum;
+        next.start = start;
+        next.length += count;
+        inode_set_extent(node, i + 1, &next);
+    } else {
+        extent_t e = { .file_block = bnum, .start = start, .length = count };
+        int rv = inode_insert_extent(node, i + 1, &e);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    node->block_count += count;
+    inode_dirty(node);
+    return 0;
+}
+
+/**
+ * Allocate blocks for the holes in a range of a file. Each hole gets
+ * contiguous runs placed right after the disk block mapped before it where
+ * possible. Blocks that are already mapped stay as they are; new blocks are
+ * not cleared.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the range within the file.
+ * @param count Number of blocks in the range.
+ *
+ * @return 0 on success, or -ENOSPC if not all holes could be filled; the blocks allocated until then stay mapped.
+ */
+int inode_alloc_range(inode_t *node, int first, int count) {
+    assert(!(node->flags & INODE_INLINE));
+    int end = first + count;
+    int bnum = first;
+    while (bnum < end) {
+        int run;
+        if (inode_map(node, bnum, &run) >= 0) {
+            bnum += run;
+            continue;
+        }
+        int want = run < end - bnum ? run : end - bnum;
+
+        // The extent before the hole; a run placed right after it on disk extends it
+        int i = extent_find(node, bnum);
+        extent_t prev = {0};
+        if (i >= 0) {
+            prev = inode_extent(node, i);
+        }
+        int goal = i >= 0 ? prev.start + prev.length : -1;
+
+        int got;
+        int start = alloc_run(goal, want, &got);
+        if (start < 0) {
+            LOG_WARN("inode_alloc_range: failed to allocate blocks\n");
+            return -ENOSPC;
+        }
+        bitmap_run_dirty(start, got);
+
+        int rv = inode_add_extent(node, bnum, start, got);
+        if (rv < 0) {
+            free_run(start, got);
+            bitmap_run_dirty(start, got);
+            return rv;
+        }
+        bnum += got;
+
+        TRACE("inode_alloc_range: %d blocks from %d allocated for inode %d, total blocks %d\n",
+              got, start, inode_get_inum(node), node->block_count);
+    }
+    return 0;
+}
+
+/**
+ * Free the blocks mapped in a range of a file, leaving a hole. An extent
+ * that spans the whole range is split in two. Blocks that other files share
+ * only lose this file's reference.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the range within the file.
+ * @param count Number of blocks in the range; INODE_MAX_BLOCKS - first to free everything from first on.
+ *
+ * @return 0 on success, or -ENOSPC if an extent had to be split but the file has no room for another one.
+ */
+int inode_free_range(inode_t *node, int first, int count) {
+    assert(!(node->flags & INODE_INLINE));
+    int end = first + count;
+    int i = extent_find(node, first);
+    if (i < 0) {
+        i = 0;
+    }
+    while (i < node->extent_count) {
+        extent_t e = inode_extent(node, i);
+        int e_end = e.file_block + e.length;
+        if (e.file_block >= end) {
+            break;
+        }
+        if (e_end <= first) {
+            i++;
+            continue;
+        }
+        int lo = first > e.file_block ? first : e.file_block;
+        int hi = end < e_end ? end : e_end;
+        int start = e.start + (lo - e.file_block);
+
+        if (lo > e.file_block && hi < e_end) {
+            // The range is inside the extent: keep its tail as a new extent
+            extent_t tail = { .file_block = hi, .start = e.start + (hi - e.file_block), .length = e_end - hi };
+            int rv = inode_insert_extent(node, i + 1, &tail);
+            if (rv < 0) {
+                return rv;
+            }
+            e.length = lo - e.file_block;
+            inode_set_extent(node, i, &e);
+            i += 2;
+        } else if (lo > e.file_block) {
+            e.length = lo - e.file_block;
+            inode_set_extent(node, i, &e);
+            i++;
+        } else if (hi < e_end) {
+            e.start += hi - e.file_block;
+            e.length = e_end - hi;
+            e.file_block = hi;
+            inode_set_extent(node, i, &e);
+            i++;
+        } else {
+            inode_remove_extent(node, i);
+        }
+
+        inode_release_run(start, hi - lo);
+        node->block_count -= hi - lo;
+        inode_dirty(node);
+        TRACE("inode_free_range: %d blocks from %d freed for inode %d, total blocks %d\n",
+              hi - lo, start, inode_get_inum(node), node->block_count);
+    }
+    return 0;
+}
+
+/**
+ * Share a range of one file's blocks with another file, or another range of
+ * the same file, without copying them. The blocks mapped in the destination
+ * range are freed first; holes in the source range stay holes.
+ *
+ * @param dst Pointer to the inode that receives the blocks.
+ * @param dst_first Index of the first block of the range within dst.
+ * @param src Pointer to the inode that holds the blocks.
+ * @param src_first Index of the first block of the range within src.
+ * @param count Number of blocks in the range, which must not overlap the destination range if src is dst.
+ *
+ * @return 0 on success, -ENOSPC if dst has no room for the extents, or -EMLINK if a block has too many
+ *         references; the blocks shared until then stay mapped.
+ */
+int inode_clone_range(inode_t *dst, int dst_first, inode_t *src, int src_first, int count) {
+    assert(!(dst->flags & INODE_INLINE) && !(src->flags & INODE_INLINE));
+    int rv = inode_free_range(dst, dst_first, count);
+    if (rv < 0) {
+        return rv;
+    }
+    int bnum = 0;
+    while (bnum < count) {
+        int run;
+        int start = inode_map(src, src_first + bnum, &run);
+        if (run > count - bnum) {
+            run = count - bnum;
+        }
+        if (start >= 0) {
+            rv = blocks_share_run(start, run);
+            if (rv < 0) {
+                return rv;
+            }
+            refs_run_dirty(start, run);
+            rv = inode_add_extent(dst, dst_first + bnum, start, run);
+            if (rv < 0) {
+                inode_release_run(start, run);
+                return rv;
+            }
+        }
+        bnum += run;
+    }
+    TRACE("inode_clone_range: %d blocks of inode %d shared at %d of inode %d\n",
+          count, inode_get_inum(src), dst_first, inode_get_inum(dst));
+    return 0;
+}
+
+/**
+ * Give a file its own copy of a run of blocks it shares with other files,
+ * before it changes them in place. The copies are placed next to the block
+ * before the run where possible; blocks the caller is about to overwrite
+ * completely are not copied.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the run within the file, which must be mapped.
+ * @param count Number of blocks in the run, at most as many as are contiguous on disk from first on.
+ * @param skip_from Start of the byte range of the file that is about to be overwritten.
+ * @param skip_to End of that range.
+ *
+ * @return The number of blocks copied from first on (between 1 and count), or -ENOSPC or -EIO.
+ */
+int inode_unshare(inode_t *node, int first, int count, int64_t skip_from, int64_t skip_to) {
+    int old = inode_get_bnum(node, first);
+    assert(old >= 0);
+    // Splitting the extent takes up to two more, so reserve them before anything changes
+    int rv = inode_reserve_extents(node, 2);
+    if (rv < 0) {
+        return rv;
+    }
+    int before = inode_get_bnum(node, first - 1);
+    int got;
+    int start = alloc_run(before >= 0 ? before + 1 : -1, count, &got);
+    if (start < 0) {
+        LOG_WARN("inode_unshare: failed to allocate blocks\n");
+        return -ENOSPC;
+    }
+    bitmap_run_dirty(start, got);
+
+    for (int b = 0; b < got; b++) {
+        int64_t pos = (int64_t)(first + b) * BLOCK_SIZE;
+        if (pos >= skip_from && pos + BLOCK_SIZE <= skip_to) {
+            continue;
+        }
+        void *from = blocks_get_block(old + b);
+        void *to = blocks_overwrite_block(start + b);
+        if (!from || !to) {
+            blocks_put_block(from);
+            blocks_put_block(to);
+            free_run(start, got);
+            bitmap_run_dirty(start, got);
+            return -EIO;
+        }
+        memcpy(to, from, BLOCK_SIZE);
+        blocks_dirty(start + b);
+        blocks_put_block(from);
+        blocks_put_block(to);
+    }
+
+    // Neither step can run out of extents after the reservation
+    rv = inode_free_range(node, first, got);
+    assert(rv == 0);
+    rv = inode_add_extent(node, first, start, got);
+    assert(rv == 0);
+    TRACE("inode_unshare: %d blocks at %d of inode %d copied to %d\n", got, first, inode_get_inum(node), start);
+    return got;
+}
+
+/**
+ * Replace the blocks mapped in a range of a file with newly allocated ones,
+ * mapped from the start of the range on. The new blocks are allocated while
+ * the old ones are still in use, so they never reuse them: what is written to
+ * them cannot clobber data the last committed block map still points to.
+ * They are placed next to the block before the range where possible and are
+ * not cleared.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the range within the file.
+ * @param count Number of blocks in the range.
+ * @param want Number of new blocks, at most count.
+ *
+ * @return 0 on success, or -ENOSPC (changing nothing).
+ */
+int inode_replace_range(inode_t *node, int first, int count, int want) {
+    assert(!(node->flags & INODE_INLINE) && want <= count);
+    int starts[want > 0 ? want : 1], lengths[want > 0 ? want : 1];
+    int runs = 0;
+    int before = inode_get_bnum(node, first - 1);
+    int goal = before >= 0 ? before + 1 : -1;
+    int rv = 0;
+    for (int have = 0; have < want; have += lengths[runs++]) {
+        starts[runs] = alloc_run(goal, want - have, &lengths[runs]);
+        if (starts[runs] < 0) {
+            LOG_WARN("inode_replace_range: failed to allocate blocks\n");
+            rv = -ENOSPC;
+            break;
+        }
+        bitmap_run_dirty(starts[runs], lengths[runs]);
+        goal = starts[runs] + lengths[runs];
+    }
+    // Freeing the range splits at most one extent, and each run may take one
+    if (rv == 0) {
+        rv = inode_reserve_extents(node, runs + 1);
+    }
+    if (rv < 0) {
+        for (int r = 0; r < runs; r++) {
+            free_run(starts[r], lengths[r]);
+            bitmap_run_dirty(starts[r], lengths[r]);
+        }
+        return rv;
+    }
+
+    rv = inode_free_range(node, first, count);
+    assert(rv == 0);
+    for (int r = 0, bnum = first; r < runs; bnum += lengths[r++]) {
+        rv = inode_add_extent(node, bnum, starts[r], lengths[r]);
+        assert(rv == 0);
+    }
+    TRACE("inode_replace_range: %d blocks at %d of inode %d replaced in %d runs\n",
+          count, first, inode_get_inum(node), runs);
+    return 0;
+}
+
+/**
+ * Map a block of a file to a disk block that already holds the same data,
+ * taking a reference to it. The block mapped there before, if any, loses
+ * this file's reference.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ * @param bnum The disk block, a data block of another file or of this one, not the one mapped at file_bnum.
+ *
+ * @return 0 on success, or -ENOSPC or -EMLINK (changing nothing).
+ */
+int inode_share_block(inode_t *node, int file_bnum, int bnum) {
+    assert(!(node->flags & INODE_INLINE) && inode_get_bnum(node, file_bnum) != bnum);
+    // Freeing the old block splits at most one extent, and the new one may take another
+    int rv = inode_reserve_extents(node, 2);
+    if (rv < 0) {
+        return rv;
+    }
+    rv = blocks_share_run(bnum, 1);
+    if (rv < 0) {
+        return rv;
+    }
+    refs_run_dirty(bnum, 1);
+
+    rv = inode_free_range(node, file_bnum, 1);
+    assert(rv == 0);
+    rv = inode_add_extent(node, file_bnum, bnum, 1);
+    assert(rv == 0);
+    TRACE("inode_share_block: block %d of inode %d mapped to %d\n", file_bnum, inode_get_inum(node), bnum);
+    return 0;
+}
+
+/**
+ * Grow a file by the given number of blocks after its last mapped block,
+ * allocating them as contiguous runs placed right after that block on disk
+ * where possible.
+ *
+ * @param node Pointer to the inode.
+ * @param count Number of blocks to add.
+ *
+ * @return 0 on success, or -ENOSPC if not all blocks could be added.
+ */
+int inode_grow(inode_t *node, int count) {
+    return inode_alloc_range(node, inode_block_end(node), count);
+}
+
+/**
+ * Allocate a new block at the end of a file.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return Block number of the newly allocated block, or negative error code.
+ */
+int inode_add_block(inode_t *node) {
+    int rv = inode_grow(node, 1);
+    if (rv < 0) {
+        return rv;
+    }
+    return inode_get_bnum(node, inode_block_end(node) - 1);
+}
+
+/**
+ * Map a block index within a file to the run of contiguous disk blocks
+ * holding it.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ * @param run Receives the number of contiguous blocks from file_bnum on; if
+ *            the block is a hole, the number of blocks until the next mapped one
+ *            (INODE_MAX_BLOCKS - file_bnum if none follows).
+ *
+ * @return The block number of file_bnum, or -1 if it is not mapped (a hole).
+ */
+int inode_map(inode_t *node, int file_bnum, int *run) {
+    int dummy;
+    if (!run) {
+        run = &dummy;
+    }
+    if (file_bnum < 0) {
+        *run = 0;
+        return -1;
+    }
+
+    int i = extent_find(node, file_bnum);
+    if (i >= 0) {
+        extent_t e = inode_extent(node, i);
+        int delta = file_bnum - e.file_block;
+        if (delta < e.length) {
+            *run = e.length - delta;
+            return e.start + delta;
+        }
+    }
+
+    // A hole, which ends where the next extent starts
+    *run = i + 1 < node->extent_count ? inode_extent(node, i + 1).file_block - file_bnum : INODE_MAX_BLOCKS - file_bnum;
+    return -1;
+}
+
+/**
+ * Map a block index within a file to a block number on disk.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ *
+ * @return The block number, or -1 if the block is not mapped.
+ */
+int inode_get_bnum(inode_t *node, int file_bnum) {
+    return inode_map(node, file_bnum, NULL);
+}
+
+/**
+ * Move a file's inline data out of the inode, leaving an empty block map.
+ * The data is copied to buf; the caller writes it back to the file's blocks
+ * and sets the size again.
+ *
+ * @param node Pointer to an inode with INODE_INLINE set.
+ * @param buf Receives the data, INODE_INLINE_SIZE bytes.
+ *
+ * @return The number of bytes of data, i.e. the old size of the file.
+ */
+int inode_take_inline(inode_t *node, char *buf) {
+    assert(node->flags & INODE_INLINE);
+    int size = node->size;
+    memcpy(buf, node->inline_data, size);
+    memset(node->inline_data, 0, INODE_INLINE_SIZE);
+    node->flags &= ~INODE_INLINE;
+    node->size = 0;
+    inode_dirty(node);
+    return size;
+}
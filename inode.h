@@ -0,0 +1,331 @@
+// Inode manipulation routines.
+//
+// Inodes are small fixed-size records in the inode table; names live in
+// directory entries (see directory.h). A small regular file keeps its data
+// in the inode itself, in place of the block map (see INODE_INLINE). Files
+// may be sparse: blocks the block map leaves out are holes, which read as zeros.
+// A file with INODE_COMPRESSED set stores its data as compressed clusters of
+// blocks instead (see compress.h).
+//
+// Each inode has a reader/writer lock guarding its fields and block map;
+// the functions below do not take it themselves.
+
+// based on cs3650 starter code
+#ifndef INODE_H
+#define INODE_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define INODE_EXTENTS 4 // Extents stored in the inode itself
+#define INODE_INLINE_SIZE 200 // Bytes of file data that fit in the inode itself
+#define INODE_MAX_BLOCKS INT_MAX // Block indexes within a file are below this
+
+// Inode flags.
+#define INODE_INLINE 1 // The file's data is in inline_data; it has no blocks
+#define INODE_COMPRESSED 2 // The file's blocks hold compressed clusters (see compress.h)
+
+/**
+ * A run of contiguous blocks of a file: file blocks
+ * [file_block, file_block + length) live in disk blocks [start, start + length).
+ */
+typedef struct extent {
+  int file_block; // index of the first block of the run within the file
+  int start;      // first disk block of the run
+  int length;     // number of blocks in the run
+} extent_t;
+
+typedef struct inode {
+  int refs;        // reference count (links from directory entries)
+  int mode;        // permission & type
+  int64_t size;    // bytes
+  int64_t atime;   // last access
+  int64_t mtime;   // last modification
+  int64_t ctime;   // last metadata change
+  int block_count; // number of data blocks mapped, not counting holes
+  int extent_count; // number of extents mapping the data blocks
+  int flags;       // INODE_* flags
+  union {
+    struct {
+      extent_t extents[INODE_EXTENTS]; // first extents of the file, sorted by file_block, not overlapping
+      int extent_block; // block holding the remaining extents, 0 if none
+    };
+    char inline_data[INODE_INLINE_SIZE]; // the file's data if INODE_INLINE is set, zero past size
+  };
+  int _reserved; // pads the inode to 256 bytes
+} inode_t;
+
+/**
+ * Load the inode table of the mounted image into memory.
+ *
+ * Only sets up the in-memory table: each block of the on-disk table is copied
+ * in when get_inode() first asks for one of its inodes, so mounting does not
+ * depend on the size of the table.
+ */
+void load_inodes();
+
+/**
+ * Write the inodes changed since the last call back to the inode table and
+ * sync the changed blocks. Resets the journal afterwards. This writes the
+ * metadata home in place, so call it only when everything logged has been
+ * committed (see journal_commit()).
+ */
+void save_inodes();
+
+/**
+ * Get the inode with the given number.
+ *
+ * @param inum Inode number.
+ *
+ * @return Pointer to the inode, or NULL if inum is out of range.
+ */
+inode_t *get_inode(int inum);
+
+/**
+ * Get the number of an inode.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return Its inode number.
+ */
+int inode_get_inum(inode_t *node);
+
+/**
+ * Check whether an inode number is in use.
+ *
+ * @param inum Inode number.
+ *
+ * @return 1 if the inode is allocated, 0 otherwise.
+ */
+int inode_in_use(int inum);
+
+/**
+ * Lock an inode for reading: its size, times and block map stay unchanged
+ * until inode_unlock().
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_rdlock(inode_t *node);
+
+/**
+ * Lock an inode for reading if no other thread holds it for writing.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return 1 if the lock was taken, 0 if not.
+ */
+int inode_tryrdlock(inode_t *node);
+
+/**
+ * Lock an inode for writing.
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_wrlock(inode_t *node);
+
+/**
+ * Release a lock taken by inode_rdlock() or inode_wrlock().
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_unlock(inode_t *node);
+
+/**
+ * Allocate and initialize a new inode.
+ *
+ * Takes the most recently freed inode number, or the lowest free one. Inode
+ * numbers never change while the inode is in use.
+ *
+ * @param mode Permissions and type of the new inode.
+ *
+ * @return The new inode number, or -ENOSPC if the inode table is full.
+ */
+int alloc_inode(int mode);
+
+/**
+ * Get the number of free inodes.
+ *
+ * @return The number of inodes that can still be allocated.
+ */
+int inode_free_count();
+
+/**
+ * Free an inode and all of its data blocks.
+ *
+ * @param inum Inode number.
+ */
+void free_inode(int inum);
+
+/**
+ * Give the blocks freed since the last call back to the allocator and log
+ * their bits of the block bitmap. Call it right after a commit, while no
+ * operation can free blocks, so the transactions that freed them are all in.
+ */
+void inode_release_freed();
+
+/**
+ * Allocate a new block at the end of a file.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return Block number of the newly allocated block, or negative error code.
+ */
+int inode_add_block(inode_t *node);
+
+/**
+ * Grow a file by the given number of blocks after its last mapped block,
+ * allocating them as contiguous runs placed right after that block on disk
+ * where possible.
+ *
+ * @param node Pointer to the inode.
+ * @param count Number of blocks to add.
+ *
+ * @return 0 on success, or -ENOSPC if not all blocks could be added.
+ */
+int inode_grow(inode_t *node, int count);
+
+/**
+ * Allocate blocks for the holes in a range of a file. Each hole gets
+ * contiguous runs placed right after the disk block mapped before it where
+ * possible. Blocks that are already mapped stay as they are; new blocks are
+ * not cleared.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the range within the file.
+ * @param count Number of blocks in the range.
+ *
+ * @return 0 on success, or -ENOSPC if not all holes could be filled; the blocks allocated until then stay mapped.
+ */
+int inode_alloc_range(inode_t *node, int first, int count);
+
+/**
+ * Free the blocks mapped in a range of a file, leaving a hole. An extent
+ * that spans the whole range is split in two. Blocks that other files share
+ * only lose this file's reference.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the range within the file.
+ * @param count Number of blocks in the range; INODE_MAX_BLOCKS - first to free everything from first on.
+ *
+ * @return 0 on success, or -ENOSPC if an extent had to be split but the file has no room for another one.
+ */
+int inode_free_range(inode_t *node, int first, int count);
+
+/**
+ * Share a range of one file's blocks with another file, or another range of
+ * the same file, without copying them. The blocks mapped in the destination
+ * range are freed first; holes in the source range stay holes.
+ *
+ * @param dst Pointer to the inode that receives the blocks.
+ * @param dst_first Index of the first block of the range within dst.
+ * @param src Pointer to the inode that holds the blocks.
+ * @param src_first Index of the first block of the range within src.
+ * @param count Number of blocks in the range, which must not overlap the destination range if src is dst.
+ *
+ * @return 0 on success, -ENOSPC if dst has no room for the extents, or -EMLINK if a block has too many
+ *         references; the blocks shared until then stay mapped.
+ */
+int inode_clone_range(inode_t *dst, int dst_first, inode_t *src, int src_first, int count);
+
+/**
+ * Give a file its own copy of a run of blocks it shares with other files,
+ * before it changes them in place. The copies are placed next to the block
+ * before the run where possible; blocks the caller is about to overwrite
+ * completely are not copied.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the run within the file, which must be mapped.
+ * @param count Number of blocks in the run, at most as many as are contiguous on disk from first on.
+ * @param skip_from Start of the byte range of the file that is about to be overwritten.
+ * @param skip_to End of that range.
+ *
+ * @return The number of blocks copied from first on (between 1 and count), or -ENOSPC or -EIO.
+ */
+int inode_unshare(inode_t *node, int first, int count, int64_t skip_from, int64_t skip_to);
+
+/**
+ * Replace the blocks mapped in a range of a file with newly allocated ones,
+ * mapped from the start of the range on. The new blocks are allocated while
+ * the old ones are still in use, so they never reuse them: what is written to
+ * them cannot clobber data the last committed block map still points to.
+ * They are placed next to the block before the range where possible and are
+ * not cleared.
+ *
+ * @param node Pointer to the inode.
+ * @param first Index of the first block of the range within the file.
+ * @param count Number of blocks in the range.
+ * @param want Number of new blocks, at most count.
+ *
+ * @return 0 on success, or -ENOSPC (changing nothing).
+ */
+int inode_replace_range(inode_t *node, int first, int count, int want);
+
+/**
+ * Map a block of a file to a disk block that already holds the same data,
+ * taking a reference to it. The block mapped there before, if any, loses
+ * this file's reference.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ * @param bnum The disk block, a data block of another file or of this one, not the one mapped at file_bnum.
+ *
+ * @return 0 on success, or -ENOSPC or -EMLINK (changing nothing).
+ */
+int inode_share_block(inode_t *node, int file_bnum, int bnum);
+
+/**
+ * Map a block index within a file to a block number on disk.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ *
+ * @return The block number, or -1 if the block is not mapped.
+ */
+int inode_get_bnum(inode_t *node, int file_bnum);
+
+/**
+ * Move a file's inline data out of the inode, leaving an empty block map.
+ * The data is copied to buf; the caller writes it back to the file's blocks
+ * and sets the size again.
+ *
+ * @param node Pointer to an inode with INODE_INLINE set.
+ * @param buf Receives the data, INODE_INLINE_SIZE bytes.
+ *
+ * @return The number of bytes of data, i.e. the old size of the file.
+ */
+int inode_take_inline(inode_t *node, char *buf);
+
+/**
+ * Map a block index within a file to the run of contiguous disk blocks
+ * holding it.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Index of the block within the file.
+ * @param run Receives the number of contiguous blocks from file_bnum on; if
+ *            the block is a hole, the number of blocks until the next mapped one
+ *            (INODE_MAX_BLOCKS - file_bnum if none follows).
+ *
+ * @return The block number of file_bnum, or -1 if it is not mapped (a hole).
+ */
+int inode_map(inode_t *node, int file_bnum, int *run);
+
+/**
+ * Mark an inode as changed: log its slot in the journal and flag it for the
+ * next save_inodes().
+ *
+ * @param node Pointer to the inode.
+ */
+void inode_dirty(inode_t *node);
+
+/**
+ * Log a range of the image that was changed in place in the journal and mark
+ * the blocks it spans dirty.
+ *
+ * @param ptr Start of the range inside a block returned by blocks_get_block().
+ * @param len Length of the range in bytes.
+ */
+void metadata_dirty(void *ptr, size_t len);
+
+#endif
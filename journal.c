@@ -0,0 +1,406 @@
+// Implements a small physical redo journal for metadata updates. Logged image ranges are batched in memory and
+// written as a single checksummed transaction to the journal area, so one operation costs an append instead of
+// a rewrite of the whole inode table.
+
+// necessary libraries
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "blocks.h"
+#include "journal.h"
+#include "log.h"
+#include "stats.h"
+
+#define JOURNAL_MAGIC 0x4a53464e     // "NFSJ", marks a formatted journal area
+#define JOURNAL_TXN_MAGIC 0x4e585446 // "FTXN", marks the start of a transaction
+
+// Header at the start of the journal area.
+typedef struct {
+    uint32_t magic;
+    uint32_t generation; // Bumped on every reset, so stale transactions are never replayed.
+    uint64_t _reserved;
+} journal_super_t;
+
+// Header of one committed transaction, followed by its records.
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t sequence;     // Position of the transaction since the last reset.
+    uint32_t record_count;
+    uint32_t length;       // Bytes of records following this header.
+    uint32_t checksum;     // FNV-1a over the records.
+} journal_txn_t;
+
+// Header of one record, followed by its data padded to 8 bytes.
+typedef struct {
+    uint64_t offset; // Where the data goes in the image.
+    uint32_t length;
+    uint32_t _reserved;
+} journal_record_t;
+
+// A range logged since the last commit.
+typedef struct {
+    size_t offset;
+    const void *src;
+    size_t len;
+    void *block; // The block holding the range, held until the commit so src stays valid and the block cache
+                 // cannot write it back before then
+} journal_pending_t;
+
+static size_t journal_start = 0;  // Byte offset of the journal area in the image.
+static size_t journal_size = 0;   // Size of the journal area in bytes.
+static size_t journal_tail = 0;   // Where the next transaction goes, relative to journal_start.
+static uint32_t journal_generation = 0;
+static uint32_t journal_sequence = 0;
+
+static journal_pending_t *pending = NULL;
+static int pending_count = 0;
+static int pending_capacity = 0;
+static size_t pending_bytes = 0;  // Space the pending ranges take up once committed.
+
+// Open-addressing index of the pending ranges by offset, twice their capacity: slot i holds 1 + the position of a
+// range in pending, or 0 if it is empty.
+static int *pending_index = NULL;
+static size_t index_mask = 0;     // Number of slots minus one, a power of two less one.
+
+static int commit_interval = 5;   // Seconds between group commits.
+static time_t last_commit = 0;
+
+// Protects the pending ranges; operations on different files log concurrently.
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Round up to the 8-byte alignment used for records.
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// 32-bit FNV-1a checksum.
+static uint32_t checksum(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// @return Pointer to the given offset inside the journal area.
+static uint8_t *journal_at(size_t offset) {
+    return (uint8_t *)blocks_base + journal_start + offset;
+}
+
+// Forget the pending ranges and release their blocks. The caller holds journal_lock.
+static void drop_pending() {
+    for (int i = 0; i < pending_count; i++) {
+        blocks_put_block(pending[i].block);
+    }
+    if (pending_count > 0) {
+        memset(pending_index, 0, (index_mask + 1) * sizeof(int));
+    }
+    pending_count = 0;
+    pending_bytes = 0;
+}
+
+// @return The slot of the index that holds the pending range at offset, or the empty slot where it goes. The
+// caller holds journal_lock.
+static size_t index_slot(size_t offset, size_t len) {
+    size_t slot = (size_t)((offset * 0x9e3779b97f4a7c15ull) >> 17) & index_mask;
+    while (pending_index[slot] != 0) {
+        journal_pending_t *p = &pending[pending_index[slot] - 1];
+        if (p->offset == offset && p->len == len) {
+            break;
+        }
+        slot = (slot + 1) & index_mask;
+    }
+    return slot;
+}
+
+// Grow the pending ranges and rebuild their index. The caller holds journal_lock.
+static void grow_pending() {
+    pending_capacity = pending_capacity ? pending_capacity * 2 : 64;
+    pending = realloc(pending, pending_capacity * sizeof(journal_pending_t));
+    free(pending_index);
+    index_mask = (size_t)pending_capacity * 2 - 1;
+    pending_index = calloc(index_mask + 1, sizeof(int));
+    if (!pending || !pending_index) {
+        perror("journal_log");
+        abort();
+    }
+    for (int i = 0; i < pending_count; i++) {
+        pending_index[index_slot(pending[i].offset, pending[i].len)] = i + 1;
+    }
+}
+
+// Copy a record to its home location in the image, marking the blocks it spans dirty.
+static void replay_record(size_t offset, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        int bnum = offset / BLOCK_SIZE;
+        size_t delta = offset % BLOCK_SIZE;
+        size_t n = BLOCK_SIZE - delta < len ? BLOCK_SIZE - delta : len;
+        uint8_t *block = blocks_get_block(bnum);
+        if (!block) {
+            LOG_ERROR("journal_replay: cannot load block %d\n", bnum);
+            return;
+        }
+        memcpy(block + delta, data, n);
+        blocks_dirty(bnum);
+        blocks_put_block(block);
+        offset += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * Attach the journal to its area of the disk image.
+ *
+ * @param first_block First block of the journal area.
+ * @param block_count Number of blocks in the journal area.
+ */
+void journal_init(int first_block, int block_count) {
+    journal_start = (size_t)first_block * BLOCK_SIZE;
+    journal_size = (size_t)block_count * BLOCK_SIZE;
+    journal_tail = sizeof(journal_super_t);
+    journal_sequence = 0;
+    pending_count = 0;
+    pending_bytes = 0;
+    last_commit = time(NULL);
+
+    journal_super_t *super = (journal_super_t *)journal_at(0);
+    if (super->magic != JOURNAL_MAGIC) {
+        journal_generation = 0;
+        journal_reset();
+        return;
+    }
+    journal_generation = super->generation;
+}
+
+/**
+ * Apply all committed transactions to their home locations in the image.
+ *
+ * @return Number of transactions replayed.
+ */
+int journal_replay() {
+    int replayed = 0;
+    size_t pos = sizeof(journal_super_t);
+
+    while (pos + sizeof(journal_txn_t) <= journal_size) {
+        journal_txn_t *txn = (journal_txn_t *)journal_at(pos);
+        if (txn->magic != JOURNAL_TXN_MAGIC || txn->generation != journal_generation ||
+            txn->sequence != (uint32_t)replayed ||
+            txn->length > journal_size - pos - sizeof(journal_txn_t)) {
+            break;
+        }
+
+        uint8_t *records = (uint8_t *)(txn + 1);
+        if (checksum(records, txn->length) != txn->checksum) {
+            LOG_ERROR("journal_replay: transaction %u is torn, stopping\n", txn->sequence);
+            break;
+        }
+
+        size_t rpos = 0;
+        for (uint32_t i = 0; i < txn->record_count; i++) {
+            journal_record_t *rec = (journal_record_t *)(records + rpos);
+            replay_record(rec->offset, (uint8_t *)(rec + 1), rec->length);
+            rpos += sizeof(journal_record_t) + align8(rec->length);
+        }
+
+        pos += sizeof(journal_txn_t) + txn->length;
+        replayed++;
+    }
+
+    if (replayed > 0) {
+        LOG_INFO("journal_replay: replayed %d transactions\n", replayed);
+    }
+    return replayed;
+}
+
+/**
+ * Record that a range of the image changed.
+ *
+ * @param offset Byte offset of the range in the disk image.
+ * @param src In-memory copy of the range's new contents.
+ * @param len Length of the range in bytes.
+ */
+void journal_log(size_t offset, const void *src, size_t len) {
+    assert(offset % BLOCK_SIZE + len <= (size_t)BLOCK_SIZE);
+    pthread_mutex_lock(&journal_lock);
+    // A range logged twice before a commit is written once, with its latest contents.
+    if (pending_count == pending_capacity) {
+        grow_pending();
+    }
+    size_t slot = index_slot(offset, len);
+    if (pending_index[slot] != 0) {
+        pending[pending_index[slot] - 1].src = src;
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+
+    pending_index[slot] = pending_count + 1;
+    pending[pending_count].offset = offset;
+    pending[pending_count].src = src;
+    pending[pending_count].len = len;
+    pending[pending_count].block = blocks_get_block(offset / BLOCK_SIZE);
+    pending_count++;
+    pending_bytes += sizeof(journal_record_t) + align8(len);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Start a new generation of the journal, which makes the committed transactions stale. The caller holds
+// journal_lock.
+static void start_generation() {
+    journal_super_t *super = (journal_super_t *)journal_at(0);
+    journal_generation++;
+    super->magic = JOURNAL_MAGIC;
+    super->generation = journal_generation;
+    super->_reserved = 0;
+    blocks_sync_range(journal_start, sizeof(journal_super_t));
+
+    journal_tail = sizeof(journal_super_t);
+    journal_sequence = 0;
+}
+
+// Write the committed transactions to their home locations from the journal itself and empty it, to make room.
+// The image in memory may already hold newer, uncommitted changes to the same places, so it is not written back
+// instead. The caller holds journal_lock.
+static int checkpoint_committed() {
+    size_t pos = sizeof(journal_super_t);
+    for (uint32_t seq = 0; seq < journal_sequence; seq++) {
+        journal_txn_t *txn = (journal_txn_t *)journal_at(pos);
+        uint8_t *records = (uint8_t *)(txn + 1);
+        size_t rpos = 0;
+        for (uint32_t i = 0; i < txn->record_count; i++) {
+            journal_record_t *rec = (journal_record_t *)(records + rpos);
+            if (blocks_write_through(rec->offset, rec + 1, rec->length) < 0) {
+                return -EIO;
+            }
+            rpos += sizeof(journal_record_t) + align8(rec->length);
+        }
+        pos += sizeof(journal_txn_t) + txn->length;
+    }
+    if (blocks_sync_file() < 0) {
+        return -EIO;
+    }
+    LOG_INFO("journal_commit: checkpointed %u transactions to make room\n", journal_sequence);
+    start_generation();
+    return 0;
+}
+
+// Write the pending ranges as one transaction, see journal_commit(). The caller holds journal_lock.
+static int commit_pending() {
+    last_commit = time(NULL);
+    if (pending_count == 0) {
+        return 0;
+    }
+
+    size_t txn_size = sizeof(journal_txn_t) + pending_bytes;
+    if (journal_tail + txn_size > journal_size && journal_sequence > 0 &&
+        sizeof(journal_super_t) + txn_size <= journal_size && checkpoint_committed() < 0) {
+        return -EIO;
+    }
+    if (journal_tail + txn_size > journal_size) {
+        return -ENOSPC;
+    }
+
+    // Write the records first and the header last, so a torn commit fails its checksum.
+    journal_txn_t *txn = (journal_txn_t *)journal_at(journal_tail);
+    uint8_t *records = (uint8_t *)(txn + 1);
+    size_t rpos = 0;
+    for (int i = 0; i < pending_count; i++) {
+        journal_record_t *rec = (journal_record_t *)(records + rpos);
+        rec->offset = pending[i].offset;
+        rec->length = pending[i].len;
+        rec->_reserved = 0;
+        memcpy(rec + 1, pending[i].src, pending[i].len);
+        memset((uint8_t *)(rec + 1) + pending[i].len, 0, align8(pending[i].len) - pending[i].len);
+        rpos += sizeof(journal_record_t) + align8(pending[i].len);
+    }
+
+    txn->generation = journal_generation;
+    txn->sequence = journal_sequence;
+    txn->record_count = pending_count;
+    txn->length = rpos;
+    txn->checksum = checksum(records, rpos);
+    txn->magic = JOURNAL_TXN_MAGIC;
+
+    if (blocks_sync_range(journal_start + journal_tail, txn_size) < 0) {
+        return -EIO;
+    }
+
+    journal_tail += txn_size;
+    journal_sequence++;
+    drop_pending();
+    return 0;
+}
+
+/**
+ * Write all logged ranges to the journal as one transaction and sync it. If
+ * they do not fit behind the committed transactions, those are written home
+ * from the journal first.
+ *
+ * @return 0 on success, -ENOSPC if the logged ranges do not fit even in the
+ *         empty journal area, -EIO if the journal could not be written.
+ */
+int journal_commit() {
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&journal_lock);
+    size_t bytes = pending_count ? sizeof(journal_txn_t) + pending_bytes : 0;
+    int rv = commit_pending();
+    pthread_mutex_unlock(&journal_lock);
+    stats_record(STATS_JOURNAL_COMMIT, start, rv, rv == 0 ? bytes : 0);
+    return rv;
+}
+
+/**
+ * Discard all logged ranges and committed transactions.
+ */
+void journal_reset() {
+    pthread_mutex_lock(&journal_lock);
+    start_generation();
+    drop_pending();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * Set how often logged ranges are group-committed.
+ *
+ * @param seconds Commit interval; 0 commits after every operation.
+ */
+void journal_set_interval(int seconds) {
+    commit_interval = seconds;
+}
+
+/**
+ * Check whether a group commit is due.
+ *
+ * @return 1 if a commit is due, 0 otherwise.
+ */
+int journal_commit_due() {
+    pthread_mutex_lock(&journal_lock);
+    // Commit once the batch takes half the space left, so the operation that takes it there still fits
+    size_t txn_size = sizeof(journal_txn_t) + pending_bytes;
+    int due = pending_count > 0 &&
+              (time(NULL) - last_commit >= commit_interval || txn_size >= (journal_size - journal_tail) / 2);
+    pthread_mutex_unlock(&journal_lock);
+    return due;
+}
+
+/**
+ * Check whether the committed transactions fill more than half of the
+ * journal area, so the home locations should be written back and the journal
+ * emptied.
+ *
+ * @return 1 if a checkpoint is due, 0 otherwise.
+ */
+int journal_checkpoint_due() {
+    pthread_mutex_lock(&journal_lock);
+    int due = journal_tail > journal_size / 2;
+    pthread_mutex_unlock(&journal_lock);
+    return due;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file journal.h
+ *
+ * A write-ahead redo journal for filesystem metadata.
+ *
+ * Callers log byte ranges of the disk image that changed in memory. Logged
+ * ranges are group-committed into a reserved journal area as one transaction,
+ * and only that area is synced. Committed transactions are replayed into the
+ * image on the next mount, so the home locations only need to be written back
+ * at checkpoints.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+/**
+ * Attach the journal to its area of the disk image.
+ *
+ * Formats the area if it does not hold a journal yet.
+ *
+ * @param first_block First block of the journal area.
+ * @param block_count Number of blocks in the journal area.
+ */
+void journal_init(int first_block, int block_count);
+
+/**
+ * Apply all committed transactions to their home locations in the image.
+ *
+ * @return Number of transactions replayed.
+ */
+int journal_replay();
+
+/**
+ * Record that a range of the image changed.
+ *
+ * The bytes are copied from src when the next transaction is committed, so
+ * src must stay valid until then and later changes to it are picked up. The
+ * range must lie within one block; the journal holds that block (see
+ * blocks_get_block()) until the commit.
+ *
+ * @param offset Byte offset of the range in the disk image.
+ * @param src In-memory copy of the range's new contents.
+ * @param len Length of the range in bytes.
+ */
+void journal_log(size_t offset, const void *src, size_t len);
+
+/**
+ * Write all logged ranges to the journal as one transaction and sync it. If
+ * they do not fit behind the committed transactions, those are written home
+ * from the journal first, never from memory, which may already hold newer
+ * changes that are not committed.
+ *
+ * @return 0 on success, -ENOSPC if the logged ranges do not fit even in the
+ *         empty journal area, -EIO if the journal could not be written (the
+ *         logged ranges are kept in both cases).
+ */
+int journal_commit();
+
+/**
+ * Discard all logged ranges and committed transactions.
+ *
+ * Call only after the home locations have been written back and synced.
+ */
+void journal_reset();
+
+/**
+ * Set how often logged ranges are group-committed.
+ *
+ * @param seconds Commit interval; 0 commits after every operation.
+ */
+void journal_set_interval(int seconds);
+
+/**
+ * Check whether a group commit is due.
+ *
+ * @return 1 if the commit interval elapsed or the logged ranges fill half of
+ *         the space left in the journal area, 0 otherwise.
+ */
+int journal_commit_due();
+
+/**
+ * Check whether the committed transactions fill more than half of the
+ * journal area, so the home locations should be written back and the journal
+ * emptied (see save_inodes()). Checkpoint only right after a commit, while no
+ * operation can log anything, so nothing uncommitted is written home.
+ *
+ * @return 1 if a checkpoint is due, 0 otherwise.
+ */
+int journal_checkpoint_due();
+
+#endif
@@ -0,0 +1,241 @@
+// Implements leveled logging and the trace ring buffer. Writers claim a record with an atomic increment of the head
+// and publish it with a sequence number, seqlock style, so recording never blocks or takes a lock; the dump checks
+// the sequence number before and after copying a record and skips the ones that changed under it.
+
+// necessary libraries
+#define _GNU_SOURCE // syscall()
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+int log_level = NUFS_LOG_LEVEL;
+int log_trace_mode = 0;
+
+typedef struct {
+    uint64_t seq;     // Index + 1 of the record when complete, 0 while being written
+    uint64_t time_ns; // CLOCK_MONOTONIC time of the trace point
+    const char *fmt;
+    int64_t args[4];
+    uint32_t tid;
+    uint32_t _reserved;
+} log_record_t;
+
+static log_record_t *ring = NULL;
+static uint64_t ring_head = 0; // Index of the next record to claim
+static uint64_t ring_start_ns = 0;
+static __thread uint32_t thread_id = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Format a trace point. Conversions take the next argument as a 64-bit integer,
+ * whatever their length modifier says; %s is not supported and prints "?".
+ *
+ * @param out Receives the text, NUL-terminated.
+ * @param size Size of out.
+ * @param fmt Format of the trace point.
+ * @param args Its four arguments.
+ */
+static void format_record(char *out, size_t size, const char *fmt, const int64_t *args) {
+    size_t n = 0;
+    int arg = 0;
+    for (const char *p = fmt; *p && n + 1 < size; p++) {
+        if (*p != '%') {
+            out[n++] = *p;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[n++] = '%';
+            p++;
+            continue;
+        }
+
+        // Keep the flags and width, replace the length modifier by ll
+        char spec[16] = "%";
+        size_t len = 1;
+        p++;
+        while (*p && strchr("-+ #0123456789.", *p) && len < sizeof(spec) - 4) {
+            spec[len++] = *p++;
+        }
+        while (*p && strchr("hlzjt", *p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        int64_t value = arg < 4 ? args[arg++] : 0;
+        int wrote;
+        if (strchr("diuxXoc", *p)) {
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+            spec[len++] = *p == 'c' ? 'd' : *p;
+            spec[len] = '\0';
+            wrote = snprintf(out + n, size - n, spec, (long long)value);
+        } else {
+            wrote = snprintf(out + n, size - n, "?");
+        }
+        if (wrote < 0) {
+            break;
+        }
+        n += (size_t)wrote < size - n ? (size_t)wrote : size - n - 1;
+    }
+    out[n] = '\0';
+}
+
+/**
+ * Choose what gets logged. Call before any other thread starts.
+ *
+ * @param level Highest level to print, one of the LOG_LEVEL_* values.
+ * @param ring_enabled 1 to record trace points in the ring buffer, 0 to print them at LOG_LEVEL_TRACE.
+ */
+void log_init(int level, int ring_enabled) {
+    log_level = level;
+    log_trace_mode = 0;
+    if (ring_enabled) {
+        if (!ring) {
+            ring = calloc(LOG_RING_RECORDS, sizeof(log_record_t));
+        }
+        if (ring) {
+            ring_start_ns = now_ns();
+            log_trace_mode = 2;
+        } else {
+            LOG_ERROR("log_init: cannot allocate the trace ring\n");
+        }
+    } else if (level >= LOG_LEVEL_TRACE) {
+        log_trace_mode = 1;
+    }
+}
+
+/**
+ * Record a trace point, see TRACE().
+ *
+ * @param fmt printf format with integer conversions only; must be a string literal.
+ * @param a First argument.
+ * @param b Second argument.
+ * @param c Third argument.
+ * @param d Fourth argument.
+ */
+void log_trace_record(const char *fmt, int64_t a, int64_t b, int64_t c, int64_t d) {
+    if (log_trace_mode == 1) {
+        char text[256];
+        int64_t args[4] = { a, b, c, d };
+        format_record(text, sizeof(text), fmt, args);
+        fputs(text, stdout);
+        return;
+    }
+
+    if (thread_id == 0) {
+        thread_id = (uint32_t)syscall(SYS_gettid);
+    }
+    uint64_t index = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    log_record_t *r = &ring[index & (LOG_RING_RECORDS - 1)];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&r->time_ns, now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&r->fmt, fmt, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->args[0], a, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->args[1], b, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->args[2], c, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->args[3], d, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->tid, thread_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Format the records in the ring buffer, oldest first. Records still being
+ * written or overwritten while dumping are skipped.
+ *
+ * @param out Stream to write to.
+ *
+ * @return Number of records written.
+ */
+int log_dump(FILE *out) {
+    if (!ring) {
+        return 0;
+    }
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > LOG_RING_RECORDS ? head - LOG_RING_RECORDS : 0;
+    int dumped = 0;
+    for (uint64_t i = first; i < head; i++) {
+        log_record_t *r = &ring[i & (LOG_RING_RECORDS - 1)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+        uint64_t time_ns = __atomic_load_n(&r->time_ns, __ATOMIC_RELAXED);
+        const char *fmt = __atomic_load_n(&r->fmt, __ATOMIC_RELAXED);
+        int64_t args[4];
+        for (int a = 0; a < 4; a++) {
+            args[a] = __atomic_load_n(&r->args[a], __ATOMIC_RELAXED);
+        }
+        uint32_t tid = __atomic_load_n(&r->tid, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != i + 1) {
+            continue; // Overwritten while it was copied
+        }
+
+        char text[256];
+        format_record(text, sizeof(text), fmt, args);
+        uint64_t t = time_ns - ring_start_ns;
+        fprintf(out, "[%5llu.%06llu %u] %s", (unsigned long long)(t / 1000000000u),
+                (unsigned long long)(t % 1000000000u / 1000), tid, text);
+        dumped++;
+    }
+    fflush(out);
+    return dumped;
+}
+
+static int dump_pipe[2] = { -1, -1 }; // The signal handler wakes up the dump thread through it
+
+// Signal handler; only write() is safe here.
+static void dump_signal(int sig) {
+    char byte = 0;
+    ssize_t rv = write(dump_pipe[1], &byte, 1);
+    (void)rv;
+}
+
+// Dump the ring each time the signal handler writes to the pipe.
+static void *dump_thread(void *arg) {
+    char byte;
+    while (read(dump_pipe[0], &byte, 1) == 1) {
+        fprintf(stderr, "--- trace ring dump ---\n");
+        log_dump(stderr);
+    }
+    return NULL;
+}
+
+/**
+ * Start a thread that dumps the ring buffer to stderr whenever the process
+ * receives a signal. Call after FUSE has forked into the background, or the thread is lost.
+ *
+ * @param sig Signal that triggers a dump, e.g. SIGUSR1.
+ *
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int log_dump_on_signal(int sig) {
+    if (dump_pipe[0] < 0 && pipe(dump_pipe) < 0) {
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dump_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(sig, &action, NULL);
+}
@@ -0,0 +1,100 @@
+// Leveled logging and tracing.
+//
+// LOG_ERROR() and LOG_WARN() write to stderr, LOG_INFO() and LOG_DEBUG() to
+// stdout, all with printf formatting. Messages above the level chosen at run
+// time are skipped, and messages above NUFS_LOG_LEVEL are compiled out
+// altogether, so LOG_DEBUG() costs nothing unless the build asks for it
+// (make DEBUG=1).
+//
+// TRACE() marks hot paths. It takes a format and at most four integer
+// arguments (no strings; more do not compile) and is stored in binary form, in
+// a lock-free ring buffer when tracing is enabled at run time; the ring is
+// formatted only when dumped. Without the ring, trace points are printed when
+// the level is LOG_LEVEL_TRACE, and otherwise cost one test of a global.
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+// Highest level compiled in.
+#ifndef NUFS_LOG_LEVEL
+#define NUFS_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_RECORDS 4096 // Trace records kept by the ring, a power of two.
+
+extern int log_level;     // Highest level printed, see log_init()
+extern int log_trace_mode; // Where TRACE() goes: 0 nowhere, 1 stdout, 2 the ring
+
+#define LOG_AT(level, stream, ...) do { \
+    if ((level) <= NUFS_LOG_LEVEL && (level) <= log_level) { \
+        fprintf(stream, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, stderr, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, stderr, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, stdout, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, stdout, __VA_ARGS__)
+
+#define TRACE_ARGS(fmt, a, b, c, d, ...) \
+    log_trace_record(fmt, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d))
+
+// Number of arguments of a TRACE(), format included, up to 16.
+#define TRACE_COUNT(...) TRACE_COUNT_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define TRACE_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, n, ...) n
+
+#define TRACE(...) do { \
+    _Static_assert(TRACE_COUNT(__VA_ARGS__) <= 5, "TRACE() records at most four values"); \
+    if (__builtin_expect(log_trace_mode != 0, 0)) { \
+        TRACE_ARGS(__VA_ARGS__, 0, 0, 0, 0, 0); \
+    } \
+} while (0)
+
+/**
+ * Choose what gets logged. Call before any other thread starts.
+ *
+ * @param level Highest level to print, one of the LOG_LEVEL_* values.
+ * @param ring_enabled 1 to record trace points in the ring buffer, 0 to print them at LOG_LEVEL_TRACE.
+ */
+void log_init(int level, int ring_enabled);
+
+/**
+ * Record a trace point, see TRACE().
+ *
+ * @param fmt printf format with integer conversions only; must be a string literal.
+ * @param a First argument.
+ * @param b Second argument.
+ * @param c Third argument.
+ * @param d Fourth argument.
+ */
+void log_trace_record(const char *fmt, int64_t a, int64_t b, int64_t c, int64_t d);
+
+/**
+ * Format the records in the ring buffer, oldest first. Records still being
+ * written or overwritten while dumping are skipped.
+ *
+ * @param out Stream to write to.
+ *
+ * @return Number of records written.
+ */
+int log_dump(FILE *out);
+
+/**
+ * Start a thread that dumps the ring buffer to stderr whenever the process
+ * receives a signal. Call after FUSE has forked into the background, or the thread is lost.
+ *
+ * @param sig Signal that triggers a dump, e.g. SIGUSR1.
+ *
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int log_dump_on_signal(int sig);
+
+#endif
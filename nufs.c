@@ -1,63 +1,162 @@
 // implements a custom filesystem using FUSE (Filesystem in Userspace), with functionalities for managing inodes, file operations, 
-// and directory operations. It provides mechanisms to initialize storage, save and load inode metadata, create and manipulate files and directories, 
+// and directory operations. It provides mechanisms to initialize storage, resolve paths through directory entries, create and manipulate files and directories, 
 // and handle file operations like reading, writing, and renaming.
 
 // Importing the necessary libraries
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np()
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <time.h>
-#include <sys/mman.h>
 #include <stdlib.h>
 #include "blocks.h"
 #include "bitmap.h"
+#include "compress.h"
+#include "dcache.h"
+#include "dedup.h"
+#include "directory.h"
+#include "inode.h"
+#include "journal.h"
+#include "log.h"
+#include "nufs_ioctl.h"
+#include "path.h"
+#include "stats.h"
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
-#define MAX_FILES 128 // Maximum number of inodes/files supported.
-#define MAX_BLOCKS_PER_FILE 128 // Maximum number of data blocks per file.
+// The metadata layout (bitmaps, inode table, journal and FIRST_DATA_BLOCK) is read
+// from the superblock, see blocks.h. Inodes are defined in inode.h and directory
+// entries in directory.h; the root directory is inode ROOT_INUM.
 
-// Define the metadata layout
-#define INODE_META_BLOCK 1 // Stores the number of inodes
-// Range for storing inode data.
-#define FIRST_INODE_BLOCK 2
-#define LAST_INODE_BLOCK 27
+// How reads update the access time (-o strictatime, relatime or noatime).
+#define ATIME_STRICT 0   // Update atime on every read.
+#define ATIME_RELATIME 1 // Update atime only if it is not newer than mtime/ctime, or is a day old.
+#define ATIME_NOATIME 2  // Never update atime on reads.
 
-#define FIRST_DATA_BLOCK 28 // Starting block for file data.
-#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode_t))
+#define RELATIME_MAX_AGE (24 * 60 * 60) // Seconds after which relatime refreshes atime anyway.
 
-//Represents metadata and block mapping for files and directories
-// Inode (inode_t)
+// Mount options, parsed from -o in main().
 typedef struct {
-    char path[256]; //The full path to the file or directory.
-    int size; // File size in bytes.
-    int blocks[MAX_BLOCKS_PER_FILE]; // Array mapping to data blocks.
-    int block_count; // Number of blocks allocated to the file.
-    mode_t mode; // Permissions and file type (e.g., directory or regular file).
-    // Timestamps for last access, modification, and metadata change.
-    time_t atime;
-    time_t mtime;
-    time_t ctime;
-} inode_t;
-
-static inode_t inodes[MAX_FILES];
-static int inode_count = 0;
+    int commit_interval; // Seconds between metadata journal commits (-o commit=N).
+    int atime_mode;      // One of the ATIME_* values above.
+    blocks_geometry_t geometry; // Used only when formatting a new image (-o blocks=N,block_size=N,inodes=N).
+    int backend;         // One of the BLOCKS_BACKEND_* values (-o backend=mmap|cache|direct).
+    int cache_mb;        // Memory budget of the block cache in MB (-o cache_mb=N), 0 for the default.
+    int readahead_kb;    // How far sequential reads prefetch ahead, in KB (-o readahead=N), 0 to disable.
+    int log_level;       // Highest LOG_LEVEL_* printed (-o loglevel=N).
+    int trace;           // Record trace points in the ring buffer (-o trace), dumped on SIGUSR1.
+    int compress;        // Compress the data of new regular files (-o compress), see compress.h.
+    int dedup;           // Share blocks written with the same data (-o dedup), see dedup.h.
+} nufs_options_t;
+
+static nufs_options_t nufs_options = {
+    .commit_interval = 5, .atime_mode = ATIME_RELATIME, .backend = BLOCKS_BACKEND_MMAP, .readahead_kb = 128,
+    .log_level = NUFS_LOG_LEVEL
+};
+
+// Sequential read detection, per inode: where the next read starts if it
+// continues the previous one, and how far blocks have been prefetched.
+// Accessed atomically, since a file can be read by several threads at once.
+typedef struct {
+    int64_t next;
+    int64_t ahead;
+} read_ahead_t;
+
+static read_ahead_t *read_ahead = NULL; // INODE_COUNT entries, allocated by storage_init().
+
+#define WRITE_BUFFER_BLOCKS 16 // Size of a file handle's write buffer, in blocks.
+
+#define FILE_MAX_SIZE ((off_t)INODE_MAX_BLOCKS * BLOCK_SIZE) // Files end below this offset
+#define COPY_CHUNK (1 << 20) // Bytes a copy moves through memory at a time, where it cannot share blocks
+
+// State of an open file, stored in fi->fh by open() and create().
+// FUSE hides files that are unlinked or renamed over while open and removes
+// them only after the last release, so the inode stays valid until then.
+typedef struct {
+    int inum;
+    int access;       // O_RDONLY, O_WRONLY or O_RDWR, from the flags of the open
+    int ctl;          // CTL_* kind of a control file, whose contents buf holds since open; CTL_NONE otherwise
+    char *buf;        // Write-coalescing buffer of WRITE_BUFFER_BLOCKS blocks, allocated on first use
+    off_t buf_offset; // File offset of buf[0]
+    size_t buf_len;   // Bytes waiting in buf, 0 if none
+    int error;        // Error from writing the buffer out, reported by the next flush or fsync
+} file_handle_t;
+
+// The control directory: virtual files, not stored in the image, that show the
+// state of the mounted file system. No real file can take their names.
+#define CTL_DIR "/.nufs"
+#define CTL_NONE 0    // Not a control path
+#define CTL_ROOT 1    // CTL_DIR itself
+#define CTL_STATS 2   // CTL_DIR/stats: per-operation statistics, see stats.h
+#define CTL_SNAPSHOT 3 // CTL_DIR/snapshot: takes "create NAME" and "delete NAME" commands, see ctl_write()
+#define CTL_MISSING 4 // Any other path in CTL_DIR
+
+// Snapshots: read-only copies of the whole tree, taken at one point in time, that
+// share the data blocks of the files (see inode_clone_range()). Each one is a
+// directory in SNAPSHOT_DIR, which is left out of the snapshots themselves.
+#define SNAPSHOT_NAME ".snapshots"
+#define SNAPSHOT_DIR "/" SNAPSHOT_NAME
+
+// For each inode, the handle holding buffered writes to it, or NULL. At most one
+// handle buffers per inode; set and cleared under the inode's lock.
+static file_handle_t **buffered_handles = NULL;
+
+// For each inode, the number of handles open on it, counted up under namespace_lock
+// (shared) when the path is resolved and down on release.
+static int *open_counts = NULL;
+
+// FUSE calls the operations from several threads. Locks are taken in this order:
+//  - namespace_lock: directory entries, the name index (see directory.h), the inode
+//    bitmap and the journal commit. Shared for lookups, reads and writes; exclusive
+//    for creating, removing and renaming, and for committing or syncing.
+//  - the inode's lock (see inode.h): its size, times and block map. Shared for
+//    reads and stat, exclusive for writes.
+//  - the allocator lock (blocks.c) and the journal lock (journal.c), internal to those modules.
+// An operation holding namespace_lock shared takes a second inode lock only to copy between files
+// (NUFS_IOC_COPY_RANGE), and then locks the lower inode number first.
+static pthread_rwlock_t namespace_lock;
+
+static const struct fuse_opt nufs_opts[] = {
+    { "commit=%d", offsetof(nufs_options_t, commit_interval), 0 },
+    { "strictatime", offsetof(nufs_options_t, atime_mode), ATIME_STRICT },
+    { "relatime", offsetof(nufs_options_t, atime_mode), ATIME_RELATIME },
+    { "noatime", offsetof(nufs_options_t, atime_mode), ATIME_NOATIME },
+    { "blocks=%d", offsetof(nufs_options_t, geometry.block_count), 0 },
+    { "block_size=%d", offsetof(nufs_options_t, geometry.block_size), 0 },
+    { "inodes=%d", offsetof(nufs_options_t, geometry.inode_count), 0 },
+    { "backend=mmap", offsetof(nufs_options_t, backend), BLOCKS_BACKEND_MMAP },
+    { "backend=cache", offsetof(nufs_options_t, backend), BLOCKS_BACKEND_CACHE },
+    { "backend=direct", offsetof(nufs_options_t, backend), BLOCKS_BACKEND_DIRECT },
+    { "cache_mb=%d", offsetof(nufs_options_t, cache_mb), 0 },
+    { "readahead=%d", offsetof(nufs_options_t, readahead_kb), 0 },
+    { "loglevel=%d", offsetof(nufs_options_t, log_level), 0 },
+    { "trace", offsetof(nufs_options_t, trace), 1 },
+    { "compress", offsetof(nufs_options_t, compress), 1 },
+    { "dedup", offsetof(nufs_options_t, dedup), 1 },
+    FUSE_OPT_END
+};
 
 // Function declarations
-void save_inodes();
-void load_inodes();
+void storage_commit();
+void storage_sync();
 void storage_init(const char *path);
-inode_t *inode_lookup(const char *path);
-inode_t *inode_create(const char *path, mode_t mode);
-int inode_add_block(inode_t *node);
+int path_lookup(const char *path);
+int path_lookup_parent(const char *path, char *name);
+static int inode_flush_buffered(int inum);
 int nufs_access(const char *path, int mask);
 int nufs_getattr(const char *path, struct stat *st);
+static int nufs_statfs(const char *path, struct statvfs *st);
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 static int nufs_mknod(const char *path, mode_t mode, dev_t rdev);
 int nufs_mkdir(const char *path, mode_t mode);
@@ -65,213 +164,786 @@ int nufs_rename(const char *from, const char *to);
 int nufs_unlink(const char *path);
 static int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 static int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+static int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
+static int nufs_open(const char *path, struct fuse_file_info *fi);
+static int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+static int nufs_release(const char *path, struct fuse_file_info *fi);
+static int nufs_flush(const char *path, struct fuse_file_info *fi);
+static int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+static void *nufs_init(struct fuse_conn_info *conn);
+static void nufs_destroy(void *private_data);
 void nufs_init_ops(struct fuse_operations *ops);
 
 /**
- * Save the inodes to disk.
- * Initializes the filesystem with a backing disk image
- * Loads inodes from disk or creates a root directory (/) if missing.
+ * Commit the metadata logged so far, and checkpoint once the journal is half full. The caller holds namespace_lock
+ * exclusively, so right after the commit the image in memory is exactly what the journal holds, and writing it home
+ * cannot write anything uncommitted. Only metadata too large for the whole journal is written in place. The blocks
+ * freed by the committed operations are released afterwards, which logs their bits of the bitmap for the next commit.
+ *
+ * @return 0 on success, or the error of journal_commit().
+ */
+static int storage_commit_locked() {
+    int rv = journal_commit();
+    if (rv == -ENOSPC) {
+        LOG_ERROR("storage_commit: the logged metadata does not fit in the journal, writing it in place\n");
+        save_inodes();
+    } else if (rv == 0 && journal_checkpoint_due()) {
+        save_inodes();
+    }
+    if (rv == 0 || rv == -ENOSPC) {
+        inode_release_freed();
+    }
+    return rv;
+}
+
+/**
+ * Group-commit the metadata logged so far once the commit interval has elapsed,
+ * the journal is filling up, or the freed blocks waiting for the commit are
+ * needed.
  */
-void save_inodes() {
-    // Write inode_count to meta block
-    void *meta_block = blocks_get_block(INODE_META_BLOCK);
-    if (!meta_block) {
-        fprintf(stderr, "save_inodes: Failed to access block %d\n", INODE_META_BLOCK);
+void storage_commit() {
+    if (!journal_commit_due() && !blocks_release_due()) {
         return;
     }
-    memcpy(meta_block, &inode_count, sizeof(inode_count));
-    // Write inodes to data blocks
-    int total = inode_count;
-    int written = 0;
-    int block_num = FIRST_INODE_BLOCK;
-    while (written < total && block_num <= LAST_INODE_BLOCK) {
-        int count = total - written;
-        if (count > INODES_PER_BLOCK) {
-            count = INODES_PER_BLOCK;
+    // Wait for the running operations, so the metadata in the journal is consistent
+    pthread_rwlock_wrlock(&namespace_lock);
+    if (journal_commit_due() || blocks_release_due()) {
+        storage_commit_locked();
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+}
+
+/**
+ * Make all changes durable: commit the journal and flush the blocks changed since the last flush.
+ */
+void storage_sync() {
+    pthread_rwlock_wrlock(&namespace_lock);
+    // The second commit holds the bitmap of the blocks released after the first one
+    if (storage_commit_locked() == 0 && journal_commit() == 0) {
+        blocks_flush();
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+}
+
+/**
+ * Initialize filesystem storage with a disk image.
+ * 
+ * @param path Path to the disk image file
+ * @note Creates root directory if it doesn't exist
+ */
+void storage_init(const char *path) {
+    LOG_INFO("Initializing storage with disk image: %s\n", path);
+
+    // Prefer the writer, so a steady stream of reads cannot hold off commits forever
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&namespace_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    nufs_options.geometry.inode_size = sizeof(inode_t);
+    blocks_set_backend(nufs_options.backend, (size_t)nufs_options.cache_mb << 20);
+    blocks_init(path, &nufs_options.geometry);
+    journal_init(JOURNAL_FIRST_BLOCK, JOURNAL_BLOCKS);
+    int replayed = journal_replay();
+    if (replayed > 0) {
+        alloc_init(); // Replay may have rewritten the block bitmap
+    }
+    load_inodes();
+    free(read_ahead);
+    free(buffered_handles);
+    free(open_counts);
+    read_ahead = calloc(INODE_COUNT, sizeof(read_ahead_t));
+    buffered_handles = calloc(INODE_COUNT, sizeof(file_handle_t *));
+    open_counts = calloc(INODE_COUNT, sizeof(int));
+    assert(read_ahead && buffered_handles && open_counts);
+
+    // Ensure root directory exists
+    if (!inode_in_use(ROOT_INUM)) {
+        int inum = alloc_inode(S_IFDIR | 0755);
+        assert(inum == ROOT_INUM);
+        if (journal_commit() == 0) {
+            save_inodes();
+        }
+    } else if (replayed > 0) {
+        // The replayed metadata is in the image now; write it back and start a fresh journal.
+        save_inodes();
+    }
+    directory_init();
+    dcache_init();
+    if (nufs_options.dedup) {
+        dedup_init(BLOCK_COUNT);
+    }
+    journal_set_interval(nufs_options.commit_interval);
+
+    LOG_INFO("Storage initialized successfully.\n");
+}
+
+/**
+ * Resolve the first len bytes of a path by looking up each component in its
+ * directory, unless the directory lookup cache knows the answer.
+ * The caller holds namespace_lock.
+ *
+ * @param path Full path of the file or directory, not necessarily NUL-terminated at len
+ * @param len Length of the path
+ * @return The inode number, -ENOENT if a component does not exist, or -ENOTDIR
+ *         if a component other than the last is not a directory
+ */
+static int path_resolve(const char *path, size_t len) {
+    int inum = ROOT_INUM;
+    path_iter_t it;
+    path_part_t part;
+    path_iter_init(&it, path, len);
+    while (path_iter_next(&it, &part)) {
+        inode_t *dir = get_inode(inum);
+        if (!S_ISDIR(dir->mode)) {
+            inum = -ENOTDIR;
+            break;
+        }
+        if (part.len >= DIR_NAME_LENGTH) {
+            inum = -ENOENT; // No entry has a name this long
+            break;
+        }
+
+        int parent = inum;
+        if (dcache_lookup(parent, part.str, part.len, &inum)) {
+            if (inum < 0) {
+                break;
+            }
+            continue;
         }
 
-        void *b = blocks_get_block(block_num);
-        if (!b) {
-            fprintf(stderr, "save_inodes: Failed to access inode block %d\n", block_num);
-            return;
+        // The directory index wants a NUL-terminated name
+        size_t mark = path_arena_mark();
+        char *name = path_arena_strndup(part.str, part.len);
+        inum = name ? directory_lookup(dir, name) : -ENAMETOOLONG;
+        path_arena_release(mark);
+        if (inum == -ENAMETOOLONG) {
+            break;
+        }
+        dcache_insert(parent, part.str, part.len, inum);
+        if (inum < 0) {
+            break;
         }
-        // Copy inodes to block
-        memcpy(b, &inodes[written], count * sizeof(inode_t));
-        written += count;
-        block_num++;
     }
+    return inum;
+}
+
+// Add an entry to a directory, see directory_put(), and forget what the lookup cache knew about the name.
+// The caller holds namespace_lock exclusively.
+static int entry_put(inode_t *dir, const char *name, int inum) {
+    dcache_forget(inode_get_inum(dir), name);
+    return directory_put(dir, name, inum);
+}
+
+// Remove an entry from a directory, see directory_delete(), and from the lookup cache.
+// The caller holds namespace_lock exclusively.
+static void entry_delete(inode_t *dir, const char *name) {
+    dcache_forget(inode_get_inum(dir), name);
+    directory_delete(dir, name);
+}
+
+/**
+ * Resolve a path to an inode by looking up each component in its directory.
+ * Walks the path in place, without allocating memory.
+ * The caller holds namespace_lock.
+ * 
+ * @param path Full path of the file or directory
+ * @return The inode number, -ENOENT if a component does not exist, or -ENOTDIR
+ *         if a component other than the last is not a directory
+ */
+int path_lookup(const char *path) {
+    return path_resolve(path, strlen(path));
+}
+
+/**
+ * Resolve the directory that holds the last component of a path.
+ * The caller holds namespace_lock.
+ * 
+ * @param path Full path of the file or directory
+ * @param name Buffer of DIR_NAME_LENGTH bytes that receives the last component
+ * @return The inode number of the parent directory, or negative error code
+ */
+int path_lookup_parent(const char *path, char *name) {
+    path_part_t last;
+    size_t parent_len = path_split(path, &last);
+    if (last.len == 0 || last.str == path) {
+        // The root has no parent
+        return -EINVAL;
+    }
+    if (last.len >= DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(name, last.str, last.len);
+    name[last.len] = '\0';
 
-    // Ensure data is written to disk
-    if (msync(blocks_base, NUFS_SIZE, MS_SYNC) == -1) {
-        perror("msync");
+    int inum = path_resolve(path, parent_len);
+    if (inum >= 0 && !S_ISDIR(get_inode(inum)->mode)) {
+        return -ENOTDIR;
     }
+    return inum;
+}
 
-    printf("Saved %d inodes to disk.\n", inode_count);
+/**
+ * Get the state of an open file.
+ *
+ * @param fi File information passed to the operation, or NULL
+ * @return The handle set up by open() or create(), or NULL if there is none
+ */
+static file_handle_t *file_handle(struct fuse_file_info *fi) {
+    return fi ? (file_handle_t *)(uintptr_t)fi->fh : NULL;
 }
 
-// Reads inode metadata and array from disk into memory.
-void load_inodes() {
-    void *meta_block = blocks_get_block(INODE_META_BLOCK);
-    if (!meta_block) {
-        fprintf(stderr, "load_inodes: Failed to access block %d\n", INODE_META_BLOCK);
-        return;
+/**
+ * Get the inode an operation applies to: the one resolved when the file was
+ * opened, or else the one the path names.
+ * The caller holds namespace_lock.
+ *
+ * @param path File path
+ * @param fi File information passed to the operation, or NULL
+ * @return The inode number, or negative error code from path_lookup()
+ */
+static int file_inum(const char *path, struct fuse_file_info *fi) {
+    file_handle_t *h = file_handle(fi);
+    return h ? h->inum : path_lookup(path);
+}
+
+/**
+ * Forget the buffered writes to a file that is being deleted.
+ * The caller holds namespace_lock exclusively.
+ *
+ * @param inum Inode number of the file
+ */
+static void drop_buffered(int inum) {
+    file_handle_t *h = buffered_handles[inum];
+    if (h) {
+        h->buf_len = 0;
+        __atomic_store_n(&buffered_handles[inum], NULL, __ATOMIC_RELAXED);
     }
+}
 
-    memcpy(&inode_count, meta_block, sizeof(inode_count));
-    memset(inodes, 0, sizeof(inodes));
+/**
+ * Recognize the paths of the control directory.
+ *
+ * @param path File path
+ * @return CTL_NONE for a path of the file system, or one of the other CTL_* values
+ */
+static int ctl_path(const char *path) {
+    size_t len = strlen(CTL_DIR);
+    if (strncmp(path, CTL_DIR, len) != 0 || (path[len] != '\0' && path[len] != '/')) {
+        return CTL_NONE;
+    }
+    if (path[len] == '\0' || strcmp(path + len, "/") == 0) {
+        return CTL_ROOT;
+    }
+    if (strcmp(path + len, "/stats") == 0) {
+        return CTL_STATS;
+    }
+    if (strcmp(path + len, "/snapshot") == 0) {
+        return CTL_SNAPSHOT;
+    }
+    return CTL_MISSING;
+}
 
-    int read_count = 0;
-    int block_num = FIRST_INODE_BLOCK;
-    while (read_count < inode_count && block_num <= LAST_INODE_BLOCK) {
-        int count = inode_count - read_count;
-        if (count > INODES_PER_BLOCK) {
-            count = INODES_PER_BLOCK;
-        }
+/**
+ * Get the attributes of a control path. The files report a size of 0; the
+ * statistics are generated when they are opened, and the snapshot file is write-only.
+ *
+ * @param ctl Kind of the path, as returned by ctl_path()
+ * @param st Buffer to fill with the attributes
+ * @return 0 on success, or -ENOENT
+ */
+static int ctl_getattr(int ctl, struct stat *st) {
+    if (ctl == CTL_MISSING) {
+        return -ENOENT;
+    }
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = INODE_COUNT + ctl; // Past every real inode
+    st->st_mode = ctl == CTL_ROOT ? S_IFDIR | 0555 : ctl == CTL_SNAPSHOT ? S_IFREG | 0200 : S_IFREG | 0444;
+    st->st_nlink = ctl == CTL_ROOT ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
+    st->st_blksize = BLOCK_SIZE;
+    return 0;
+}
 
-        void *b = blocks_get_block(block_num);
-        if (!b) {
-            fprintf(stderr, "load_inodes: Failed to access inode block %d\n", block_num);
-            return;
+/**
+ * List the control directory.
+ *
+ * @param ctl Kind of the path, as returned by ctl_path()
+ * @param buf Buffer to fill with directory entries
+ * @param filler Function to add entries to the buffer
+ * @param offset Offset of the last entry returned by the previous call, 0 to start
+ * @return 0 on success, or negative error code
+ */
+static int ctl_readdir(int ctl, void *buf, fuse_fill_dir_t filler, off_t offset) {
+    if (ctl != CTL_ROOT) {
+        return ctl == CTL_MISSING ? -ENOENT : -ENOTDIR;
+    }
+    static const char *names[] = { ".", "..", "stats", "snapshot" };
+    for (off_t i = offset; i < (off_t)(sizeof(names) / sizeof(names[0])); i++) {
+        if (filler(buf, names[i], NULL, i + 1)) {
+            break;
         }
+    }
+    return 0;
+}
 
-        memcpy(&inodes[read_count], b, count * sizeof(inode_t));
-        read_count += count;
-        block_num++;
+/**
+ * Open a control file, capturing its contents so consecutive reads agree.
+ * Reads bypass the page cache, since the reported size is 0.
+ *
+ * @param ctl Kind of the path, as returned by ctl_path()
+ * @param fi File information that receives the handle
+ * @return 0 on success, or negative error code
+ */
+static int ctl_open(int ctl, struct fuse_file_info *fi) {
+    if (ctl == CTL_ROOT || ctl == CTL_MISSING) {
+        return ctl == CTL_MISSING ? -ENOENT : -EISDIR;
+    }
+    if ((fi->flags & O_ACCMODE) != (ctl == CTL_SNAPSHOT ? O_WRONLY : O_RDONLY)) {
+        return -EACCES;
     }
+    file_handle_t *h = calloc(1, sizeof(file_handle_t));
+    if (h && ctl == CTL_SNAPSHOT) {
+        h->ctl = ctl;
+        h->inum = -EBADF;
+        fi->fh = (uintptr_t)h;
+        fi->direct_io = 1;
+        return 0;
+    }
+    size_t len = stats_format(NULL, 0);
+    char *text = h ? malloc(len + 1) : NULL;
+    if (!text) {
+        free(h);
+        return -ENOMEM;
+    }
+    // The statistics may have grown since they were measured
+    h->buf_len = stats_format(text, len + 1);
+    if (h->buf_len > len) {
+        h->buf_len = len;
+    }
+    h->buf = text;
+    h->ctl = ctl;
+    h->inum = -EBADF;
+    fi->fh = (uintptr_t)h;
+    fi->direct_io = 1;
+    return 0;
+}
 
-    // Trust the stored inode_count
-    printf("Loaded %d inodes from disk.\n", inode_count);
+/**
+ * Read a control file from the contents captured by ctl_open().
+ *
+ * @param h Handle of the control file
+ * @param buf Buffer to read data into
+ * @param size Number of bytes to read
+ * @param offset Starting byte offset
+ * @return Number of bytes read
+ */
+static int ctl_read(file_handle_t *h, char *buf, size_t size, off_t offset) {
+    if (offset >= (off_t)h->buf_len) {
+        return 0;
+    }
+    if (size > h->buf_len - offset) {
+        size = h->buf_len - offset;
+    }
+    memcpy(buf, h->buf + offset, size);
+    return size;
 }
 
 /**
- * Initialize filesystem storage with a disk image.
- * 
- * @param path Path to the disk image file
- * @note Creates root directory if it doesn't exist
+ * Check whether a path is in the snapshot directory, where nothing can be changed.
+ *
+ * @param path File path
+ * @return 1 for SNAPSHOT_DIR and the paths in it, 0 otherwise
  */
-void storage_init(const char *path) {
-    printf("Initializing storage with disk image: %s\n", path);
+static int snapshot_path(const char *path) {
+    size_t len = strlen(SNAPSHOT_DIR);
+    return strncmp(path, SNAPSHOT_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
 
-    blocks_init(path);
-    load_inodes();
+// Check a snapshot name: a directory entry name other than "." and "..".
+static int snapshot_name_ok(const char *name) {
+    return name[0] && strlen(name) < DIR_NAME_LENGTH && !strchr(name, '/') &&
+           strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
 
-    // Ensure root directory exists
-    if (!inode_lookup("/")) {
-        inode_create("/", S_IFDIR | 0755);
+// Count the inodes in a directory tree, without the directory itself and SNAPSHOT_DIR.
+static int snapshot_count(int dir) {
+    int count = 0;
+    dirent_t entry;
+    for (int slot = 0; (slot = directory_next(get_inode(dir), slot, &entry)) >= 0; slot++) {
+        if (dir == ROOT_INUM && strcmp(entry.name, SNAPSHOT_NAME) == 0) {
+            continue;
+        }
+        count += 1 + (S_ISDIR(get_inode(entry.inum)->mode) ? snapshot_count(entry.inum) : 0);
     }
+    return count;
+}
 
-    printf("Storage initialized successfully.\n");
+// Check whether a file of a directory tree, or the directory itself, is open.
+static int snapshot_busy(int inum) {
+    if (__atomic_load_n(&open_counts[inum], __ATOMIC_RELAXED) > 0) {
+        return 1;
+    }
+    dirent_t entry;
+    inode_t *node = get_inode(inum);
+    if (S_ISDIR(node->mode)) {
+        for (int slot = 0; (slot = directory_next(node, slot, &entry)) >= 0; slot++) {
+            if (snapshot_busy(entry.inum)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
 }
 
 /**
- * Look up an inode by its full path.
- * 
- * @param path Full path of the file or directory
- * @return Pointer to the inode, or NULL if not found
+ * Copy a directory tree into an empty directory: directories get new entries,
+ * files share the blocks of the originals.
+ * The caller holds namespace_lock exclusively.
+ *
+ * @param src_dir Inode number of the directory to copy
+ * @param dst_dir Inode number of the directory that receives the copies
+ * @return 0 on success, or -ENOSPC / -EMLINK / -EIO with the copies made until then left in place
  */
-inode_t *inode_lookup(const char *path) {
-    char normalized_path[256];
-    strncpy(normalized_path, path, sizeof(normalized_path) - 1);
-    normalized_path[sizeof(normalized_path) - 1] = '\0';
+static int snapshot_copy(int src_dir, int dst_dir) {
+    dirent_t entry;
+    for (int slot = 0; (slot = directory_next(get_inode(src_dir), slot, &entry)) >= 0; slot++) {
+        if (src_dir == ROOT_INUM && strcmp(entry.name, SNAPSHOT_NAME) == 0) {
+            continue;
+        }
+        inode_t *src = get_inode(entry.inum);
+        int inum = alloc_inode(src->mode);
+        if (inum < 0) {
+            return inum;
+        }
+        int rv = entry_put(get_inode(dst_dir), entry.name, inum);
+        if (rv < 0) {
+            free_inode(inum);
+            return rv;
+        }
+        inode_t *dst = get_inode(inum);
+        dst->flags |= src->flags & INODE_COMPRESSED;
+        if (S_ISDIR(src->mode)) {
+            rv = snapshot_copy(entry.inum, inum);
+        } else if (src->flags & INODE_INLINE) {
+            memcpy(dst->inline_data, src->inline_data, INODE_INLINE_SIZE);
+            dst->size = src->size;
+        } else {
+            memset(dst->inline_data, 0, INODE_INLINE_SIZE);
+            dst->flags &= ~INODE_INLINE;
+            dst->size = src->size;
+            int count = (src->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (src->flags & INODE_COMPRESSED) {
+                // The last cluster may take blocks past the end
+                count = (count + COMPRESS_CLUSTER_BLOCKS - 1) / COMPRESS_CLUSTER_BLOCKS * COMPRESS_CLUSTER_BLOCKS;
+            }
+            rv = count > 0 ? inode_clone_range(dst, 0, src, 0, count) : 0;
+        }
+        dst->atime = src->atime;
+        dst->mtime = src->mtime;
+        dst->ctime = src->ctime;
+        inode_dirty(dst);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    return 0;
+}
 
-    size_t len = strlen(normalized_path);
-    while (len > 1 && normalized_path[len - 1] == '/') {
-        normalized_path[--len] = '\0';
+/**
+ * Take a snapshot of the whole tree as SNAPSHOT_DIR/name. All other operations
+ * wait meanwhile, and the data buffered by open files is written out first, so
+ * the snapshot shows the tree at one point in time. The copy takes an inode per
+ * file and directory and time in proportion to them, during which the whole
+ * file system is blocked.
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success, or negative error code; a snapshot that failed halfway
+ *         is left in place, to be deleted
+ */
+static int snapshot_create(const char *name) {
+    if (!snapshot_name_ok(name)) {
+        return -EINVAL;
+    }
+    pthread_rwlock_wrlock(&namespace_lock);
+    for (int inum = 0; inum < INODE_COUNT; inum++) {
+        inode_flush_buffered(inum);
     }
 
-    for (int i = 0; i < inode_count; i++) {
-        if (strcmp(inodes[i].path, normalized_path) == 0) {
-            return &inodes[i];
+    inode_t *root = get_inode(ROOT_INUM);
+    int dir = directory_lookup(root, SNAPSHOT_NAME);
+    int rv = 0;
+    if (dir < 0) {
+        dir = alloc_inode(S_IFDIR | 0755);
+        rv = dir < 0 ? dir : entry_put(root, SNAPSHOT_NAME, dir);
+        if (rv < 0 && dir >= 0) {
+            free_inode(dir);
         }
+    } else if (!S_ISDIR(get_inode(dir)->mode)) {
+        rv = -ENOTDIR;
+    } else if (directory_lookup(get_inode(dir), name) >= 0) {
+        rv = -EEXIST;
     }
-    return NULL;
+    // Running out of inodes halfway is easy to avoid
+    if (rv == 0 && snapshot_count(ROOT_INUM) + 1 > inode_free_count()) {
+        rv = -ENOSPC;
+    }
+
+    int snap = -1;
+    if (rv == 0) {
+        snap = alloc_inode(root->mode);
+        rv = entry_put(get_inode(dir), name, snap);
+        if (rv < 0) {
+            free_inode(snap);
+            snap = -1;
+        }
+    }
+    if (rv == 0) {
+        rv = snapshot_copy(ROOT_INUM, snap);
+        inode_t *node = get_inode(snap);
+        node->mtime = root->mtime;
+        node->ctime = root->ctime;
+        inode_dirty(node);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+
+    storage_commit();
+    LOG_INFO("snapshot: %s %s\n", rv < 0 ? "failed to create" : "created", name);
+    return rv;
+}
+
+// Free a directory tree of a snapshot, including the directory itself. The caller holds namespace_lock exclusively.
+static void snapshot_free(int inum) {
+    inode_t *node = get_inode(inum);
+    if (S_ISDIR(node->mode)) {
+        dirent_t entry;
+        while (directory_next(node, 0, &entry) >= 0) {
+            entry_delete(node, entry.name);
+            snapshot_free(entry.inum);
+        }
+    }
+    free_inode(inum);
 }
 
 /**
- * Create a new inode for a file or directory.
- * 
- * @param path Full path for the new inode
- * @param mode File mode (permissions and type)
- * @return Pointer to the newly created inode
+ * Delete the snapshot SNAPSHOT_DIR/name, releasing the blocks no other file shares.
+ * Its inodes are freed at once, so nothing in it may be open: a handle would
+ * otherwise read whatever file reuses the inode next.
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success, or -EINVAL / -ENOENT / -EBUSY
  */
-inode_t *inode_create(const char *path, mode_t mode) {
-    if (inode_count >= MAX_FILES) {
-        return NULL;
+static int snapshot_delete(const char *name) {
+    if (!snapshot_name_ok(name)) {
+        return -EINVAL;
+    }
+    pthread_rwlock_wrlock(&namespace_lock);
+    int dir = directory_lookup(get_inode(ROOT_INUM), SNAPSHOT_NAME);
+    int snap = dir < 0 ? -ENOENT : directory_lookup(get_inode(dir), name);
+    if (snap >= 0 && snapshot_busy(snap)) {
+        snap = -EBUSY;
+    }
+    if (snap >= 0) {
+        entry_delete(get_inode(dir), name);
+        snapshot_free(snap);
     }
+    pthread_rwlock_unlock(&namespace_lock);
 
-    inode_t *node = &inodes[inode_count++];
-    strncpy(node->path, path, sizeof(node->path) - 1);
-    node->path[sizeof(node->path) - 1] = '\0';
-    node->size = 0;
-    node->block_count = 0;
-    node->mode = mode;
-    time_t now = time(NULL);
-    node->atime = node->mtime = node->ctime = now;
-    save_inodes();
-    return node;
+    storage_commit();
+    LOG_INFO("snapshot: %s %s\n", snap == -EBUSY ? "files open in" : snap < 0 ? "no snapshot" : "deleted", name);
+    return snap < 0 ? snap : 0;
+}
+
+/**
+ * Run a command written to the snapshot control file: "create NAME" takes a
+ * snapshot and "delete NAME" deletes one. A trailing newline is ignored, so
+ * `echo create NAME > .nufs/snapshot` works; each write is one command.
+ *
+ * @param h Handle of the control file
+ * @param buf The command
+ * @param size Length of the command
+ * @param offset Ignored
+ * @return size on success, or negative error code
+ */
+static int ctl_write(file_handle_t *h, const char *buf, size_t size, off_t offset) {
+    char command[DIR_NAME_LENGTH + 16];
+    if (h->ctl != CTL_SNAPSHOT) {
+        return -EBADF;
+    }
+    if (size >= sizeof(command)) {
+        return -EINVAL;
+    }
+    memcpy(command, buf, size);
+    command[size] = '\0';
+    if (size > 0 && command[size - 1] == '\n') {
+        command[size - 1] = '\0';
+    }
+    int rv = -EINVAL;
+    if (strncmp(command, "create ", 7) == 0) {
+        rv = snapshot_create(command + 7);
+    } else if (strncmp(command, "delete ", 7) == 0) {
+        rv = snapshot_delete(command + 7);
+    }
+    return rv < 0 ? rv : (int)size;
 }
 
 /**
- * Allocate a new block for a file.
+ * Create a new file or directory and link it into its parent directory.
+ * The caller holds namespace_lock exclusively.
  * 
- * @param node Pointer to the inode
- * @return Block number of the newly allocated block, or negative error code
+ * @param path Full path for the new inode
+ * @param mode File mode (permissions and type)
+ * @return The new inode number, or negative error code
  */
-int inode_add_block(inode_t *node) {
-    if (node->block_count >= MAX_BLOCKS_PER_FILE) {
-        fprintf(stderr, "inode_add_block: max blocks reached for inode\n");
-        return -ENOSPC;
+static int node_create(const char *path, int mode) {
+    if (ctl_path(path)) {
+        return -EPERM;
+    }
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+    char name[DIR_NAME_LENGTH];
+    int parent = path_lookup_parent(path, name);
+    if (parent < 0) {
+        return parent;
     }
 
-    int block_index = alloc_block();
-    if (block_index < 0) {
-        fprintf(stderr, "inode_add_block: failed to allocate block\n");
-        return -ENOSPC;
+    inode_t *dir = get_inode(parent);
+    if (directory_lookup(dir, name) >= 0) {
+        return -EEXIST;
     }
 
-    node->blocks[node->block_count++] = block_index;
-    save_inodes();
+    int inum = alloc_inode(mode);
+    if (inum < 0) {
+        return inum;
+    }
+    if (nufs_options.compress && S_ISREG(mode)) {
+        get_inode(inum)->flags |= INODE_COMPRESSED;
+    }
 
-    printf("inode_add_block: block %d allocated for inode, total blocks %d\n", block_index, node->block_count);
-    return block_index;
+    int rv = entry_put(dir, name, inum);
+    if (rv < 0) {
+        free_inode(inum);
+        return rv;
+    }
+    return inum;
 }
 
 /**
- * Rename a file or directory.
+ * Move a directory entry to a new path, replacing what the new path names with
+ * rename(2) semantics: a file can replace a file and a directory an empty
+ * directory. Both entries change in the same journal transaction, so the
+ * target is never missing after a crash.
+ * The caller holds namespace_lock exclusively.
  * 
  * @param from Original path
  * @param to New path
  * @return 0 on success, negative error code on failure
  */
-int nufs_rename(const char *from, const char *to) {
-    inode_t *inode = inode_lookup(from);
-    if (!inode) {
-        fprintf(stderr, "rename: source file %s not found\n", from);
+static int node_rename(const char *from, const char *to) {
+    if (ctl_path(from) || ctl_path(to)) {
+        return -EPERM;
+    }
+    if (snapshot_path(from) || snapshot_path(to)) {
+        return -EROFS;
+    }
+    char from_name[DIR_NAME_LENGTH];
+    char to_name[DIR_NAME_LENGTH];
+    int from_parent = path_lookup_parent(from, from_name);
+    int to_parent = path_lookup_parent(to, to_name);
+    if (from_parent < 0 || to_parent < 0) {
+        LOG_DEBUG("rename: invalid path %s or %s\n", from, to);
+        return from_parent < 0 ? from_parent : to_parent;
+    }
+
+    inode_t *from_dir = get_inode(from_parent);
+    inode_t *to_dir = get_inode(to_parent);
+    int inum = directory_lookup(from_dir, from_name);
+    if (inum < 0) {
+        LOG_DEBUG("rename: source file %s not found\n", from);
         return -ENOENT;
     }
 
-    if (inode_lookup(to)) {
-        fprintf(stderr, "rename: destination %s already exists\n", to);
-        return -EEXIST;
+    // A directory cannot be moved into its own subtree
+    for (int dir = to_parent; dir >= 0; dir = directory_parent(dir)) {
+        if (dir == inum) {
+            LOG_DEBUG("rename: cannot move %s into itself\n", from);
+            return -EINVAL;
+        }
     }
 
-    if (strlen(to) >= sizeof(inode->path)) {
-        fprintf(stderr, "rename: destination path %s is too long\n", to);
-        return -ENAMETOOLONG;
+    inode_t *inode = get_inode(inum);
+    int target = directory_lookup(to_dir, to_name);
+    if (target == inum) {
+        // Both paths already name the same inode
+        return 0;
+    }
+    if (target >= 0) {
+        inode_t *replaced = get_inode(target);
+        dirent_t entry;
+        if (S_ISDIR(inode->mode) && !S_ISDIR(replaced->mode)) {
+            LOG_DEBUG("rename: destination %s is not a directory\n", to);
+            return -ENOTDIR;
+        }
+        if (!S_ISDIR(inode->mode) && S_ISDIR(replaced->mode)) {
+            LOG_DEBUG("rename: destination %s is a directory\n", to);
+            return -EISDIR;
+        }
+        if (S_ISDIR(replaced->mode) && directory_next(replaced, 0, &entry) >= 0) {
+            LOG_DEBUG("rename: destination %s is not empty\n", to);
+            return -ENOTEMPTY;
+        }
+
+        // Drop the replaced inode's link; its entry slot is reused below, so the put cannot fail
+        entry_delete(to_dir, to_name);
+        replaced->refs--;
+        if (replaced->refs <= 0 || S_ISDIR(replaced->mode)) {
+            drop_buffered(target);
+            free_inode(target);
+        } else {
+            replaced->ctime = time(NULL);
+            inode_dirty(replaced);
+        }
     }
 
-    strncpy(inode->path, to, sizeof(inode->path) - 1);
-    inode->path[sizeof(inode->path) - 1] = '\0';
+    // Moving the directory entry moves everything below it along
+    entry_delete(from_dir, from_name);
+    int rv = entry_put(to_dir, to_name, inum);
+    if (rv < 0) {
+        entry_put(from_dir, from_name, inum);
+        return rv;
+    }
 
     time_t now = time(NULL);
     inode->mtime = now;
     inode->ctime = now;
 
-    save_inodes();
-    printf("rename(%s -> %s) successful\n", from, to);
+    inode_dirty(inode);
+    LOG_DEBUG("rename(%s -> %s) successful\n", from, to);
     return 0;
 }
 
+/**
+ * Rename a file or directory.
+ * 
+ * @param from Original path
+ * @param to New path
+ * @return 0 on success, negative error code on failure
+ */
+int nufs_rename(const char *from, const char *to) {
+    pthread_rwlock_wrlock(&namespace_lock);
+    int rv = node_rename(from, to);
+    pthread_rwlock_unlock(&namespace_lock);
+    storage_commit();
+    return rv;
+}
+
 /**
  * Check file access permissions.
  * 
@@ -280,13 +952,48 @@ int nufs_rename(const char *from, const char *to) {
  * @return 0 on success
  */
 int nufs_access(const char *path, int mask) {
-    inode_t *node = inode_lookup(path);
-    if (!node) {
-        printf("access: file or directory %s not found\n", path);
-        return -ENOENT;
+    int ctl = ctl_path(path);
+    if (ctl) {
+        int allowed = ctl == CTL_SNAPSHOT ? W_OK : R_OK | (ctl == CTL_ROOT ? X_OK : 0);
+        return ctl == CTL_MISSING ? -ENOENT : (mask & ~allowed) ? -EACCES : 0;
     }
+    if ((mask & W_OK) && snapshot_path(path)) {
+        return -EROFS;
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = path_lookup(path);
+    pthread_rwlock_unlock(&namespace_lock);
+    if (inum < 0) {
+        LOG_DEBUG("access: file or directory %s not found\n", path);
+        return inum;
+    }
+
+    TRACE("access(%d, %04o) -> 0\n", inum, mask);
+    return 0;
+}
 
-    printf("access(%s, %04o) -> 0\n", path, mask);
+/**
+ * Get filesystem statistics. The free block and inode counts are cached by
+ * their allocators, so this does not scan the bitmaps. Blocks freed since the
+ * last commit count as free, since the commit gives them back.
+ *
+ * @param path Any path in the filesystem (unused)
+ * @param st Buffer to fill with filesystem statistics
+ * @return 0 on success
+ */
+static int nufs_statfs(const char *path, struct statvfs *st) {
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = BLOCK_COUNT - FIRST_DATA_BLOCK;
+    st->f_bfree = blocks_free_count() + blocks_freed_count();
+    st->f_bavail = st->f_bfree;
+    st->f_files = INODE_COUNT;
+    pthread_rwlock_rdlock(&namespace_lock);
+    st->f_ffree = inode_free_count();
+    pthread_rwlock_unlock(&namespace_lock);
+    st->f_favail = st->f_ffree;
+    st->f_namemax = DIR_NAME_LENGTH - 1;
     return 0;
 }
 
@@ -298,71 +1005,97 @@ int nufs_access(const char *path, int mask) {
  * @return 0 on success
  */
 int nufs_getattr(const char *path, struct stat *st) {
-    inode_t *node = inode_lookup(path);
-    if (!node) {
-        fprintf(stderr, "getattr: inode not found for path %s\n", path);
-        return -ENOENT;
+    int ctl = ctl_path(path);
+    if (ctl) {
+        return ctl_getattr(ctl, st);
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("getattr: inode not found for path %s\n", path);
+        return inum;
     }
+    // Report the size and times the buffered writes will give the file
+    inode_flush_buffered(inum);
+    inode_t *node = get_inode(inum);
+    inode_rdlock(node);
 
     // Fill stat struct with inode metadata
     memset(st, 0, sizeof(struct stat));
+    st->st_ino = inum;
     st->st_mode = node->mode;
     st->st_size = node->size;
-    st->st_nlink = (node->mode & S_IFDIR) ? 2 : 1;
+    st->st_nlink = S_ISDIR(node->mode) ? 2 : node->refs;
     st->st_uid = getuid();
     st->st_gid = getgid();
     st->st_atime = node->atime;
     st->st_mtime = node->mtime;
     st->st_ctime = node->ctime;
-    st->st_blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    st->st_blocks = (blkcnt_t)node->block_count * (BLOCK_SIZE / 512); // Holes and inline data take no blocks
     st->st_blksize = BLOCK_SIZE;
+    if (snapshot_path(path)) {
+        st->st_mode &= ~0222;
+    }
+    inode_unlock(node);
+    pthread_rwlock_unlock(&namespace_lock);
 
-    printf("getattr(%s) -> mode: %o, size: %d, blocks: %ld\n", path, node->mode, node->size, st->st_blocks);
+    TRACE("getattr(%d) -> mode: %o, size: %ld, blocks: %ld\n", inum, st->st_mode, st->st_size, st->st_blocks);
     return 0;
 }
 
 
 /**
  * Read directory contents.
+ *
+ * Entries are streamed in slot order: each gets the offset of the next one, so
+ * a large directory can be listed over several calls once the buffer fills up.
  * 
  * @param path Directory path
  * @param buf Buffer to fill with directory entries
  * @param filler Function to add entries to the buffer
- * @param offset Unused
+ * @param offset Offset of the last entry returned by the previous call, 0 to start
  * @param fi File information (unused)
  * @return 0 on success
  */
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    printf("readdir(%s)\n", path);
-
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    LOG_DEBUG("readdir(%s, %ld)\n", path, (long)offset);
+    int ctl = ctl_path(path);
+    if (ctl) {
+        return ctl_readdir(ctl, buf, filler, offset);
+    }
 
-    // List files and directories in the given directory
-    for (int i = 0; i < inode_count; i++) {
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return inum;
+    }
+    inode_t *dir = get_inode(inum);
+    if (!S_ISDIR(dir->mode)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return -ENOTDIR;
+    }
 
-        // Check if the inode path is a direct child of the given directory
-        if (strcmp(path, "/") == 0) {
-            const char *name = inodes[i].path + 1;
-            if (strlen(name) > 0 && strchr(name, '/') == NULL) {
-                filler(buf, name, NULL, 0);
-            }
-        // Check if the inode path is a child of the given directory
-        } else {
-            size_t path_len = strlen(path);
-            if (strncmp(inodes[i].path, path, path_len) == 0 && 
-                strlen(inodes[i].path) > path_len && 
-                inodes[i].path[path_len] == '/' &&
-                strchr(inodes[i].path + path_len + 1, '/') == NULL) {
-                
-                const char *name = inodes[i].path + path_len + 1;
-                filler(buf, name, NULL, 0);
-            }
-        }
+    // "." and ".." come first, at offsets 1 and 2; the entry in slot s is followed by offset s + 3
+    int full = 0;
+    if (offset < 1) {
+        full = filler(buf, ".", NULL, 1);
+    }
+    if (!full && offset < 2) {
+        full = filler(buf, "..", NULL, 2);
     }
+    dirent_t entry;
+    int slot = offset > 2 ? offset - 2 : 0;
+    while (!full && (slot = directory_next(dir, slot, &entry)) >= 0) {
+        full = filler(buf, entry.name, NULL, slot + 3);
+        slot++;
+    }
+    pthread_rwlock_unlock(&namespace_lock);
 
     return 0;
 }
+
 /**
  * Create a new file.
  * 
@@ -372,29 +1105,18 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
  * @return 0 on success, or negative error code
  */
 static int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    printf("mknod(%s, %o)\n", path, mode);
-
-    // Check if file already exists
-    if (inode_count >= MAX_FILES) {
-        fprintf(stderr, "mknod: max file count reached\n");
-        return -ENOSPC;
+    LOG_DEBUG("mknod(%s, %o)\n", path, mode);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    int rv = node_create(path, mode ? mode : (S_IFREG | 0644));
+    pthread_rwlock_unlock(&namespace_lock);
+    if (rv < 0) {
+        LOG_DEBUG("mknod: failed to create inode for %s\n", path);
+        return rv;
     }
 
-    // Check if path is too long
-    if (strlen(path) >= sizeof(inodes[0].path)) {
-        fprintf(stderr, "mknod: path too long\n");
-        return -ENAMETOOLONG;
-    }
-
-    // Check if file already exists
-    inode_t *node = inode_create(path, mode ? mode : (S_IFREG | 0644));
-    if (!node) {
-        fprintf(stderr, "mknod: failed to create inode for %s\n", path);
-        return -ENOSPC;
-    }
-
-    save_inodes();
-    printf("mknod: successfully created file %s\n", path);
+    storage_commit();
+    LOG_DEBUG("mknod: successfully created file %s\n", path);
     return 0;
 }
 
@@ -406,227 +1128,2050 @@ static int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
  * @return 0 on success, or negative error code
  */
 int nufs_mkdir(const char *path, mode_t mode) {
-    printf("mkdir(%s, %o)\n", path, mode);
-
-    if (inode_lookup(path)) {
-        printf("mkdir: directory %s already exists\n", path);
-        return -EEXIST;
+    LOG_DEBUG("mkdir(%s, %o)\n", path, mode);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    int rv = node_create(path, mode | S_IFDIR);
+    pthread_rwlock_unlock(&namespace_lock);
+    if (rv < 0) {
+        LOG_DEBUG("mkdir: failed to create directory %s\n", path);
+        return rv;
     }
 
-    inode_t *node = inode_create(path, mode | S_IFDIR);
-    if (!node) {
-        printf("mkdir: failed to create inode for directory %s\n", path);
-        return -ENOMEM;
-    }
-
-    node->size = 0;
-    save_inodes();
-    printf("mkdir: successfully created directory %s\n", path);
+    storage_commit();
+    LOG_DEBUG("mkdir: successfully created directory %s\n", path);
     return 0;
 }
 
 /**
- * Remove a file or directory.
+ * Remove a file's directory entry, and the file once nothing refers to it.
+ * The caller holds namespace_lock exclusively.
  * 
- * @param path File or directory path
+ * @param path File path
  * @return 0 on success, or negative error code
  */
-int nufs_unlink(const char *path) {
-    inode_t *inode = inode_lookup(path);
+static int node_unlink(const char *path) {
+    if (ctl_path(path)) {
+        return -EPERM;
+    }
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+    char name[DIR_NAME_LENGTH];
+    int parent = path_lookup_parent(path, name);
+    if (parent < 0) {
+        return parent;
+    }
+
+    inode_t *dir = get_inode(parent);
+    int inum = directory_lookup(dir, name);
     // Check if file exists
-    if (!inode) {
-        fprintf(stderr, "unlink: file %s not found\n", path);
+    if (inum < 0) {
+        LOG_DEBUG("unlink: file %s not found\n", path);
         return -ENOENT;
     }
     // Check if file is a directory
-    if (inode->mode & S_IFDIR) {
-        fprintf(stderr, "unlink: cannot unlink directory %s\n", path);
+    inode_t *inode = get_inode(inum);
+    if (S_ISDIR(inode->mode)) {
+        LOG_DEBUG("unlink: cannot unlink directory %s\n", path);
         return -EISDIR;
     }
 
-    // Free data blocks
-    for (int i = 0; i < inode->block_count; i++) {
-        if (inode->blocks[i] >= 0) {
-            free_block(inode->blocks[i]);
-        }
+    // Remove the name, then the inode and its data blocks once nothing refers to it
+    entry_delete(dir, name);
+    inode->refs--;
+    if (inode->refs <= 0) {
+        drop_buffered(inum);
+        free_inode(inum);
+    } else {
+        inode->ctime = time(NULL);
+        inode_dirty(inode);
     }
 
-    // Remove this specific inode by shifting the array
-    int index = inode - inodes;
-    memmove(&inodes[index], &inodes[index + 1], (inode_count - index - 1) * sizeof(inode_t));
-    inode_count--;
-
-    // Update the inode bitmap to reflect the removal
-    void *ibm = get_inode_bitmap();
-    bitmap_put(ibm, index, 0);
-
-    save_inodes();
-    printf("unlink(%s) -> 0\n", path);
+    LOG_DEBUG("unlink(%s) -> 0\n", path);
     return 0;
 }
 
 /**
- * Write data to a file.
+ * Remove a file.
  * 
  * @param path File path
+ * @return 0 on success, or negative error code
+ */
+int nufs_unlink(const char *path) {
+    pthread_rwlock_wrlock(&namespace_lock);
+    int rv = node_unlink(path);
+    pthread_rwlock_unlock(&namespace_lock);
+    storage_commit();
+    return rv;
+}
+
+/**
+ * Clear part of a file block.
+ *
+ * @param block_num Block number on disk
+ * @param from Offset of the first byte to clear within the block
+ * @param to Offset after the last byte to clear
+ * @return 0 on success, or -EIO
+ */
+static int block_zero(int block_num, size_t from, size_t to) {
+    int whole = from == 0 && to == (size_t)BLOCK_SIZE;
+    char *block = whole ? blocks_overwrite_block(block_num) : blocks_get_block(block_num);
+    if (!block) {
+        LOG_ERROR("write: failed to get block %d\n", block_num);
+        return -EIO;
+    }
+    memset(block + from, 0, to - from);
+    blocks_dirty(block_num);
+    blocks_put_block(block);
+    return 0;
+}
+
+/**
+ * Write data into a file's inline data.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode, with INODE_INLINE set
  * @param buf Buffer containing data to write
  * @param size Number of bytes to write
+ * @param offset Starting byte offset; the write must end within INODE_INLINE_SIZE
+ * @return Number of bytes written
+ */
+static int file_write_inline(inode_t *inode, const char *buf, size_t size, off_t offset) {
+    memcpy(inode->inline_data + offset, buf, size);
+    if (offset + size > inode->size) {
+        inode->size = offset + size;
+    }
+
+    time_t now = time(NULL);
+    inode->mtime = now;
+    inode->ctime = now;
+
+    inode_dirty(inode);
+    return size;
+}
+
+/**
+ * Move a file's inline data to a data block, or a cluster if the file is
+ * compressed, before a write that does not fit inline.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode, with INODE_INLINE set
+ * @return 0 on success, or -ENOSPC / -EIO with the data left inline
+ */
+static int file_promote_inline(inode_t *inode) {
+    char data[INODE_INLINE_SIZE];
+    int size = inode_take_inline(inode, data);
+    int rv = 0;
+    char *block = NULL;
+    if (size > 0 && (inode->flags & INODE_COMPRESSED)) {
+        char *cluster = calloc(1, COMPRESS_CLUSTER_SIZE);
+        rv = cluster ? compress_write_cluster(inode, 0, memcpy(cluster, data, size)) : -ENOMEM;
+        free(cluster);
+    } else if (size > 0) {
+        rv = inode_grow(inode, 1);
+        if (rv == 0) {
+            block = blocks_overwrite_block(inode_get_bnum(inode, 0));
+            rv = block ? 0 : -EIO;
+        }
+    }
+    if (rv < 0) {
+        // Neither inode_grow() nor compress_write_cluster() allocates anything when it runs out of space
+        if (inode->block_count == 0) {
+            inode->flags |= INODE_INLINE;
+            memcpy(inode->inline_data, data, size);
+            inode->size = size;
+            inode_dirty(inode);
+        }
+        return rv;
+    }
+    if (block) {
+        memcpy(block, data, size);
+        memset(block + size, 0, BLOCK_SIZE - size);
+        blocks_dirty(inode_get_bnum(inode, 0));
+        blocks_put_block(block);
+    }
+    inode->size = size;
+    inode_dirty(inode);
+    return 0;
+}
+
+/**
+ * Map the blocks a write goes to from a given offset on, allocating them if
+ * they are a hole. The allocator does not clear blocks, so the parts of new
+ * blocks the write does not cover are cleared here, before the data goes in.
+ * Blocks the file shares with others are copied first, so the write changes
+ * only this file (see inode_unshare()).
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode
+ * @param pos Byte offset the write continues at
+ * @param remaining Number of bytes left to write from pos on
+ * @param complete 1 if the write is sure to cover all of them, so shared blocks it overwrites need not be copied
+ * @param run Receives the number of contiguous disk blocks the write may use from pos on
+ * @param fresh Receives 1 if these blocks were just allocated, 0 if they held data before
+ * @return The disk block holding pos, or -ENOSPC / -EIO
+ */
+static int file_write_map(inode_t *inode, off_t pos, size_t remaining, int complete, int *run, int *fresh) {
+    int first = pos / BLOCK_SIZE;
+    int needed = (pos + remaining - 1) / BLOCK_SIZE - first + 1;
+    int block_num = inode_map(inode, first, run);
+    *fresh = block_num < 0;
+    if (!*fresh) {
+        // The run ends where the blocks switch between shared and unshared
+        int count = *run < needed ? *run : needed;
+        int shared = blocks_shared(block_num);
+        *run = 1;
+        while (*run < count && blocks_shared(block_num + *run) == shared) {
+            (*run)++;
+        }
+        if (!shared) {
+            return block_num;
+        }
+        int got = inode_unshare(inode, first, *run, pos, complete ? pos + (off_t)remaining : pos);
+        if (got < 0) {
+            return got;
+        }
+        *run = got;
+        return inode_get_bnum(inode, first);
+    }
+
+    // Fill as much of the hole as the write covers, in as few runs as possible
+    int want = *run < needed ? *run : needed;
+    inode_alloc_range(inode, first, want);
+    block_num = inode_map(inode, first, run);
+    if (block_num < 0) {
+        return -ENOSPC;
+    }
+    if (*run > want) {
+        *run = want; // Further blocks belong to the extent after the hole
+    }
+
+    off_t start = (off_t)first * BLOCK_SIZE;
+    off_t end = start + (off_t)*run * BLOCK_SIZE;
+    int rv = 0;
+    if (pos > start) {
+        rv = block_zero(block_num, 0, pos - start);
+    }
+    if (rv == 0 && pos + (off_t)remaining < end) {
+        rv = block_zero(block_num + *run - 1, pos + remaining - (end - BLOCK_SIZE), BLOCK_SIZE);
+    }
+    return rv < 0 ? rv : block_num;
+}
+
+/**
+ * Finish a write: update the file's size and times.
+ *
+ * @param inode Pointer to the file's inode
+ * @param size Number of bytes that were to be written
  * @param offset Starting byte offset
- * @param fi File information (unused)
- * @return Number of bytes written, or negative error code
+ * @param written Number of bytes actually written
+ * @param error Error that stopped the write early, if any
+ * @return Number of bytes written, or the error if nothing could be
  */
-static int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    inode_t *inode = inode_lookup(path);
-    // Check if file exists
-    if (!inode) {
-        fprintf(stderr, "write: inode not found for path %s\n", path);
-        return -ENOENT;
+static int file_end_write(inode_t *inode, size_t size, off_t offset, size_t written, int error) {
+    if (written == 0 && size > 0) {
+        return error < 0 ? error : -ENOSPC;
     }
 
-    // Check if file is a directory
-    if (!(inode->mode & S_IFREG)) {
-        fprintf(stderr, "write: cannot write to directory %s\n", path);
-        return -EISDIR;
+    // Update file size if necessary
+    if (offset + written > inode->size) {
+        inode->size = offset + written;
     }
 
-    // Write data block by block
+    time_t now = time(NULL);
+    inode->mtime = now;
+    inode->ctime = now;
+
+    inode_dirty(inode);
+    return written;
+}
+
+/**
+ * Write data to a compressed file, one cluster at a time. A cluster the
+ * write covers only in part is read first.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode, with INODE_COMPRESSED set and without INODE_INLINE
+ * @param buf Buffer containing data to write
+ * @param size Number of bytes to write
+ * @param offset Starting byte offset
+ * @return Number of bytes written, or negative error code
+ */
+static int file_write_compressed(inode_t *inode, const char *buf, size_t size, off_t offset) {
+    char *cluster_buf = malloc(COMPRESS_CLUSTER_SIZE);
+    if (!cluster_buf) {
+        return -ENOMEM;
+    }
     size_t total_written = 0;
+    int error = 0;
     while (total_written < size) {
-        int block_index = (offset + total_written) / BLOCK_SIZE;
-        size_t block_offset = (offset + total_written) % BLOCK_SIZE;
-        size_t to_write = BLOCK_SIZE - block_offset;
-
-        if (to_write > size - total_written) {
-            to_write = size - total_written;
+        off_t pos = offset + total_written;
+        int cluster = pos / COMPRESS_CLUSTER_SIZE;
+        size_t cluster_offset = pos % COMPRESS_CLUSTER_SIZE;
+        size_t len = COMPRESS_CLUSTER_SIZE - cluster_offset;
+        if (len > size - total_written) {
+            len = size - total_written;
+        }
+        if (len < (size_t)COMPRESS_CLUSTER_SIZE) {
+            error = compress_read_cluster(inode, cluster, cluster_buf);
+            if (error < 0) {
+                break;
+            }
+        }
+        memcpy(cluster_buf + cluster_offset, buf + total_written, len);
+        error = compress_write_cluster(inode, cluster, cluster_buf);
+        if (error < 0) {
+            break;
         }
+        total_written += len;
+    }
+    free(cluster_buf);
+    return file_end_write(inode, size, offset, total_written, error);
+}
 
-        if (block_index >= inode->block_count) {
-            int new_block = inode_add_block(inode);
-            if (new_block < 0) {
-                fprintf(stderr, "write: failed to allocate block\n");
-                return total_written ? total_written : -ENOSPC;
+/**
+ * Write data to a regular file.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ * 
+ * @param inode Pointer to the file's inode
+ * @param buf Buffer containing data to write
+ * @param size Number of bytes to write
+ * @param offset Starting byte offset
+ * @return Number of bytes written, or negative error code
+ */
+static int file_write(inode_t *inode, const char *buf, size_t size, off_t offset) {
+    if (offset + (off_t)size > FILE_MAX_SIZE) {
+        return -EFBIG;
+    }
+    if (inode->flags & INODE_INLINE) {
+        if (offset + size <= INODE_INLINE_SIZE) {
+            return file_write_inline(inode, buf, size, offset);
+        }
+        int rv = file_promote_inline(inode);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    if (inode->flags & INODE_COMPRESSED) {
+        return file_write_compressed(inode, buf, size, offset);
+    }
+    // Write data one contiguous run of blocks at a time; with deduplication, whole blocks one at a time
+    size_t total_written = 0;
+    int error = 0;
+    while (total_written < size) {
+        off_t pos = offset + total_written;
+        size_t block_offset = pos % BLOCK_SIZE;
+        int dedup = nufs_options.dedup && block_offset == 0 && size - total_written >= BLOCK_SIZE;
+        uint64_t hash = 0;
+        if (dedup) {
+            hash = dedup_hash(buf + total_written);
+            if (dedup_write_block(inode, pos / BLOCK_SIZE, buf + total_written, hash)) {
+                total_written += BLOCK_SIZE;
+                continue;
             }
         }
 
-        // Write data to block
-        int block_num = inode->blocks[block_index];
-        void *block = blocks_get_block(block_num);
+        int run, fresh;
+        int block_num = file_write_map(inode, pos, dedup ? BLOCK_SIZE : size - total_written, 1, &run, &fresh);
+        if (block_num < 0) {
+            error = block_num;
+            break;
+        }
+        run = blocks_span(block_num, run);
+        size_t to_write = (size_t)run * BLOCK_SIZE - block_offset;
+        if (to_write > size - total_written) {
+            to_write = size - total_written;
+        }
+
+        // Blocks written from start to end need not be read first
+        int whole = block_offset == 0 && to_write >= BLOCK_SIZE;
+        void *block = whole ? blocks_overwrite_block(block_num) : blocks_get_block(block_num);
         if (!block) {
-            fprintf(stderr, "write: failed to get block %d\n", block_num);
-            return -EIO;
+            LOG_ERROR("write: failed to get block %d\n", block_num);
+            error = -EIO;
+            break;
         }
 
         memcpy((char *)block + block_offset, buf + total_written, to_write);
+        for (int b = 0; b < (block_offset + to_write + BLOCK_SIZE - 1) / BLOCK_SIZE; b++) {
+            blocks_dirty(block_num + b);
+        }
+        blocks_put_block(block);
+        if (dedup) {
+            dedup_insert(hash, inode, pos / BLOCK_SIZE, block_num);
+        }
         total_written += to_write;
     }
+    return file_end_write(inode, size, offset, total_written, error);
+}
 
-    // Update file size if necessary
-    if (offset + total_written > inode->size) {
-        inode->size = offset + total_written;
+// Free a buffer vector as FUSE does once it has sent the reply: the memory of each piece, then the vector.
+static void bufvec_free(struct fuse_bufvec *vec) {
+    for (size_t i = 0; i < vec->count; i++) {
+        free(vec->buf[i].mem);
     }
+    free(vec);
+}
 
-    time_t now = time(NULL);
-    inode->mtime = now;
-    inode->ctime = now;
+/**
+ * Describe a byte range of a regular file as pieces of the disk image file,
+ * one per contiguous run of blocks; holes are pieces of zeros in memory.
+ * The runs are pinned (see blocks_pin()) until the calling thread's next
+ * operation, by which time FUSE has read them: until then a truncate or
+ * unlink cannot hand them to another file.
+ * The caller holds namespace_lock and the inode's lock.
+ *
+ * @param inode Pointer to the file's inode
+ * @param size Number of bytes in the range
+ * @param offset Starting byte offset
+ * @return A buffer vector allocated with malloc(), or NULL if out of memory
+ */
+static struct fuse_bufvec *file_bufvec(inode_t *inode, size_t size, off_t offset) {
+    int capacity = 1;
+    struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec));
+    if (!vec) {
+        return NULL;
+    }
+    *vec = FUSE_BUFVEC_INIT(0);
+    vec->count = 0;
+
+    size_t mapped = 0;
+    while (mapped < size) {
+        int block_index = (offset + mapped) / BLOCK_SIZE;
+        size_t block_offset = (offset + mapped) % BLOCK_SIZE;
+
+        int run;
+        int block_num = inode_map(inode, block_index, &run);
+        size_t len = (size_t)run * BLOCK_SIZE - block_offset;
+        if (len > size - mapped) {
+            len = size - mapped;
+        }
 
-    save_inodes();
-    return total_written;
+        if ((int)vec->count == capacity) {
+            capacity *= 2;
+            struct fuse_bufvec *grown = realloc(vec, sizeof(struct fuse_bufvec) + (capacity - 1) * sizeof(struct fuse_buf));
+            if (!grown) {
+                bufvec_free(vec);
+                return NULL;
+            }
+            vec = grown;
+        }
+        // FUSE frees the memory of each piece, so a hole gets zeros of its own
+        void *zeros = block_num < 0 ? calloc(1, len) : NULL;
+        if (block_num < 0 ? !zeros : blocks_pin(block_num, (block_offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE) < 0) {
+            bufvec_free(vec);
+            return NULL;
+        }
+        struct fuse_buf *piece = &vec->buf[vec->count++];
+        piece->size = len;
+        if (block_num < 0) {
+            piece->flags = 0;
+            piece->mem = zeros;
+            piece->fd = -1;
+            piece->pos = 0;
+        } else {
+            piece->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            piece->mem = NULL;
+            piece->fd = blocks_get_fd();
+            piece->pos = (off_t)block_num * BLOCK_SIZE + block_offset;
+        }
+        mapped += len;
+    }
+    return vec;
 }
 
 /**
- * Read data from a file.
- * 
- * @param path File path
- * @param buf Buffer to read data into
- * @param size Number of bytes to read
+ * Write data from a FUSE buffer to a regular file. The data goes straight
+ * from the buffer (possibly a pipe the kernel spliced it into) to the image
+ * file, without passing through a user space copy, one contiguous run of
+ * blocks at a time.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode
+ * @param buf Buffer vector holding the data
  * @param offset Starting byte offset
- * @param fi File information (unused)
- * @return Number of bytes read, or negative error code
+ * @return Number of bytes written, or negative error code
  */
-static int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    inode_t *inode = inode_lookup(path);
-    // Check if file exists
-    if (!inode) {
-        fprintf(stderr, "read: inode not found for path '%s'\n", path);
-        return -ENOENT;
+static int file_write_buf(inode_t *inode, struct fuse_bufvec *buf, off_t offset) {
+    size_t size = fuse_buf_size(buf);
+    if (offset + (off_t)size > FILE_MAX_SIZE) {
+        return -EFBIG;
     }
-
-    // Check if file is a directory
-    if (!(inode->mode & S_IFREG)) {
-        fprintf(stderr, "read: cannot read directory %s\n", path);
-        return -EISDIR;
+    if ((inode->flags & INODE_COMPRESSED) || nufs_options.dedup) {
+        // Compressed or deduplicated data never goes straight to the image; it is looked at in memory first
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = malloc(size);
+        if (!dst.buf[0].mem) {
+            return -ENOMEM;
+        }
+        ssize_t got = fuse_buf_copy(&dst, buf, 0);
+        int rv = got < 0 ? (int)got : file_write(inode, dst.buf[0].mem, got, offset);
+        free(dst.buf[0].mem);
+        return rv;
     }
-    
-    // Check if offset is beyond file size
-    if (offset >= inode->size) {
-        return 0;
+    if (inode->flags & INODE_INLINE) {
+        if (offset + size <= INODE_INLINE_SIZE) {
+            // Small enough to stay inline; copy it through a buffer
+            char data[INODE_INLINE_SIZE];
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+            dst.buf[0].mem = data;
+            ssize_t got = fuse_buf_copy(&dst, buf, 0);
+            if (got < 0) {
+                return got;
+            }
+            return file_write_inline(inode, data, got, offset);
+        }
+        int rv = file_promote_inline(inode);
+        if (rv < 0) {
+            return rv;
+        }
     }
-    
-    // Limit read size to file size
-    size_t remaining = inode->size - offset;
-    if (size > remaining) {
-        size = remaining;
+
+    size_t total_written = 0;
+    int error = 0;
+    while (total_written < size) {
+        off_t pos = offset + total_written;
+        int run, fresh;
+        // A copy from a pipe or file may stop short, so shared blocks are copied in full before it overwrites them
+        int block_num = file_write_map(inode, pos, size - total_written, 0, &run, &fresh);
+        if (block_num < 0) {
+            error = block_num;
+            break;
+        }
+        size_t len = (size_t)run * BLOCK_SIZE - pos % BLOCK_SIZE;
+        if (len > size - total_written) {
+            len = size - total_written;
+        }
+
+        // fuse_buf_copy() moves on in buf, so the next run continues where this one stopped
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd = blocks_get_fd();
+        dst.buf[0].pos = (off_t)block_num * BLOCK_SIZE + pos % BLOCK_SIZE;
+        ssize_t got = fuse_buf_copy(&dst, buf, 0);
+        if (got > 0) {
+            for (off_t b = dst.buf[0].pos / BLOCK_SIZE; b <= (dst.buf[0].pos + got - 1) / BLOCK_SIZE; b++) {
+                blocks_dirty(b);
+            }
+            total_written += got;
+        }
+        if (got < (ssize_t)len) {
+            error = got < 0 ? got : 0;
+            if (fresh) {
+                // Clear what the copy left of the new blocks, so they still read as zeros
+                size_t done = got > 0 ? got : 0;
+                off_t from = dst.buf[0].pos + done;
+                off_t to = (off_t)(block_num + run) * BLOCK_SIZE;
+                while (from < to) {
+                    int b = from / BLOCK_SIZE;
+                    block_zero(b, from % BLOCK_SIZE, BLOCK_SIZE);
+                    from = (off_t)(b + 1) * BLOCK_SIZE;
+                }
+            }
+            break;
+        }
     }
+    return file_end_write(inode, size, offset, total_written, error);
+}
 
-    size_t total_read = 0;
-    // Read data block by block
-    while (total_read < size) {
-        int block_index = (offset + total_read) / BLOCK_SIZE;
-        size_t block_offset = (offset + total_read) % BLOCK_SIZE;
-        size_t to_read = BLOCK_SIZE - block_offset;
+/**
+ * Write out the data a handle has buffered.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode
+ * @param h Handle holding the buffered data
+ * @return 0 on success, or negative error code
+ */
+static int handle_flush_locked(inode_t *inode, file_handle_t *h) {
+    int rv = 0;
+    if (h->buf_len > 0) {
+        rv = file_write(inode, h->buf, h->buf_len, h->buf_offset);
+        if (rv >= 0 && (size_t)rv < h->buf_len) {
+            rv = -ENOSPC;
+        }
+        h->buf_len = 0;
+    }
+    __atomic_store_n(&buffered_handles[h->inum], NULL, __ATOMIC_RELAXED);
+    return rv < 0 ? rv : 0;
+}
 
-        if (to_read > size - total_read) {
-            to_read = size - total_read;
+/**
+ * Write out the buffered writes to a file, if any, so its inode and blocks are current.
+ * A failure is kept in the buffering handle and reported by its next flush or fsync.
+ * The caller holds namespace_lock but not the inode's lock.
+ *
+ * @param inum Inode number of the file
+ * @return 1 if data was written out, 0 if nothing was buffered
+ */
+static int inode_flush_buffered(int inum) {
+    if (!__atomic_load_n(&buffered_handles[inum], __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    inode_t *inode = get_inode(inum);
+    inode_wrlock(inode);
+    file_handle_t *h = buffered_handles[inum];
+    if (h) {
+        int rv = handle_flush_locked(inode, h);
+        if (rv < 0 && h->error == 0) {
+            h->error = rv;
         }
+    }
+    inode_unlock(inode);
+    return h != NULL;
+}
 
-        if (block_index >= inode->block_count) {
-            break;
+/**
+ * Write data through an open file handle. Small writes that continue the
+ * previous one are collected in the handle's buffer and reach the file's
+ * blocks a buffer at a time, so a stream of small appends fills whole blocks
+ * and logs its metadata once per buffer instead of once per write.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode
+ * @param h Handle the data is written through
+ * @param buf Buffer containing data to write
+ * @param size Number of bytes to write
+ * @param offset Starting byte offset
+ * @param flushed Set to 1 if file data or metadata was changed, left alone if the data was only buffered
+ * @return Number of bytes written, or negative error code
+ */
+static int handle_write(inode_t *inode, file_handle_t *h, const char *buf, size_t size, off_t offset, int *flushed) {
+    size_t capacity = (size_t)BLOCK_SIZE * WRITE_BUFFER_BLOCKS;
+    file_handle_t *owner = buffered_handles[h->inum];
+    if (owner && (owner != h || offset != h->buf_offset + (off_t)h->buf_len || h->buf_len + size > capacity)) {
+        int rv = handle_flush_locked(inode, owner);
+        *flushed = 1;
+        if (rv < 0) {
+            if (owner == h) {
+                return rv;
+            }
+            if (owner->error == 0) {
+                owner->error = rv;
+            }
         }
+    }
 
-        int block_num = inode->blocks[block_index];
-        void *block = blocks_get_block(block_num);
-        if (!block) {
-            fprintf(stderr, "read: failed to get block %d for path '%s'\n", block_num, path);
-            return -EIO;
+    if (size < capacity && !h->buf) {
+        h->buf = malloc(capacity);
+    }
+    if (size >= capacity || !h->buf) {
+        *flushed = 1;
+        return file_write(inode, buf, size, offset);
+    }
+
+    if (h->buf_len == 0) {
+        h->buf_offset = offset;
+    }
+    memcpy(h->buf + h->buf_len, buf, size);
+    h->buf_len += size;
+    __atomic_store_n(&buffered_handles[h->inum], h, __ATOMIC_RELAXED);
+    if (h->buf_len == capacity) {
+        *flushed = 1;
+        int rv = handle_flush_locked(inode, h);
+        if (rv < 0) {
+            return rv;
         }
+    }
+    return size;
+}
 
-        memcpy(buf + total_read, (char *)block + block_offset, to_read);
-        total_read += to_read;
+/**
+ * Write data to a file.
+ * 
+ * @param path File path
+ * @param buf Buffer containing data to write
+ * @param size Number of bytes to write
+ * @param offset Starting byte offset
+ * @param fi File information, with the handle from open() or create()
+ * @return Number of bytes written, or negative error code
+ */
+static int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    file_handle_t *ctl = file_handle(fi);
+    if (ctl && ctl->ctl) {
+        return ctl_write(ctl, buf, size, offset);
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = file_inum(path, fi);
+    // Check if file exists
+    if (inum < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("write: inode not found for path %s\n", path);
+        return inum;
+    }
+
+    // Check if file is a directory
+    inode_t *inode = get_inode(inum);
+    if (!S_ISREG(inode->mode)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("write: cannot write to directory %s\n", path);
+        return -EISDIR;
     }
 
-    inode->atime = time(NULL);
-    save_inodes();
+    inode_wrlock(inode);
+    int flushed = 0;
+    file_handle_t *h = file_handle(fi);
+    int rv;
+    if (h) {
+        rv = handle_write(inode, h, buf, size, offset, &flushed);
+    } else {
+        rv = file_write(inode, buf, size, offset);
+        flushed = 1;
+    }
+    inode_unlock(inode);
+    pthread_rwlock_unlock(&namespace_lock);
 
-    return total_read;
+    if (flushed) {
+        storage_commit();
+    }
+    TRACE("write(%d, %zu, %ld) -> %d\n", inum, size, offset, rv);
+    return rv;
 }
 
 /**
- * Initialize FUSE operations with custom filesystem functions.
+ * Write data to a file from a FUSE buffer vector, avoiding a copy through user space.
+ * Data already in memory goes through the handle's write buffer like nufs_write().
  * 
- * @param ops Pointer to the FUSE operations struct
+ * @param path File path
+ * @param buf Buffer vector holding the data
+ * @param offset Starting byte offset
+ * @param fi File information, with the handle from open() or create()
+ * @return Number of bytes written, or negative error code
  */
-void nufs_init_ops(struct fuse_operations *ops) {
-    memset(ops, 0, sizeof(struct fuse_operations));
-    ops->access = nufs_access;
-    ops->getattr = nufs_getattr;
-    ops->readdir = nufs_readdir;
-    ops->mknod = nufs_mknod;
-    ops->mkdir = nufs_mkdir;
-    ops->unlink = nufs_unlink;
-    ops->read = nufs_read;
-    ops->write = nufs_write;
-    ops->rename = nufs_rename;
+static int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    file_handle_t *ctl = file_handle(fi);
+    if (ctl && ctl->ctl) {
+        char command[DIR_NAME_LENGTH + 16];
+        size_t size = fuse_buf_size(buf);
+        if (size >= sizeof(command)) {
+            return -EINVAL;
+        }
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = command;
+        ssize_t got = fuse_buf_copy(&dst, buf, 0);
+        return got < 0 ? (int)got : ctl_write(ctl, command, got, offset);
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = file_inum(path, fi);
+    if (inum < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("write_buf: inode not found for path %s\n", path);
+        return inum;
+    }
+
+    inode_t *inode = get_inode(inum);
+    if (!S_ISREG(inode->mode)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("write_buf: cannot write to directory %s\n", path);
+        return -EISDIR;
+    }
+
+    inode_wrlock(inode);
+    int flushed = 1;
+    file_handle_t *h = file_handle(fi);
+    int rv = 0;
+    if (h && buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        flushed = 0;
+        rv = handle_write(inode, h, buf->buf[0].mem, buf->buf[0].size, offset, &flushed);
+    } else {
+        // Data in a pipe goes straight to the image, after what is buffered before it
+        file_handle_t *owner = buffered_handles[inum];
+        if (owner) {
+            rv = handle_flush_locked(inode, owner);
+            if (rv < 0 && owner != h && owner->error == 0) {
+                owner->error = rv;
+                rv = 0;
+            }
+        }
+        if (rv == 0) {
+            rv = file_write_buf(inode, buf, offset);
+        }
+    }
+    inode_unlock(inode);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    if (flushed) {
+        storage_commit();
+    }
+    TRACE("write_buf(%d, %ld) -> %d\n", inum, offset, rv);
+    return rv;
 }
 
-// Main function to mount the filesystem with the given disk image.
-int main(int argc, char *argv[]) {
-    assert(argc > 2 && argc < 6);
-    printf("Mounting filesystem with disk image: %s\n", argv[argc - 1]);
+/**
+ * Check whether a read should update an inode's access time, according to the atime mount option.
+ * The caller holds the inode's lock.
+ *
+ * @param inode Pointer to the inode that was read
+ * @param now Time of the read
+ * @return 1 if the access time should be set to now, 0 otherwise
+ */
+static int atime_needs_update(inode_t *inode, time_t now) {
+    if (nufs_options.atime_mode == ATIME_NOATIME) {
+        return 0;
+    }
+    if (nufs_options.atime_mode == ATIME_RELATIME &&
+        inode->atime > inode->mtime && inode->atime > inode->ctime &&
+        now - inode->atime < RELATIME_MAX_AGE) {
+        return 0;
+    }
+    return inode->atime != now;
+}
+
+/**
+ * Update an inode's access time after a read, according to the atime mount option.
+ * The change stays in memory and is persisted with the next journal commit.
+ * The caller holds namespace_lock but not the inode's lock, which is taken
+ * exclusively only when the access time actually changes.
+ *
+ * @param inode Pointer to the inode that was read
+ */
+static void inode_touch_atime(inode_t *inode) {
+    time_t now = time(NULL);
+    inode_rdlock(inode);
+    int update = atime_needs_update(inode, now);
+    inode_unlock(inode);
+    if (!update) {
+        return;
+    }
+
+    inode_wrlock(inode);
+    if (atime_needs_update(inode, now)) {
+        inode->atime = now;
+        inode_dirty(inode);
+    }
+    inode_unlock(inode);
+}
+
+/**
+ * Read the blocks of a byte range of a regular file that are not in memory
+ * yet, one request per contiguous run of blocks.
+ * The caller holds namespace_lock and the inode's lock.
+ *
+ * @param inode Pointer to the file's inode
+ * @param size Number of bytes in the range
+ * @param offset Starting byte offset
+ * @param wait 1 to wait for the reads (blocks_load()), 0 to only start them (blocks_prefetch())
+ */
+static void file_load(inode_t *inode, size_t size, off_t offset, int wait) {
+    int file_bnum = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
+    while (file_bnum <= last) {
+        int run;
+        int block_num = inode_map(inode, file_bnum, &run);
+        if (run > last - file_bnum + 1) {
+            run = last - file_bnum + 1;
+        }
+        if (block_num < 0) {
+            file_bnum += run; // A hole, nothing to read
+            continue;
+        }
+        if (wait) {
+            blocks_load(block_num, run);
+        } else {
+            blocks_prefetch(block_num, run);
+        }
+        file_bnum += run;
+    }
+}
+
+/**
+ * Read data from a compressed file, one cluster at a time.
+ * The caller holds namespace_lock and the inode's lock.
+ *
+ * @param inode Pointer to the file's inode, with INODE_COMPRESSED set and without INODE_INLINE
+ * @param buf Buffer to read data into
+ * @param size Number of bytes to read, which must not go past the end of the file
+ * @param offset Starting byte offset
+ * @return Number of bytes read, or negative error code
+ */
+static int file_read_compressed(inode_t *inode, char *buf, size_t size, off_t offset) {
+    char *cluster_buf = NULL;
+    size_t total_read = 0;
+    while (total_read < size) {
+        off_t pos = offset + total_read;
+        size_t cluster_offset = pos % COMPRESS_CLUSTER_SIZE;
+        size_t len = COMPRESS_CLUSTER_SIZE - cluster_offset;
+        if (len > size - total_read) {
+            len = size - total_read;
+        }
+        // A whole cluster goes straight to buf, the others through cluster_buf
+        char *to = buf + total_read;
+        if (len < (size_t)COMPRESS_CLUSTER_SIZE) {
+            if (!cluster_buf && !(cluster_buf = malloc(COMPRESS_CLUSTER_SIZE))) {
+                return -ENOMEM;
+            }
+            to = cluster_buf;
+        }
+        int rv = compress_read_cluster(inode, pos / COMPRESS_CLUSTER_SIZE, to);
+        if (rv < 0) {
+            free(cluster_buf);
+            return rv;
+        }
+        if (to == cluster_buf) {
+            memcpy(buf + total_read, cluster_buf + cluster_offset, len);
+        }
+        total_read += len;
+    }
+    free(cluster_buf);
+    return total_read;
+}
+
+/**
+ * Read data from a regular file.
+ * The caller holds namespace_lock and the inode's lock.
+ * 
+ * @param inode Pointer to the file's inode
+ * @param buf Buffer to read data into
+ * @param size Number of bytes to read
+ * @param offset Starting byte offset
+ * @return Number of bytes read, or negative error code
+ */
+static int file_read(inode_t *inode, char *buf, size_t size, off_t offset) {
+    // Check if offset is beyond file size
+    if (offset >= inode->size) {
+        return 0;
+    }
+    
+    // Limit read size to file size
+    size_t remaining = inode->size - offset;
+    if (size > remaining) {
+        size = remaining;
+    }
+
+    if (inode->flags & INODE_INLINE) {
+        memcpy(buf, inode->inline_data + offset, size);
+        return size;
+    }
+
+    if (size > (size_t)BLOCK_SIZE) {
+        // Fetch the blocks together rather than one at a time as they are copied
+        file_load(inode, size, offset, 1);
+    }
+    if (inode->flags & INODE_COMPRESSED) {
+        return file_read_compressed(inode, buf, size, offset);
+    }
+
+    size_t total_read = 0;
+    // Read data one contiguous run of blocks at a time
+    while (total_read < size) {
+        int block_index = (offset + total_read) / BLOCK_SIZE;
+        size_t block_offset = (offset + total_read) % BLOCK_SIZE;
+
+        int run;
+        int block_num = inode_map(inode, block_index, &run);
+        if (block_num < 0) {
+            // A hole reads as zeros
+            size_t to_clear = (size_t)run * BLOCK_SIZE - block_offset;
+            if (to_clear > size - total_read) {
+                to_clear = size - total_read;
+            }
+            memset(buf + total_read, 0, to_clear);
+            total_read += to_clear;
+            continue;
+        }
+        run = blocks_span(block_num, run);
+        void *block = blocks_get_block(block_num);
+        if (!block) {
+            LOG_ERROR("read: failed to get block %d for inode %d\n", block_num, inode_get_inum(inode));
+            return -EIO;
+        }
+
+        size_t to_read = (size_t)run * BLOCK_SIZE - block_offset;
+        if (to_read > size - total_read) {
+            to_read = size - total_read;
+        }
+
+        memcpy(buf + total_read, (char *)block + block_offset, to_read);
+        blocks_put_block(block);
+        total_read += to_read;
+    }
+    return total_read;
+}
+
+/**
+ * Prefetch the blocks after a read if it continues the previous read of the
+ * file. Once a sequential reader gets within half a window (-o readahead) of
+ * what was prefetched, the next window is requested, so its reads keep
+ * finding their blocks in memory.
+ * The caller holds namespace_lock and the inode's lock.
+ *
+ * @param inode Pointer to the file's inode
+ * @param offset Starting byte offset of the read
+ * @param size Number of bytes read
+ */
+static void file_read_ahead(inode_t *inode, off_t offset, size_t size) {
+    read_ahead_t *ra = &read_ahead[inode_get_inum(inode)];
+    int64_t end = offset + size;
+    int64_t expected = __atomic_exchange_n(&ra->next, end, __ATOMIC_RELAXED);
+    int64_t window = (int64_t)nufs_options.readahead_kb * 1024;
+    if (offset != expected) {
+        // A seek; start over from here
+        __atomic_store_n(&ra->ahead, end, __ATOMIC_RELAXED);
+        return;
+    }
+
+    int64_t ahead = __atomic_load_n(&ra->ahead, __ATOMIC_RELAXED);
+    if (ahead < end) {
+        ahead = end;
+    }
+    int64_t limit = end + window < inode->size ? end + window : inode->size;
+    if (window == 0 || ahead - end >= window / 2 || limit <= ahead) {
+        return;
+    }
+    __atomic_store_n(&ra->ahead, limit, __ATOMIC_RELAXED);
+    file_load(inode, limit - ahead, ahead, 0);
+}
+
+/**
+ * Read data from a file.
+ * 
+ * @param path File path
+ * @param buf Buffer to read data into
+ * @param size Number of bytes to read
+ * @param offset Starting byte offset
+ * @param fi File information, with the handle from open() or create()
+ * @return Number of bytes read, or negative error code
+ */
+static int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    file_handle_t *h = file_handle(fi);
+    if (h && h->ctl) {
+        return ctl_read(h, buf, size, offset);
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = file_inum(path, fi);
+    // Check if file exists
+    if (inum < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("read: inode not found for path '%s'\n", path);
+        return inum;
+    }
+
+    // Check if file is a directory
+    inode_t *inode = get_inode(inum);
+    if (!S_ISREG(inode->mode)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("read: cannot read directory %s\n", path);
+        return -EISDIR;
+    }
+    inode_flush_buffered(inum);
+
+    inode_rdlock(inode);
+    int rv = file_read(inode, buf, size, offset);
+    if (rv > 0) {
+        file_read_ahead(inode, offset, rv);
+    }
+    inode_unlock(inode);
+    if (rv > 0) {
+        inode_touch_atime(inode);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    TRACE("read(%d, %zu, %ld) -> %d\n", inum, size, offset, rv);
+    return rv;
+}
+
+/**
+ * Read data from a file without copying it. The returned buffer vector points
+ * at the file's blocks in the image file, so FUSE can splice them to the
+ * kernel directly. FUSE frees the vector and the memory of each piece.
+ * 
+ * @param path File path
+ * @param bufp Receives the buffer vector describing the data
+ * @param size Number of bytes to read
+ * @param offset Starting byte offset
+ * @param fi File information, with the handle from open() or create()
+ * @return 0 on success, or negative error code
+ */
+static int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    file_handle_t *h = file_handle(fi);
+    if (h && h->ctl) {
+        struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec));
+        char *data = malloc(size ? size : 1);
+        if (!vec || !data) {
+            free(vec);
+            free(data);
+            return -ENOMEM;
+        }
+        *vec = FUSE_BUFVEC_INIT(0);
+        vec->buf[0].mem = data;
+        vec->buf[0].size = ctl_read(h, data, size, offset);
+        *bufp = vec;
+        return 0;
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = file_inum(path, fi);
+    if (inum < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("read_buf: inode not found for path '%s'\n", path);
+        return inum;
+    }
+
+    inode_t *inode = get_inode(inum);
+    if (!S_ISREG(inode->mode)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        LOG_DEBUG("read_buf: cannot read directory %s\n", path);
+        return -EISDIR;
+    }
+    inode_flush_buffered(inum);
+
+    inode_rdlock(inode);
+    // Limit read size to file size
+    if (offset >= inode->size) {
+        size = 0;
+    } else if (size > (size_t)(inode->size - offset)) {
+        size = inode->size - offset;
+    }
+    struct fuse_bufvec *vec;
+    if (inode->flags & (INODE_INLINE | INODE_COMPRESSED)) {
+        // Copy the data out with the vector, the inode may change once unlocked; compressed data has to be anyway
+        vec = malloc(sizeof(struct fuse_bufvec));
+        char *data = vec ? malloc(size ? size : 1) : NULL;
+        if (vec && !data) {
+            free(vec);
+            vec = NULL;
+        }
+        if (vec) {
+            *vec = FUSE_BUFVEC_INIT(size);
+            vec->buf[0].mem = data;
+            int got = size > 0 ? file_read(inode, data, size, offset) : 0;
+            if (got < 0) {
+                bufvec_free(vec);
+                inode_unlock(inode);
+                pthread_rwlock_unlock(&namespace_lock);
+                return got;
+            }
+        }
+    } else {
+        vec = file_bufvec(inode, size, offset);
+    }
+    inode_unlock(inode);
+    if (vec && size > 0) {
+        inode_touch_atime(inode);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+
+    if (!vec) {
+        return -ENOMEM;
+    }
+    *bufp = vec;
+    return 0;
+}
+
+// Clear bytes [from, to) of a file block, if it is mapped; a shared block is copied first.
+static int file_zero_block(inode_t *inode, int file_bnum, size_t from, size_t to) {
+    int block_num = inode_get_bnum(inode, file_bnum);
+    if (block_num >= 0 && blocks_shared(block_num)) {
+        int64_t start = (int64_t)file_bnum * BLOCK_SIZE;
+        int rv = inode_unshare(inode, file_bnum, 1, start + from, start + to);
+        if (rv < 0) {
+            return rv;
+        }
+        block_num = inode_get_bnum(inode, file_bnum);
+    }
+    return block_num < 0 ? 0 : block_zero(block_num, from, to);
+}
+
+// Clear bytes [from, to) of one cluster of a compressed file by rewriting it.
+static int file_zero_cluster(inode_t *inode, off_t from, off_t to) {
+    char *cluster_buf = malloc(COMPRESS_CLUSTER_SIZE);
+    if (!cluster_buf) {
+        return -ENOMEM;
+    }
+    int cluster = from / COMPRESS_CLUSTER_SIZE;
+    off_t start = (off_t)cluster * COMPRESS_CLUSTER_SIZE;
+    int rv = compress_read_cluster(inode, cluster, cluster_buf);
+    if (rv == 0) {
+        memset(cluster_buf + (from - start), 0, to - from);
+        rv = compress_write_cluster(inode, cluster, cluster_buf);
+    }
+    free(cluster_buf);
+    return rv;
+}
+
+/**
+ * Change the size of a regular file. Shrinking frees the blocks past the new
+ * end and clears the rest of the last one; growing leaves a hole, so nothing
+ * is allocated. A file truncated to nothing takes its data inline again.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode
+ * @param size New size in bytes
+ * @return 0 on success, or negative error code
+ */
+static int file_truncate(inode_t *inode, off_t size) {
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (size > FILE_MAX_SIZE) {
+        return -EFBIG;
+    }
+    if ((inode->flags & INODE_INLINE) && size > INODE_INLINE_SIZE) {
+        int rv = file_promote_inline(inode);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+
+    if (inode->flags & INODE_INLINE) {
+        // Inline data is zero past the size
+        if (size < inode->size) {
+            memset(inode->inline_data + size, 0, inode->size - size);
+        }
+    } else if ((inode->flags & INODE_COMPRESSED) && size < inode->size) {
+        // The last cluster is rewritten first, so a failure changes nothing
+        off_t tail_end = (size + COMPRESS_CLUSTER_SIZE - 1) / COMPRESS_CLUSTER_SIZE * COMPRESS_CLUSTER_SIZE;
+        if (size < tail_end) {
+            int rv = file_zero_cluster(inode, size, tail_end);
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        int keep = tail_end / BLOCK_SIZE;
+        inode_free_range(inode, keep, INODE_MAX_BLOCKS - keep);
+        if (inode->extent_count == 0 && size <= INODE_INLINE_SIZE) {
+            memset(inode->inline_data, 0, INODE_INLINE_SIZE);
+            inode->flags |= INODE_INLINE;
+        }
+    } else if (size < inode->size) {
+        // Bytes past the end of the last block must read as zeros if the file grows again. They are cleared
+        // first, so a failure changes nothing
+        if (size % BLOCK_SIZE) {
+            int rv = file_zero_block(inode, size / BLOCK_SIZE, size % BLOCK_SIZE, BLOCK_SIZE);
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        int keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        inode_free_range(inode, keep, INODE_MAX_BLOCKS - keep);
+        if (inode->extent_count == 0 && size <= INODE_INLINE_SIZE) {
+            memset(inode->inline_data, 0, INODE_INLINE_SIZE);
+            inode->flags |= INODE_INLINE;
+        }
+    }
+    inode->size = size;
+
+    time_t now = time(NULL);
+    inode->mtime = now;
+    inode->ctime = now;
+    inode_dirty(inode);
+    return 0;
+}
+
+/**
+ * Allocate the blocks of a byte range of a regular file, as fallocate() does.
+ * The holes in the range get cleared blocks; data already there stays.
+ * How much space a compressed file needs is not known until it is written,
+ * so its blocks cannot be allocated ahead.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode
+ * @param offset Starting byte offset
+ * @param length Number of bytes in the range
+ * @param keep_size 1 to leave the file's size alone, 0 to extend it to the end of the range
+ * @return 0 on success, or -ENOSPC / -EIO, or -EOPNOTSUPP for a compressed file
+ */
+static int file_allocate(inode_t *inode, off_t offset, off_t length, int keep_size) {
+    off_t end = offset + length;
+    int rv = 0;
+    if (inode->flags & INODE_COMPRESSED) {
+        return -EOPNOTSUPP;
+    }
+    if ((inode->flags & INODE_INLINE) && end > INODE_INLINE_SIZE) {
+        rv = file_promote_inline(inode);
+    }
+    if (rv == 0 && !(inode->flags & INODE_INLINE)) {
+        int last = (end - 1) / BLOCK_SIZE;
+        int file_bnum = offset / BLOCK_SIZE;
+        while (file_bnum <= last) {
+            int run;
+            if (inode_map(inode, file_bnum, &run) >= 0) {
+                file_bnum += run;
+                continue;
+            }
+            int want = run < last - file_bnum + 1 ? run : last - file_bnum + 1;
+            inode_alloc_range(inode, file_bnum, want);
+            int block_num = inode_map(inode, file_bnum, &run);
+            if (block_num < 0) {
+                rv = -ENOSPC;
+                break;
+            }
+            if (run > want) {
+                run = want;
+            }
+            rv = blocks_zero_run(block_num, run);
+            if (rv < 0) {
+                break;
+            }
+            file_bnum += run;
+        }
+    }
+
+    if (rv == 0 && !keep_size && end > inode->size) {
+        inode->size = end;
+        inode->mtime = time(NULL);
+    }
+    inode->ctime = time(NULL);
+    inode_dirty(inode);
+    return rv;
+}
+
+/**
+ * Punch a hole into a regular file: free the blocks a byte range covers
+ * whole and clear its parts of the others. The size stays the same.
+ * The caller holds namespace_lock and the inode's lock exclusively.
+ *
+ * @param inode Pointer to the file's inode
+ * @param offset Starting byte offset
+ * @param length Number of bytes in the range
+ * @return 0 on success, or negative error code
+ */
+static int file_punch_hole(inode_t *inode, off_t offset, off_t length) {
+    off_t end = offset + length;
+    int rv = 0;
+    if (inode->flags & INODE_INLINE) {
+        if (offset < inode->size) {
+            memset(inode->inline_data + offset, 0, (end < inode->size ? end : inode->size) - offset);
+        }
+    } else if (inode->flags & INODE_COMPRESSED) {
+        // Clusters the range covers whole are freed, the ones at its ends are rewritten
+        off_t head_end = (offset + COMPRESS_CLUSTER_SIZE - 1) / COMPRESS_CLUSTER_SIZE * COMPRESS_CLUSTER_SIZE;
+        off_t tail_start = end / COMPRESS_CLUSTER_SIZE * COMPRESS_CLUSTER_SIZE;
+        if (offset < head_end) {
+            rv = file_zero_cluster(inode, offset, head_end < end ? head_end : end);
+        }
+        if (rv == 0 && head_end <= tail_start && tail_start < end) {
+            rv = file_zero_cluster(inode, tail_start, end);
+        }
+        if (rv == 0 && head_end < tail_start) {
+            rv = inode_free_range(inode, head_end / BLOCK_SIZE, (tail_start - head_end) / BLOCK_SIZE);
+        }
+    } else {
+        int first = offset / BLOCK_SIZE;
+        int last = (end - 1) / BLOCK_SIZE;
+        size_t head = offset % BLOCK_SIZE;                    // Bytes of the first block before the range
+        size_t tail = end - (off_t)last * BLOCK_SIZE;          // Bytes of the last block in the range
+        if (head > 0) {
+            rv = file_zero_block(inode, first, head, first == last ? tail : (size_t)BLOCK_SIZE);
+        }
+        if (rv == 0 && tail < (size_t)BLOCK_SIZE && (first != last || head == 0)) {
+            rv = file_zero_block(inode, last, first == last ? head : 0, tail);
+        }
+        int free_first = head > 0 ? first + 1 : first;
+        int free_end = tail < (size_t)BLOCK_SIZE ? last : last + 1;
+        if (rv == 0 && free_first < free_end) {
+            rv = inode_free_range(inode, free_first, free_end - free_first);
+        }
+    }
+
+    time_t now = time(NULL);
+    inode->mtime = now;
+    inode->ctime = now;
+    inode_dirty(inode);
+    return rv;
+}
+
+/**
+ * Find the next data or hole in a regular file, like lseek() with SEEK_DATA
+ * or SEEK_HOLE. The end of the file counts as a hole; inline data is all data.
+ * The caller holds namespace_lock and the inode's lock.
+ *
+ * @param inode Pointer to the file's inode
+ * @param offset Byte offset to start looking at
+ * @param data 1 to look for data, 0 for a hole
+ * @return The offset found, or -ENXIO if offset is not within the file or no data follows it
+ */
+static int64_t file_seek_hole(inode_t *inode, int64_t offset, int data) {
+    if (offset < 0 || offset >= inode->size) {
+        return -ENXIO;
+    }
+    if (inode->flags & INODE_INLINE) {
+        return data ? offset : inode->size;
+    }
+    int64_t pos = offset;
+    while (pos < inode->size) {
+        int file_bnum = pos / BLOCK_SIZE;
+        int compressed = inode->flags & INODE_COMPRESSED;
+        if (compressed) {
+            // A cluster is data if its first block is mapped
+            file_bnum -= file_bnum % COMPRESS_CLUSTER_BLOCKS;
+        }
+        int run;
+        int mapped = inode_map(inode, file_bnum, &run) >= 0;
+        if (mapped == data) {
+            return pos;
+        }
+        if (compressed && mapped) {
+            run = (run + COMPRESS_CLUSTER_BLOCKS - 1) / COMPRESS_CLUSTER_BLOCKS * COMPRESS_CLUSTER_BLOCKS;
+        }
+        pos = (file_bnum + run) * (int64_t)BLOCK_SIZE;
+    }
+    return data ? -ENXIO : inode->size;
+}
+
+/**
+ * Copy a byte range from one regular file to another through memory.
+ * The caller holds namespace_lock, the source inode's lock and the
+ * destination inode's lock exclusively.
+ *
+ * @param dst Pointer to the destination file's inode
+ * @param src Pointer to the source file's inode
+ * @param src_offset Starting byte offset in src
+ * @param dst_offset Starting byte offset in dst
+ * @param length Number of bytes to copy
+ * @return Number of bytes copied, or negative error code if nothing could be
+ */
+static int64_t file_copy(inode_t *dst, inode_t *src, int64_t src_offset, int64_t dst_offset, int64_t length) {
+    char *buf = malloc(length < COPY_CHUNK ? length : COPY_CHUNK);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    int64_t done = 0;
+    int rv = 0;
+    while (done < length) {
+        size_t n = length - done < COPY_CHUNK ? length - done : COPY_CHUNK;
+        rv = file_read(src, buf, n, src_offset + done);
+        if (rv <= 0) {
+            break;
+        }
+        rv = file_write(dst, buf, rv, dst_offset + done);
+        if (rv <= 0) {
+            break;
+        }
+        done += rv;
+    }
+    free(buf);
+    return done > 0 || rv >= 0 ? done : rv;
+}
+
+/**
+ * Copy a byte range from one regular file to another, or to another range of
+ * the same file, like copy_file_range(). Where both ranges start at the same
+ * offset within a block, the blocks the range covers are shared rather than
+ * copied, and so is a last, partial block that ends both files; the rest goes
+ * through memory. Compressed files share whole clusters, and only with each
+ * other; an empty destination takes on the source's compression.
+ * The caller holds namespace_lock, the source inode's lock and
+ * the destination inode's lock exclusively.
+ *
+ * @param dst Pointer to the destination file's inode
+ * @param src Pointer to the source file's inode
+ * @param src_offset Starting byte offset in src
+ * @param dst_offset Starting byte offset in dst
+ * @param length Number of bytes to copy, 0 for everything from src_offset on
+ * @return Number of bytes copied, which stops at the end of src, or negative error code
+ */
+static int64_t file_copy_range(inode_t *dst, inode_t *src, int64_t src_offset, int64_t dst_offset, int64_t length) {
+    if (src_offset < 0 || dst_offset < 0 || length < 0) {
+        return -EINVAL;
+    }
+    if (src_offset >= src->size) {
+        return 0;
+    }
+    if (length == 0 || length > src->size - src_offset) {
+        length = src->size - src_offset;
+    }
+    if (dst_offset > FILE_MAX_SIZE - length) {
+        return -EFBIG;
+    }
+    if (src == dst && src_offset < dst_offset + length && dst_offset < src_offset + length) {
+        return -EINVAL;
+    }
+
+    int compressed = src->flags & INODE_COMPRESSED;
+    if (dst != src && dst->size == 0 && dst->block_count == 0) {
+        dst->flags = (dst->flags & ~INODE_COMPRESSED) | compressed;
+    }
+    int64_t unit = compressed ? COMPRESS_CLUSTER_SIZE : BLOCK_SIZE; // What can be shared
+
+    int64_t done = 0;
+    if (!(src->flags & INODE_INLINE) && (dst->flags & INODE_COMPRESSED) == compressed &&
+        src_offset % unit == dst_offset % unit) {
+        // The head up to the first boundary has to be copied
+        int64_t head = (unit - src_offset % unit) % unit;
+        if (head > length) {
+            head = length;
+        }
+        if (head > 0) {
+            done = file_copy(dst, src, src_offset, dst_offset, head);
+            if (done < head) {
+                return done;
+            }
+        }
+        int64_t shared = (length - done) / unit * unit;
+        if (src_offset + length == src->size && dst_offset + length >= dst->size) {
+            shared = length - done; // The rest of the last block or cluster is zero in both files
+        }
+        if (shared > 0) {
+            int rv = dst->flags & INODE_INLINE ? file_promote_inline(dst) : 0;
+            if (rv == 0) {
+                rv = inode_clone_range(dst, (dst_offset + done) / BLOCK_SIZE, src, (src_offset + done) / BLOCK_SIZE,
+                                       (shared + unit - 1) / unit * (unit / BLOCK_SIZE));
+            }
+            if (rv < 0) {
+                return done > 0 ? done : rv;
+            }
+            done += shared;
+            if (dst_offset + done > dst->size) {
+                dst->size = dst_offset + done;
+            }
+            time_t now = time(NULL);
+            dst->mtime = now;
+            dst->ctime = now;
+            inode_dirty(dst);
+        }
+    }
+    if (done < length) {
+        int64_t rv = file_copy(dst, src, src_offset + done, dst_offset + done, length - done);
+        if (rv < 0) {
+            return done > 0 ? done : rv;
+        }
+        done += rv;
+    }
+    return done;
+}
+
+/**
+ * Look up the regular file an operation that changes its blocks applies to, and
+ * write out its buffered data, so the operation sees it. On success the caller
+ * holds namespace_lock; on failure it is released.
+ *
+ * @param path File path
+ * @param fi File information, or NULL
+ * @return The inode number, or negative error code
+ */
+static int file_lookup_flushed(const char *path, struct fuse_file_info *fi) {
+    file_handle_t *h = file_handle(fi);
+    if ((h && h->ctl) || ctl_path(path)) {
+        return -EACCES;
+    }
+    if (snapshot_path(path)) {
+        return -EROFS;
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = file_inum(path, fi);
+    if (inum < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return inum;
+    }
+    if (!S_ISREG(get_inode(inum)->mode)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return -EISDIR;
+    }
+    inode_flush_buffered(inum);
+    return inum;
+}
+
+/**
+ * Change the size of an open file.
+ *
+ * @param path File path
+ * @param size New size in bytes
+ * @param fi File information, with the handle from open() or create(), or NULL
+ * @return 0 on success, or negative error code
+ */
+static int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    // A shell's > redirection truncates the snapshot control file before writing to it
+    if (ctl_path(path) == CTL_SNAPSHOT && size == 0) {
+        return 0;
+    }
+    int inum = file_lookup_flushed(path, fi);
+    if (inum < 0) {
+        LOG_DEBUG("truncate: cannot truncate %s: %s\n", path, strerror(-inum));
+        return inum;
+    }
+    inode_t *inode = get_inode(inum);
+    inode_wrlock(inode);
+    int rv = file_truncate(inode, size);
+    inode_unlock(inode);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    storage_commit();
+    TRACE("truncate(%d, %ld) -> %d\n", inum, size, rv);
+    return rv;
+}
+
+/**
+ * Change the size of a file.
+ *
+ * @param path File path
+ * @param size New size in bytes
+ * @return 0 on success, or negative error code
+ */
+static int nufs_truncate(const char *path, off_t size) {
+    return nufs_ftruncate(path, size, NULL);
+}
+
+/**
+ * Allocate or deallocate the blocks of a byte range of a file. Supports
+ * mode 0, FALLOC_FL_KEEP_SIZE and FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE.
+ *
+ * @param path File path
+ * @param mode Zero or a combination of the FALLOC_FL_* flags above
+ * @param offset Starting byte offset
+ * @param length Number of bytes in the range
+ * @param fi File information, with the handle from open() or create()
+ * @return 0 on success, or negative error code
+ */
+static int nufs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE) ||
+        ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if (length > FILE_MAX_SIZE - offset) {
+        return -EFBIG;
+    }
+    int inum = file_lookup_flushed(path, fi);
+    if (inum < 0) {
+        LOG_DEBUG("fallocate: cannot allocate in %s: %s\n", path, strerror(-inum));
+        return inum;
+    }
+    inode_t *inode = get_inode(inum);
+    inode_wrlock(inode);
+    int rv = mode & FALLOC_FL_PUNCH_HOLE ? file_punch_hole(inode, offset, length)
+                                         : file_allocate(inode, offset, length, mode & FALLOC_FL_KEEP_SIZE);
+    inode_unlock(inode);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    storage_commit();
+    TRACE("fallocate(%d, %x, %ld) -> %d\n", inum, mode, offset, rv);
+    return rv;
+}
+
+/**
+ * Handle NUFS_IOC_SEEK_DATA and NUFS_IOC_SEEK_HOLE.
+ *
+ * @param inum Inode number of the file; the caller holds namespace_lock
+ * @param cmd NUFS_IOC_SEEK_DATA or NUFS_IOC_SEEK_HOLE
+ * @param offset The offset to start looking at, which receives the offset found
+ * @return 0 on success, or negative error code
+ */
+static int ioctl_seek_hole(int inum, unsigned int cmd, int64_t *offset) {
+    inode_t *inode = get_inode(inum);
+    inode_rdlock(inode);
+    int64_t rv = file_seek_hole(inode, *offset, cmd == NUFS_IOC_SEEK_DATA);
+    inode_unlock(inode);
+
+    TRACE("ioctl(%d, %x, %ld) -> %ld\n", inum, cmd, *offset, rv);
+    if (rv < 0) {
+        return rv;
+    }
+    *offset = rv;
+    return 0;
+}
+
+/**
+ * Handle NUFS_IOC_COPY_RANGE. The two inodes are locked in the order of their
+ * numbers, so two copies in opposite directions cannot deadlock.
+ *
+ * @param inum Inode number of the destination file; the caller holds namespace_lock
+ * @param arg The ioctl's argument, whose length receives the bytes copied
+ * @return 0 on success, or negative error code
+ */
+static int ioctl_copy_range(int inum, struct nufs_copy_range *arg) {
+    if (strnlen(arg->src_path, NUFS_COPY_PATH_MAX) == NUFS_COPY_PATH_MAX || arg->src_path[0] != '/') {
+        return -EINVAL;
+    }
+    if (ctl_path(arg->src_path)) {
+        return -EACCES;
+    }
+    int src_inum = path_lookup(arg->src_path);
+    if (src_inum < 0) {
+        return src_inum;
+    }
+    if (!S_ISREG(get_inode(src_inum)->mode)) {
+        return -EISDIR;
+    }
+    inode_flush_buffered(src_inum);
+
+    inode_t *dst = get_inode(inum);
+    inode_t *src = get_inode(src_inum);
+    if (src_inum < inum) {
+        inode_rdlock(src);
+    }
+    inode_wrlock(dst);
+    if (src_inum > inum) {
+        inode_rdlock(src);
+    }
+    int64_t rv = file_copy_range(dst, src, arg->src_offset, arg->dest_offset, arg->length);
+    if (src != dst) {
+        inode_unlock(src);
+    }
+    inode_unlock(dst);
+
+    TRACE("ioctl(%d, copy_range %d, %ld) -> %ld\n", inum, src_inum, arg->dest_offset, rv);
+    if (rv < 0) {
+        return rv;
+    }
+    arg->length = rv;
+    return 0;
+}
+
+/**
+ * Handle NUFS_IOC_GET_COMPRESS and NUFS_IOC_SET_COMPRESS.
+ *
+ * @param inum Inode number of the file; the caller holds namespace_lock
+ * @param cmd NUFS_IOC_GET_COMPRESS or NUFS_IOC_SET_COMPRESS
+ * @param compress Receives whether the file is compressed, or holds whether it is to be
+ * @return 0 on success, or -EBUSY if the file already has data blocks
+ */
+static int ioctl_compress(int inum, unsigned int cmd, int *compress) {
+    inode_t *inode = get_inode(inum);
+    int rv = 0;
+    if (cmd == NUFS_IOC_GET_COMPRESS) {
+        inode_rdlock(inode);
+        *compress = (inode->flags & INODE_COMPRESSED) != 0;
+        inode_unlock(inode);
+        return 0;
+    }
+    inode_wrlock(inode);
+    if (inode->block_count > 0) {
+        rv = (inode->flags & INODE_COMPRESSED) == (*compress ? INODE_COMPRESSED : 0) ? 0 : -EBUSY;
+    } else {
+        inode->flags = (inode->flags & ~INODE_COMPRESSED) | (*compress ? INODE_COMPRESSED : 0);
+        inode->ctime = time(NULL);
+        inode_dirty(inode);
+    }
+    inode_unlock(inode);
+    TRACE("ioctl(%d, %x, %d) -> %d\n", inum, cmd, *compress, rv);
+    return rv;
+}
+
+/**
+ * Handle the ioctl()s of nufs_ioctl.h.
+ *
+ * @param path File path
+ * @param cmd The command, one of the NUFS_IOC_* values
+ * @param arg Argument in the caller's address space (unused)
+ * @param fi File information, with the handle from open() or create()
+ * @param flags FUSE_IOCTL_* flags
+ * @param data The argument, copied in and out by FUSE
+ * @return 0 on success, or negative error code
+ */
+static int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    unsigned int command = cmd;
+    if (command != NUFS_IOC_SEEK_DATA && command != NUFS_IOC_SEEK_HOLE && command != NUFS_IOC_COPY_RANGE &&
+        command != NUFS_IOC_GET_COMPRESS && command != NUFS_IOC_SET_COMPRESS) {
+        return -ENOTTY;
+    }
+    file_handle_t *h = file_handle(fi);
+    if (h && h->ctl) {
+        return -ENOTTY;
+    }
+    int changes = command == NUFS_IOC_COPY_RANGE || command == NUFS_IOC_SET_COMPRESS;
+    if (changes && h && h->access == O_RDONLY) {
+        return -EBADF; // As write() on a file not open for writing
+    }
+    if (changes && snapshot_path(path)) {
+        return -EROFS;
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = file_inum(path, fi);
+    if (inum < 0 || !S_ISREG(get_inode(inum)->mode)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return inum < 0 ? inum : -ENOTTY;
+    }
+    inode_flush_buffered(inum);
+    int rv;
+    if (command == NUFS_IOC_COPY_RANGE) {
+        rv = ioctl_copy_range(inum, data);
+    } else if (command == NUFS_IOC_GET_COMPRESS || command == NUFS_IOC_SET_COMPRESS) {
+        rv = ioctl_compress(inum, command, data);
+    } else {
+        rv = ioctl_seek_hole(inum, command, data);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+
+    if (changes) {
+        storage_commit();
+    }
+    return rv;
+}
+
+/**
+ * Set up the state of an open file: its inode, resolved once here, and an
+ * empty write buffer.
+ * The caller holds namespace_lock, so the inode cannot be freed before it counts as open.
+ *
+ * @param inum Inode number of the file
+ * @param fi File information that receives the handle
+ * @return 0 on success, or -ENOMEM
+ */
+static int handle_open(int inum, struct fuse_file_info *fi) {
+    file_handle_t *h = calloc(1, sizeof(file_handle_t));
+    if (!h) {
+        return -ENOMEM;
+    }
+    h->inum = inum;
+    h->access = fi->flags & O_ACCMODE;
+    __atomic_add_fetch(&open_counts[inum], 1, __ATOMIC_RELAXED);
+    fi->fh = (uintptr_t)h;
+    return 0;
+}
+
+/**
+ * Open a file.
+ *
+ * @param path File path
+ * @param fi File information that receives the handle
+ * @return 0 on success, or negative error code
+ */
+static int nufs_open(const char *path, struct fuse_file_info *fi) {
+    int ctl = ctl_path(path);
+    if (ctl) {
+        return ctl_open(ctl, fi);
+    }
+    if (((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) && snapshot_path(path)) {
+        return -EROFS;
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int inum = path_lookup(path);
+    int rv = inum < 0 ? inum : handle_open(inum, fi);
+    pthread_rwlock_unlock(&namespace_lock);
+    if (inum < 0) {
+        LOG_DEBUG("open: inode not found for path %s\n", path);
+    }
+    return rv;
+}
+
+/**
+ * Create and open a new file.
+ *
+ * @param path File path
+ * @param mode File permissions
+ * @param fi File information that receives the handle
+ * @return 0 on success, or negative error code
+ */
+static int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    LOG_DEBUG("create(%s, %o)\n", path, mode);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    int inum = node_create(path, mode);
+    int rv = inum < 0 ? inum : handle_open(inum, fi);
+    pthread_rwlock_unlock(&namespace_lock);
+    if (inum < 0) {
+        LOG_DEBUG("create: failed to create inode for %s\n", path);
+        return inum;
+    }
+
+    storage_commit();
+    return rv;
+}
+
+/**
+ * Write out a handle's buffered data, for flush and fsync.
+ *
+ * @param fi File information with the handle, if any
+ * @return 0 on success, or the error of a write that was buffered since the last call
+ */
+static int handle_flush(struct fuse_file_info *fi) {
+    file_handle_t *h = file_handle(fi);
+    if (!h || h->ctl) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    inode_flush_buffered(h->inum);
+    pthread_rwlock_unlock(&namespace_lock);
+    int rv = h->error;
+    h->error = 0;
+    return rv;
+}
+
+/**
+ * Release an open file once the last descriptor for it is closed.
+ *
+ * @param path File path
+ * @param fi File information with the handle
+ * @return 0
+ */
+static int nufs_release(const char *path, struct fuse_file_info *fi) {
+    file_handle_t *h = file_handle(fi);
+    if (!h) {
+        return 0;
+    }
+    if (!h->ctl) {
+        pthread_rwlock_rdlock(&namespace_lock);
+        if (__atomic_load_n(&buffered_handles[h->inum], __ATOMIC_RELAXED) == h) {
+            inode_flush_buffered(h->inum);
+        }
+        __atomic_sub_fetch(&open_counts[h->inum], 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&namespace_lock);
+    }
+    if (h->error < 0) {
+        LOG_WARN("release: buffered write to %s failed: %s\n", path, strerror(-h->error));
+    }
+    free(h->buf);
+    free(h);
+    fi->fh = 0;
+
+    storage_commit();
+    return 0;
+}
+
+/**
+ * Flush a file on close. Writes out the handle's buffered data and makes all changes durable.
+ *
+ * @param path File path
+ * @param fi File information, with the handle from open() or create()
+ * @return 0 on success, or the error of a buffered write
+ */
+static int nufs_flush(const char *path, struct fuse_file_info *fi) {
+    int rv = handle_flush(fi);
+    storage_sync();
+    return rv;
+}
+
+/**
+ * Synchronize a file's contents. Writes out the handle's buffered data and makes all changes durable.
+ *
+ * @param path File path
+ * @param datasync Unused
+ * @param fi File information, with the handle from open() or create()
+ * @return 0 on success, or the error of a buffered write
+ */
+static int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    int rv = handle_flush(fi);
+    storage_sync();
+    return rv;
+}
+
+/**
+ * Start the services that must run in the mounted process, which FUSE may
+ * have forked into the background after main() set up the storage.
+ *
+ * @param conn Connection parameters (unused)
+ * @return NULL, passed to the other operations as private data
+ */
+static void *nufs_init(struct fuse_conn_info *conn) {
+    blocks_start_io();
+    if (nufs_options.trace && log_dump_on_signal(SIGUSR1) < 0) {
+        LOG_ERROR("init: cannot start the trace dump thread\n");
+    }
+    return NULL;
+}
+
+/**
+ * Clean up on unmount: write out the data still buffered by open files,
+ * then all metadata back to its home blocks.
+ *
+ * @param private_data Unused
+ */
+static void nufs_destroy(void *private_data) {
+    for (int inum = 0; inum < INODE_COUNT; inum++) {
+        if (buffered_handles[inum]) {
+            handle_flush_locked(get_inode(inum), buffered_handles[inum]);
+        }
+    }
+    blocks_unpin(1);
+    pthread_rwlock_wrlock(&namespace_lock);
+    if (storage_commit_locked() == 0 && journal_commit() == 0) {
+        save_inodes();
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+}
+
+// Wrappers that record the calls, errors, bytes and latency of each operation
+// (see stats.h); nufs_init_ops() registers them instead of the operations.
+// FUSE has sent the reply to a thread's last call once the thread makes its
+// next one, so the blocks a read_buf() vector pinned can go then.
+#define STATS_OP(op, name, params, args, bytes) \
+    static int stats_##name params { \
+        blocks_unpin(0); \
+        uint64_t start = stats_now(); \
+        int rv = name args; \
+        stats_record(op, start, rv, bytes); \
+        return rv; \
+    }
+
+STATS_OP(STATS_ACCESS, nufs_access, (const char *path, int mask), (path, mask), 0)
+STATS_OP(STATS_GETATTR, nufs_getattr, (const char *path, struct stat *st), (path, st), 0)
+STATS_OP(STATS_STATFS, nufs_statfs, (const char *path, struct statvfs *st), (path, st), 0)
+STATS_OP(STATS_READDIR, nufs_readdir,
+         (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+         (path, buf, filler, offset, fi), 0)
+STATS_OP(STATS_MKNOD, nufs_mknod, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev), 0)
+STATS_OP(STATS_MKDIR, nufs_mkdir, (const char *path, mode_t mode), (path, mode), 0)
+STATS_OP(STATS_UNLINK, nufs_unlink, (const char *path), (path), 0)
+STATS_OP(STATS_RENAME, nufs_rename, (const char *from, const char *to), (from, to), 0)
+STATS_OP(STATS_OPEN, nufs_open, (const char *path, struct fuse_file_info *fi), (path, fi), 0)
+STATS_OP(STATS_CREATE, nufs_create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi), 0)
+STATS_OP(STATS_RELEASE, nufs_release, (const char *path, struct fuse_file_info *fi), (path, fi), 0)
+STATS_OP(STATS_READ, nufs_read,
+         (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, buf, size, offset, fi), rv > 0 ? rv : 0)
+STATS_OP(STATS_WRITE, nufs_write,
+         (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, buf, size, offset, fi), rv > 0 ? rv : 0)
+STATS_OP(STATS_READ_BUF, nufs_read_buf,
+         (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, bufp, size, offset, fi), rv == 0 ? fuse_buf_size(*bufp) : 0)
+STATS_OP(STATS_WRITE_BUF, nufs_write_buf,
+         (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi),
+         (path, buf, offset, fi), rv > 0 ? rv : 0)
+STATS_OP(STATS_TRUNCATE, nufs_truncate, (const char *path, off_t size), (path, size), 0)
+STATS_OP(STATS_TRUNCATE, nufs_ftruncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi), 0)
+STATS_OP(STATS_FALLOCATE, nufs_fallocate,
+         (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi),
+         (path, mode, offset, length, fi), 0)
+STATS_OP(STATS_IOCTL, nufs_ioctl,
+         (const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data),
+         (path, cmd, arg, fi, flags, data), 0)
+STATS_OP(STATS_FLUSH, nufs_flush, (const char *path, struct fuse_file_info *fi), (path, fi), 0)
+STATS_OP(STATS_FSYNC, nufs_fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi), 0)
+
+/**
+ * Initialize FUSE operations with custom filesystem functions.
+ * 
+ * @param ops Pointer to the FUSE operations struct
+ */
+void nufs_init_ops(struct fuse_operations *ops) {
+    memset(ops, 0, sizeof(struct fuse_operations));
+    ops->access = stats_nufs_access;
+    ops->getattr = stats_nufs_getattr;
+    ops->statfs = stats_nufs_statfs;
+    ops->readdir = stats_nufs_readdir;
+    ops->mknod = stats_nufs_mknod;
+    ops->mkdir = stats_nufs_mkdir;
+    ops->unlink = stats_nufs_unlink;
+    ops->open = stats_nufs_open;
+    ops->create = stats_nufs_create;
+    ops->release = stats_nufs_release;
+    ops->read = stats_nufs_read;
+    ops->write = stats_nufs_write;
+    if (nufs_options.backend == BLOCKS_BACKEND_MMAP) {
+        // Their buffers point into the image file, which the block cache would not see
+        ops->read_buf = stats_nufs_read_buf;
+        ops->write_buf = stats_nufs_write_buf;
+    }
+    ops->rename = stats_nufs_rename;
+    ops->truncate = stats_nufs_truncate;
+    ops->ftruncate = stats_nufs_ftruncate;
+    ops->fallocate = stats_nufs_fallocate;
+    ops->ioctl = stats_nufs_ioctl;
+    ops->flush = stats_nufs_flush;
+    ops->fsync = stats_nufs_fsync;
+    ops->init = nufs_init;
+    ops->destroy = nufs_destroy;
+}
+
+// Main function to mount the filesystem with the given disk image.
+int main(int argc, char *argv[]) {
+    assert(argc > 2);
+    // The disk image is the last argument; everything before it goes to FUSE.
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv);
+    if (fuse_opt_parse(&args, &nufs_options, nufs_opts, NULL) == -1) {
+        return 1;
+    }
+    log_init(nufs_options.log_level, nufs_options.trace);
+
+    LOG_INFO("Mounting filesystem with disk image: %s\n", argv[argc - 1]);
     storage_init(argv[argc - 1]);
 
     struct fuse_operations nufs_ops;
     nufs_init_ops(&nufs_ops);
-    int ret = fuse_main(argc - 1, argv, &nufs_ops, NULL);
+    int ret = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+    fuse_opt_free_args(&args);
     blocks_free();
     return ret;
 }
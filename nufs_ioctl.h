@@ -0,0 +1,46 @@
+// Commands of the ioctl()s that files of a mounted nufs accept, for tools that
+// work on its files. Each takes a pointer to its argument.
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// lseek() with SEEK_DATA and SEEK_HOLE, which FUSE 2.9 does not pass on to the
+// file system (the kernel then treats the whole file as data). The argument is
+// an int64_t offset, replaced by the start of the next data or hole at or after
+// it. Fails with ENXIO if the offset is at or past the end of the file, or, for
+// NUFS_IOC_SEEK_DATA, if only holes follow it.
+#define NUFS_IOC_SEEK_DATA _IOWR('N', 1, int64_t)
+#define NUFS_IOC_SEEK_HOLE _IOWR('N', 2, int64_t)
+
+#define NUFS_COPY_PATH_MAX 1024 // Size of nufs_copy_range.src_path, with its terminating NUL
+
+// Argument of NUFS_IOC_COPY_RANGE.
+struct nufs_copy_range {
+    int64_t src_offset;                 // Byte offset in the source file
+    int64_t dest_offset;                // Byte offset in the file the ioctl is issued on
+    int64_t length;                     // Bytes to copy, 0 for all from src_offset on; receives the bytes copied
+    char src_path[NUFS_COPY_PATH_MAX];  // Path of the source file within the mount, starting with '/'
+};
+
+// copy_file_range(), which FUSE 2.9 does not pass on either. Copies a byte
+// range of another file on the same mount, or of the same file, which must not
+// overlap the destination range, into the file the ioctl is issued on. A range
+// that starts at the same offset within a block in both files shares its whole
+// blocks instead of copying them: they are copied only once either file writes
+// to them. The copy stops at the end of the source file. The file the ioctl
+// is issued on must be open for writing, or the ioctl fails with EBADF.
+#define NUFS_IOC_COPY_RANGE _IOWR('N', 3, struct nufs_copy_range)
+
+// Whether a file's data is stored compressed. The argument is an int, 1 for
+// compressed and 0 for not. Compression can be switched only while the file
+// has no data blocks, e.g. right after it was created or truncated to nothing;
+// otherwise NUFS_IOC_SET_COMPRESS fails with EBUSY, unless the file is already
+// stored as asked. Setting it needs the file open for writing (EBADF
+// otherwise). New files are compressed if the file system is mounted with
+// -o compress.
+#define NUFS_IOC_GET_COMPRESS _IOR('N', 4, int)
+#define NUFS_IOC_SET_COMPRESS _IOW('N', 5, int)
+
+#endif
@@ -0,0 +1,119 @@
+// Implements path parsing over views into the original string, and the per-thread arena for temporary strings.
+// Nothing here touches the heap: the arena is a fixed thread-local buffer used like a stack.
+
+// necessary libraries
+#include <string.h>
+#include "path.h"
+
+static __thread char arena[PATH_ARENA_SIZE];
+static __thread size_t arena_used = 0;
+
+/**
+ * Start walking the components of a path.
+ *
+ * @param it Iterator to set up.
+ * @param path The path; it must stay unchanged during the walk.
+ * @param len Number of bytes of path to walk, e.g. strlen(path).
+ */
+void path_iter_init(path_iter_t *it, const char *path, size_t len) {
+    it->next = path;
+    it->end = path + len;
+}
+
+/**
+ * Get the next component of a path. Empty components, from leading, trailing
+ * and repeated slashes, are skipped.
+ *
+ * @param it Iterator set up by path_iter_init().
+ * @param part Receives the component.
+ *
+ * @return 1 if a component was found, 0 at the end of the path.
+ */
+int path_iter_next(path_iter_t *it, path_part_t *part) {
+    const char *p = it->next;
+    while (p < it->end && *p == '/') {
+        p++;
+    }
+    if (p == it->end) {
+        it->next = p;
+        return 0;
+    }
+
+    const char *start = p;
+    while (p < it->end && *p != '/') {
+        p++;
+    }
+    part->str = start;
+    part->len = p - start;
+    it->next = p;
+    return 1;
+}
+
+/**
+ * Split a path into its parent and its last component, ignoring trailing slashes.
+ *
+ * @param path The path.
+ * @param part Receives the last component; its length is 0 for the root.
+ *
+ * @return Length of the parent's path, i.e. of the path up to the last
+ *         component ("/" for a name in the root).
+ */
+size_t path_split(const char *path, path_part_t *part) {
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    part->str = path + start;
+    part->len = end - start;
+    if (end == 1 && path[0] == '/') {
+        part->len = 0; // The root
+    }
+
+    // Drop the slashes before the name, keeping the one of the root
+    size_t parent = start;
+    while (parent > 1 && path[parent - 1] == '/') {
+        parent--;
+    }
+    return parent;
+}
+
+/**
+ * Remember how much of the calling thread's arena is in use.
+ *
+ * @return A mark for path_arena_release().
+ */
+size_t path_arena_mark() {
+    return arena_used;
+}
+
+/**
+ * Free everything allocated from the calling thread's arena since a mark.
+ *
+ * @param mark Value returned by path_arena_mark().
+ */
+void path_arena_release(size_t mark) {
+    arena_used = mark;
+}
+
+/**
+ * Copy a string into the calling thread's arena and NUL-terminate it.
+ *
+ * @param str String to copy.
+ * @param len Number of bytes to copy.
+ *
+ * @return The copy, valid until the arena is released past it, or NULL if the arena is full.
+ */
+char *path_arena_strndup(const char *str, size_t len) {
+    if (len + 1 > PATH_ARENA_SIZE - arena_used) {
+        return NULL;
+    }
+    char *copy = arena + arena_used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    arena_used += len + 1;
+    return copy;
+}
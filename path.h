@@ -0,0 +1,81 @@
+// Path parsing without heap allocations.
+//
+// A path is walked one component at a time through views into the original
+// string, so resolving a path copies nothing. Code that needs a component as
+// a NUL-terminated string copies it into a small per-thread arena, which is
+// released in stack order with path_arena_mark() and path_arena_release().
+#ifndef PATH_H
+#define PATH_H
+
+#include <stddef.h>
+
+#define PATH_ARENA_SIZE 4096 // Bytes of temporary strings each thread can hold at once.
+
+// A component of a path: len bytes starting at str, not NUL-terminated.
+typedef struct path_part {
+    const char *str;
+    size_t len;
+} path_part_t;
+
+// Position of a walk over the components of a path.
+typedef struct path_iter {
+    const char *next; // Start of the rest of the path
+    const char *end;  // End of the path
+} path_iter_t;
+
+/**
+ * Start walking the components of a path.
+ *
+ * @param it Iterator to set up.
+ * @param path The path; it must stay unchanged during the walk.
+ * @param len Number of bytes of path to walk, e.g. strlen(path).
+ */
+void path_iter_init(path_iter_t *it, const char *path, size_t len);
+
+/**
+ * Get the next component of a path. Empty components, from leading, trailing
+ * and repeated slashes, are skipped.
+ *
+ * @param it Iterator set up by path_iter_init().
+ * @param part Receives the component.
+ *
+ * @return 1 if a component was found, 0 at the end of the path.
+ */
+int path_iter_next(path_iter_t *it, path_part_t *part);
+
+/**
+ * Split a path into its parent and its last component, ignoring trailing slashes.
+ *
+ * @param path The path.
+ * @param part Receives the last component; its length is 0 for the root.
+ *
+ * @return Length of the parent's path, i.e. of the path up to the last
+ *         component ("/" for a name in the root).
+ */
+size_t path_split(const char *path, path_part_t *part);
+
+/**
+ * Remember how much of the calling thread's arena is in use.
+ *
+ * @return A mark for path_arena_release().
+ */
+size_t path_arena_mark();
+
+/**
+ * Free everything allocated from the calling thread's arena since a mark.
+ *
+ * @param mark Value returned by path_arena_mark().
+ */
+void path_arena_release(size_t mark);
+
+/**
+ * Copy a string into the calling thread's arena and NUL-terminate it.
+ *
+ * @param str String to copy.
+ * @param len Number of bytes to copy.
+ *
+ * @return The copy, valid until the arena is released past it, or NULL if the arena is full.
+ */
+char *path_arena_strndup(const char *str, size_t len);
+
+#endif
@@ -0,0 +1,192 @@
+// Implements per-operation counters and log-linear latency histograms. A latency v lands in bucket v for v < 16;
+// above that, its highest set bit picks a group of 16 buckets and the next four bits the bucket in the group.
+
+// necessary libraries
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+#define SUB_BITS 4                          // Linear steps per power of two: 1 << SUB_BITS
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BUCKETS];
+} op_stats_t;
+
+static op_stats_t stats[STATS_OPS];
+
+static const char *op_names[STATS_OPS] = {
+    [STATS_GETATTR] = "getattr",
+    [STATS_ACCESS] = "access",
+    [STATS_STATFS] = "statfs",
+    [STATS_READDIR] = "readdir",
+    [STATS_MKNOD] = "mknod",
+    [STATS_MKDIR] = "mkdir",
+    [STATS_UNLINK] = "unlink",
+    [STATS_RENAME] = "rename",
+    [STATS_OPEN] = "open",
+    [STATS_CREATE] = "create",
+    [STATS_RELEASE] = "release",
+    [STATS_READ] = "read",
+    [STATS_WRITE] = "write",
+    [STATS_READ_BUF] = "read_buf",
+    [STATS_WRITE_BUF] = "write_buf",
+    [STATS_FLUSH] = "flush",
+    [STATS_FSYNC] = "fsync",
+    [STATS_TRUNCATE] = "truncate",
+    [STATS_FALLOCATE] = "fallocate",
+    [STATS_IOCTL] = "ioctl",
+    [STATS_SAVE_INODES] = "save_inodes",
+    [STATS_BLOCKS_FLUSH] = "blocks_flush",
+    [STATS_JOURNAL_COMMIT] = "journal_commit",
+    [STATS_ALLOC] = "alloc",
+};
+
+// Bucket of a latency.
+static int bucket_of(uint64_t ns) {
+    if (ns < SUB_COUNT) {
+        return ns;
+    }
+    int top = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (top - SUB_BITS)) & (SUB_COUNT - 1);
+    return (top - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+// Middle of the range of latencies a bucket holds.
+static uint64_t bucket_value(int bucket) {
+    if (bucket < SUB_COUNT) {
+        return bucket;
+    }
+    int top = bucket / SUB_COUNT + SUB_BITS - 1;
+    int sub = bucket % SUB_COUNT;
+    uint64_t width = 1ull << (top - SUB_BITS);
+    return ((uint64_t)(SUB_COUNT + sub) << (top - SUB_BITS)) + width / 2;
+}
+
+/**
+ * Get the time to pass to stats_record() as the start of an operation.
+ *
+ * @return Monotonic time in nanoseconds.
+ */
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Record one call of an operation.
+ *
+ * @param op The operation.
+ * @param start Value of stats_now() when the operation started.
+ * @param rv Result of the operation; negative values count as errors.
+ * @param bytes Bytes the operation read or wrote.
+ */
+void stats_record(stats_op_t op, uint64_t start, int64_t rv, uint64_t bytes) {
+    uint64_t ns = stats_now() - start;
+    op_stats_t *s = &stats[op];
+    __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+    if (rv < 0) {
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    }
+    if (bytes) {
+        __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Find a percentile in a copy of a histogram.
+ *
+ * @param buckets The histogram.
+ * @param count Number of values in it.
+ * @param permille Percentile, in tenths of a percent.
+ * @return The latency in nanoseconds.
+ */
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, int permille) {
+    uint64_t rank = (count * permille + 999) / 1000;
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            return bucket_value(b);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Format the statistics as text, one line per operation that was called, with
+ * its counts and the 50th, 90th, 99th and 99.9th latency percentiles and the maximum.
+ *
+ * @param buf Buffer to write into; may be NULL if size is 0.
+ * @param size Size of buf.
+ *
+ * @return Length of the text, like snprintf(): if it is size or more, the text was truncated.
+ */
+size_t stats_format(char *buf, size_t size) {
+    size_t len = 0;
+#define APPEND(...) do { \
+        int n = snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, __VA_ARGS__); \
+        len += n > 0 ? n : 0; \
+    } while (0)
+
+    APPEND("# op calls errors bytes mean_us p50_us p90_us p99_us p999_us max_us\n");
+    uint64_t copy[BUCKETS]; // Copy of a histogram, so its percentiles agree with each other
+    for (int op = 0; op < STATS_OPS; op++) {
+        op_stats_t *s = &stats[op];
+        uint64_t count = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            copy[b] = __atomic_load_n(&s->buckets[b], __ATOMIC_RELAXED);
+            count += copy[b];
+        }
+        if (count == 0) {
+            continue;
+        }
+        uint64_t calls = __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+        uint64_t errors = __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+        uint64_t bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+        APPEND("%s %llu %llu %llu %.1f %.1f %.1f %.1f %.1f %.1f\n", op_names[op],
+               (unsigned long long)calls, (unsigned long long)errors, (unsigned long long)bytes,
+               total / 1000.0 / count, percentile(copy, count, 500) / 1000.0,
+               percentile(copy, count, 900) / 1000.0, percentile(copy, count, 990) / 1000.0,
+               percentile(copy, count, 999) / 1000.0, max / 1000.0);
+    }
+#undef APPEND
+    return len;
+}
+
+/**
+ * Clear all statistics.
+ */
+void stats_reset() {
+    for (int op = 0; op < STATS_OPS; op++) {
+        op_stats_t *s = &stats[op];
+        __atomic_store_n(&s->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->errors, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->max_ns, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < BUCKETS; b++) {
+            __atomic_store_n(&s->buckets[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+// Per-operation statistics: calls, errors, bytes moved and a latency histogram.
+//
+// Histograms are HDR style: latencies in nanoseconds fall into buckets that
+// split every power of two into 16 linear steps, so any percentile is known
+// within about 6% from 1 ns to hours, in constant memory. All counters are
+// updated with relaxed atomics; recording never takes a lock.
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Operations with statistics.
+typedef enum {
+    STATS_GETATTR,
+    STATS_ACCESS,
+    STATS_STATFS,
+    STATS_READDIR,
+    STATS_MKNOD,
+    STATS_MKDIR,
+    STATS_UNLINK,
+    STATS_RENAME,
+    STATS_OPEN,
+    STATS_CREATE,
+    STATS_RELEASE,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_READ_BUF,
+    STATS_WRITE_BUF,
+    STATS_FLUSH,
+    STATS_FSYNC,
+    STATS_TRUNCATE,      // truncate and ftruncate
+    STATS_FALLOCATE,
+    STATS_IOCTL,
+    STATS_SAVE_INODES,   // Writing all dirty inodes back (inode.c)
+    STATS_BLOCKS_FLUSH,  // Syncing dirty blocks to the image, msync or pwritev (blocks.c)
+    STATS_JOURNAL_COMMIT,
+    STATS_ALLOC,         // Block allocation (alloc_run, alloc_block)
+    STATS_OPS            // Number of operations
+} stats_op_t;
+
+/**
+ * Get the time to pass to stats_record() as the start of an operation.
+ *
+ * @return Monotonic time in nanoseconds.
+ */
+uint64_t stats_now();
+
+/**
+ * Record one call of an operation.
+ *
+ * @param op The operation.
+ * @param start Value of stats_now() when the operation started.
+ * @param rv Result of the operation; negative values count as errors.
+ * @param bytes Bytes the operation read or wrote.
+ */
+void stats_record(stats_op_t op, uint64_t start, int64_t rv, uint64_t bytes);
+
+/**
+ * Format the statistics as text, one line per operation that was called, with
+ * its counts and the 50th, 90th, 99th and 99.9th latency percentiles and the maximum.
+ *
+ * @param buf Buffer to write into; may be NULL if size is 0.
+ * @param size Size of buf.
+ *
+ * @return Length of the text, like snprintf(): if it is size or more, the text was truncated.
+ */
+size_t stats_format(char *buf, size_t size);
+
+/**
+ * Clear all statistics.
+ */
+void stats_reset();
+
+#endif
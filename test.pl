@@ -2,11 +2,13 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 63;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts) = @_;
+    $opts = $opts ? "MOUNT_OPTS='-o $opts'" : "";
+    system("(make mount $opts 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -132,6 +134,15 @@ ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
 
+write_text("foo/other.txt", "replace me");
+ok((rename("mnt/foo/file.txt", "mnt/foo/other.txt") and !-e "mnt/foo/file.txt"),
+   "Rename over an existing file");
+ok(read_text("foo/other.txt") eq $msg4, "Renamed file replaced the old contents");
+
+ok((mkdir("mnt/next") and mkdir("mnt/next/sub") and rename("mnt/next", "mnt/tmp")),
+   "Rename a directory tree over an empty directory");
+ok((-d "mnt/tmp/sub" and !-e "mnt/next"), "Directory tree moved along");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -171,5 +182,95 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# Small file growing out of its inode";
+write_text("small.txt", "tiny");
+open my $ah, ">>", "mnt/small.txt";
+$ah->print("x" x 300);
+close $ah;
+ok(read_text("small.txt") eq "tiny\n" . ("x" x 300), "Appending past the inline data keeps the old contents");
+
+say "# Sparse files";
+open my $sh, ">", "mnt/sparse.bin";
+seek $sh, 1024 * 1024, 0;
+$sh->print("end");
+close $sh;
+my @st = stat("mnt/sparse.bin");
+ok(($st[7] == 1024 * 1024 + 3 and $st[12] * 512 <= 8192), "Writing past the end leaves a hole that takes no blocks");
+ok(read_text_slice("sparse.bin", 4, 4096) eq "\0\0\0\0", "The hole reads as zeros");
+truncate("mnt/sparse.bin", 10);
+ok(-s "mnt/sparse.bin" == 10, "Truncate shrinks a file");
+
+say "# Copy-on-write clones";
+my $orig = "clone me " x 5000;
+write_text("orig.txt", $orig);
+system("tools/reflink mnt/orig.txt mnt/clone.txt");
+ok(read_text("clone.txt") eq $orig, "A clone reads like the original");
+open my $ch, "+<", "mnt/clone.txt";
+seek $ch, 4096, 0;
+$ch->print("CHANGED");
+close $ch;
+ok(read_text_slice("clone.txt", 7, 4096) eq "CHANGED", "A clone can be written to");
+ok(read_text("orig.txt") eq $orig, "Writing to a clone leaves the original alone");
+
+say "# Snapshots";
+system("echo create s1 > mnt/.nufs/snapshot");
+ok(read_text(".snapshots/s1/orig.txt") eq $orig, "A snapshot holds a copy of each file");
+write_text("orig.txt", "after the snapshot");
+ok(read_text(".snapshots/s1/orig.txt") eq $orig, "Changing a file leaves its snapshot alone");
+ok(!unlink("mnt/.snapshots/s1/clone.txt"), "Snapshots are read-only");
+system("echo delete s1 > mnt/.nufs/snapshot");
+ok(!-e "mnt/.snapshots/s1", "A snapshot can be deleted");
+
+say "# Compression";
+my $text = join("", map { "line $_ of a compressible file\n" } 1..4000);
+open my $zh, ">", "mnt/packed.txt";
+ok(ioctl($zh, 0x40044E05, pack("i", 1)), "NUFS_IOC_SET_COMPRESS turns on compression for an empty file");
+$zh->print($text);
+close $zh;
+ok(read_text("packed.txt") eq $text, "A compressed file reads back what was written");
+my @zst = stat("mnt/packed.txt");
+ok($zst[12] * 512 < length($text) / 2, "A compressed file takes fewer blocks than its size");
+
+unmount();
+
+say "# Deduplication";
+mount("dedup");
+my $blocks = join("\n", map { "vendored dependency, line $_" } 1..3000);
+write_text("dup1.txt", $blocks);
+my $free = `stat -f -c %f mnt` + 0;
+write_text("dup2.txt", $blocks);
+ok(read_text("dup2.txt") eq $blocks, "A copy written under -o dedup reads back");
+ok(`stat -f -c %f mnt` + 0 >= $free - 1, "Its blocks are shared with the original's");
+open my $dh, "+<", "mnt/dup2.txt";
+$dh->print("CHANGED");
+close $dh;
+ok(read_text("dup1.txt") eq $blocks, "Writing to the copy leaves the original alone");
 
+unmount();
+
+say "# Image check";
+sleep 1;
+ok(system("./fsck.nufs -n data.nufs >> test.log") == 0, "fsck.nufs finds the image consistent after unmounting");
+
+# The basic checks again, with the metadata in memory and the data blocks in the block cache
+for my $backend ("cache", "direct") {
+    say "#           == backend=$backend ==";
+    system("rm -f data.nufs");
+    mount("backend=$backend");
+    my $big = "=This string is fourty characters long.=" x 2000;
+    write_text("one.txt", $msg0);
+    write_text("big.txt", $big);
+    ok((read_text("one.txt") eq $msg0 and read_text("big.txt") eq $big), "backend=$backend: files read back");
+    ok(read_text_slice("big.txt", 10, 40010) eq "ng is four", "backend=$backend: read with offset & length");
+    ok((mkdir("mnt/dir") and rename("mnt/big.txt", "mnt/dir/moved.txt") and !-e "mnt/big.txt"),
+       "backend=$backend: move a file to another directory");
+    unmount();
+
+    mount("backend=$backend");
+    ok((read_text("one.txt") eq $msg0 and read_text("dir/moved.txt") eq $big),
+       "backend=$backend: files read back after remounting");
+    unmount();
+
+    sleep 1;
+    ok(system("./fsck.nufs -n data.nufs >> test.log") == 0, "backend=$backend: fsck.nufs finds the image consistent");
+}
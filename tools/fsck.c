@@ -0,0 +1,772 @@
+// Checks a nufs image and repairs what it finds, like e2fsck. Cross-checks the inode bitmap against the inodes, the
+// extents of each file against the image and each other, the block bitmap and reference counts against the blocks the
+// files map, and the directory entries against the inodes they name and the tree they form. The inode table and the
+// bitmaps are scanned by several threads, each taking its own range, so the time a check takes after a crash shrinks
+// with the number of cores. Committed journal transactions are replayed first, as a mount would replay them; with -n
+// they are replayed into a private mapping of the image, so what is checked is what the next mount would see.
+//
+// The scans work on the image in place, through the mapping (the default backend), so the block pointers they take
+// stay valid without blocks_put_block(). The bitmaps, reference counts and inode table are mapped privately, so a
+// repair reaches the image only through the blocks_flush() at the end, for the blocks dirty_at() marked. Blocks that
+// no file maps are freed, reference counts and bitmap bits are set to what the files use, and extents or directory
+// entries that point outside the image or at blocks and inodes that cannot be theirs are dropped. Files and
+// directories left without a name are moved to /lost+found, as #INUM, unless they are empty files, which are freed.
+//
+// usage: fsck.nufs [-n] [-j THREADS] IMAGE
+//
+//   -n          only report problems; the image is opened read-only and not changed
+//   -j THREADS  number of scanning threads (default: one per online CPU)
+//
+// Exits with 0 if the image is consistent, 1 if all problems were repaired, 4 if some were left, and 8 if the image
+// could not be checked at all.
+
+// necessary libraries
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "blocks.h"
+#include "directory.h"
+#include "inode.h"
+#include "journal.h"
+#include "log.h"
+
+#define MAX_THREADS 64
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(dirent_t))
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(extent_t))
+#define LOST_FOUND "lost+found"
+#define DROP_SPILL "extents past those in the inode dropped"
+
+static int repair = 1;     // 0 with -n
+static int thread_count = 1;
+static int problems = 0;   // Problems found, counted atomically
+static int unrepaired = 0; // Problems left as they were
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// What the scans learn, indexed by inode number or block number. Written by several threads at once, atomically.
+static uint8_t *live = NULL;          // Inodes in use and valid, set by check_inodes()
+static uint32_t *claims = NULL;       // Data extents that map each block
+static int *extent_owner = NULL;      // For each block, the lowest inode number + 1 using it as its extent block
+static uint64_t *entry_owner = NULL;  // For each inode, the lowest (directory << 32 | slot) + 1 of an entry naming it
+static int entry_conflicts = 0;       // Whether some inode is named by more than one entry
+
+/**
+ * Report a problem with the image, and how it is repaired.
+ *
+ * @param fix What the caller does about the problem unless -n was given, or NULL if it cannot repair it.
+ * @param fmt printf format of the message, without a newline.
+ *
+ * @return 1 if the caller should repair the problem, 0 if not.
+ */
+static int problem(const char *fix, const char *fmt, ...) {
+    int fixing = repair && fix;
+    __atomic_fetch_add(&problems, 1, __ATOMIC_RELAXED);
+    if (!fixing) {
+        __atomic_fetch_add(&unrepaired, 1, __ATOMIC_RELAXED);
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&report_lock);
+    vprintf(fmt, ap);
+    printf(fixing ? ": %s\n" : fix ? "\n" : ": cannot be repaired\n", fix);
+    pthread_mutex_unlock(&report_lock);
+    va_end(ap);
+    return fixing;
+}
+
+// Mark the block holding a byte of the image as changed, for the blocks_flush() at the end.
+static void dirty_at(const void *ptr) {
+    blocks_dirty(blocks_offset(ptr) / BLOCK_SIZE);
+}
+
+// The slot of an inode in the inode table itself; the scans do not go through the in-memory copy of inode.c.
+static inode_t *table_inode(int inum) {
+    inode_t *block = blocks_get_block(FIRST_INODE_BLOCK + inum / (int)INODES_PER_BLOCK);
+    return &block[inum % (int)INODES_PER_BLOCK];
+}
+
+// The i-th extent of a file, in the inode or in its extent block.
+static extent_t *extent_at(inode_t *node, int i) {
+    if (i < INODE_EXTENTS) {
+        return &node->extents[i];
+    }
+    extent_t *spill = blocks_get_block(node->extent_block);
+    return &spill[i - INODE_EXTENTS];
+}
+
+// Whether an extent lies within the data blocks, so its blocks can be read.
+static int extent_in_data(extent_t e) {
+    return e.length > 0 && e.start >= FIRST_DATA_BLOCK && (int64_t)e.start + e.length <= BLOCK_COUNT;
+}
+
+// Number of a file's extents that can be read: all of them, unless -n left a bad count or extent block in place.
+static int readable_extents(int inum, inode_t *node) {
+    if (node->extent_count <= INODE_EXTENTS) {
+        return node->extent_count < 0 ? 0 : node->extent_count;
+    }
+    int xb = node->extent_block;
+    if (xb < FIRST_DATA_BLOCK || xb >= BLOCK_COUNT || extent_owner[xb] != inum + 1) {
+        return INODE_EXTENTS;
+    }
+    int max = INODE_EXTENTS + EXTENTS_PER_BLOCK;
+    return node->extent_count < max ? node->extent_count : max;
+}
+
+// Atomically lower *p to v if v is smaller; 0 counts as unset. Returns 1 if *p was already set.
+static int lower_to(uint64_t *p, uint64_t v) {
+    uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (old == 0 || v < old) {
+        if (__atomic_compare_exchange_n(p, &old, v, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return old != 0;
+        }
+    }
+    return 1;
+}
+
+static int lower_to_int(int *p, int v) {
+    int old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (old == 0 || v < old) {
+        if (__atomic_compare_exchange_n(p, &old, v, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return old != 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct {
+    void (*fn)(int first, int end);
+    int first;
+    int end;
+} range_t;
+
+static void *range_thread(void *arg) {
+    range_t *r = arg;
+    r->fn(r->first, r->end);
+    return NULL;
+}
+
+/**
+ * Run a scan over [0, count), split into one range per thread. The ranges are
+ * multiples of 64 items, so no two threads change the same word of a bitmap.
+ *
+ * @param fn Scans the items from first to end - 1.
+ * @param count Number of items.
+ */
+static void parallel_for(void (*fn)(int first, int end), int count) {
+    pthread_t threads[MAX_THREADS];
+    range_t ranges[MAX_THREADS];
+    int per_thread = ((count + thread_count - 1) / thread_count + 63) / 64 * 64;
+    int started = 0;
+    for (int first = 0; first < count; first += per_thread) {
+        ranges[started] = (range_t){ fn, first, first + per_thread < count ? first + per_thread : count };
+        if (pthread_create(&threads[started], NULL, range_thread, &ranges[started]) != 0) {
+            range_thread(&ranges[started]); // Out of threads: scan it here
+            continue;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static int valid_mode(int mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG: case S_IFDIR: case S_IFLNK: case S_IFIFO: case S_IFSOCK: case S_IFCHR: case S_IFBLK:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// First pass over the inode table: the fields of each inode in the inode bitmap, and its extent block.
+static void check_inodes(int first, int end) {
+    void *ibm = get_inode_bitmap();
+    for (int inum = first; inum < end; inum++) {
+        if (!bitmap_get(ibm, inum)) {
+            continue;
+        }
+        inode_t *node = table_inode(inum);
+        if (!valid_mode(node->mode)) {
+            // Nothing about such an inode can be trusted, so its entries and blocks go too; main() reports the root
+            if (inum != ROOT_INUM && problem("freed", "inode %d: in use, but has mode %o", inum, node->mode)) {
+                memset(node, 0, sizeof(inode_t));
+                dirty_at(node);
+                bitmap_put(ibm, inum, 0);
+                dirty_at((uint64_t *)ibm + inum / 64);
+            }
+            continue;
+        }
+        live[inum] = 1;
+
+        inode_t was = *node;
+        if (node->refs != 1 && problem("set to 1", "inode %d: reference count is %d, not 1", inum, node->refs)) {
+            node->refs = 1; // Every inode has exactly one name
+        }
+        if ((node->flags & ~(INODE_INLINE | INODE_COMPRESSED)) &&
+            problem("cleared", "inode %d: unknown flags %x", inum, node->flags & ~(INODE_INLINE | INODE_COMPRESSED))) {
+            node->flags &= INODE_INLINE | INODE_COMPRESSED;
+        }
+        if (node->flags & INODE_INLINE) {
+            if (!S_ISREG(node->mode)) {
+                if (problem("cleared", "inode %d: inline data in a file that is not a regular file", inum)) {
+                    node->flags &= ~INODE_INLINE;
+                    memset(node->inline_data, 0, INODE_INLINE_SIZE);
+                    node->size = node->block_count = node->extent_count = 0;
+                }
+            } else {
+                if ((node->size < 0 || node->size > INODE_INLINE_SIZE) &&
+                    problem("size corrected", "inode %d: inline file of %lld bytes", inum, (long long)node->size)) {
+                    node->size = node->size < 0 ? 0 : INODE_INLINE_SIZE;
+                }
+                if ((node->block_count || node->extent_count) &&
+                    problem("cleared", "inode %d: inline file with %d blocks in %d extents", inum, node->block_count,
+                            node->extent_count)) {
+                    node->block_count = node->extent_count = 0;
+                }
+            }
+        }
+        if (!(node->flags & INODE_INLINE)) {
+            int max = INODE_EXTENTS + EXTENTS_PER_BLOCK;
+            if ((node->extent_count < 0 || node->extent_count > max) &&
+                problem("count corrected", "inode %d: %d extents", inum, node->extent_count)) {
+                node->extent_count = node->extent_count < 0 ? 0 : max;
+            }
+            int xb = node->extent_block;
+            if (xb && (xb < FIRST_DATA_BLOCK || xb >= BLOCK_COUNT)) {
+                if (problem(DROP_SPILL, "inode %d: extent block %d is outside the data blocks", inum, xb)) {
+                    node->extent_block = 0;
+                    if (node->extent_count > INODE_EXTENTS) {
+                        node->extent_count = INODE_EXTENTS;
+                    }
+                }
+            } else if (xb && node->extent_count <= INODE_EXTENTS) {
+                if (problem("freed", "inode %d: extent block %d holds none of its %d extents", inum, xb,
+                            node->extent_count)) {
+                    node->extent_block = 0;
+                }
+            } else if (!xb && node->extent_count > INODE_EXTENTS) {
+                if (problem(DROP_SPILL, "inode %d: %d extents, but no extent block", inum, node->extent_count)) {
+                    node->extent_count = INODE_EXTENTS;
+                }
+            }
+            xb = node->extent_block;
+            if (xb >= FIRST_DATA_BLOCK && xb < BLOCK_COUNT && node->extent_count > INODE_EXTENTS) {
+                lower_to_int(&extent_owner[xb], inum + 1);
+            }
+        }
+        if (memcmp(&was, node, sizeof(inode_t)) != 0) {
+            dirty_at(node);
+        }
+    }
+}
+
+// Directory that names an inode, or -1 if none does.
+static int parent_of(int inum) {
+    return entry_owner[inum] ? (int)((entry_owner[inum] - 1) >> 32) : -1;
+}
+
+typedef struct {
+    dirent_t *entry;
+    int slot;
+} entry_ref_t;
+
+static int compare_entries(const void *a, const void *b) {
+    const entry_ref_t *x = a, *y = b;
+    int c = strncmp(x->entry->name, y->entry->name, DIR_NAME_LENGTH);
+    return c ? c : x->slot - y->slot;
+}
+
+// Remove a directory entry in place.
+static void clear_entry(dirent_t *entry) {
+    memset(entry, 0, sizeof(dirent_t));
+    dirty_at(entry);
+}
+
+/**
+ * Check the entries of a directory, dropping those that cannot be right, and
+ * record which entry names each inode.
+ *
+ * @param dir Inode number of the directory.
+ * @param node Its slot in the inode table, with checked extents.
+ * @param refs Scratch array, grown as needed.
+ * @param refs_capacity Its size in entries.
+ */
+static void check_entries(int dir, inode_t *node, entry_ref_t **refs, int *refs_capacity) {
+    int count = 0;
+    int extents = readable_extents(dir, node);
+    for (int i = 0; i < extents; i++) {
+        extent_t e = *extent_at(node, i);
+        for (int b = 0; extent_in_data(e) && b < e.length; b++) {
+            dirent_t *entries = blocks_get_block(e.start + b);
+            for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+                dirent_t *entry = &entries[j];
+                int slot = (e.file_block + b) * DIRENTS_PER_BLOCK + j;
+                if (entry->name[0] == '\0') {
+                    continue;
+                }
+                int inum = entry->inum;
+                if (!memchr(entry->name, '\0', DIR_NAME_LENGTH) || strchr(entry->name, '/') ||
+                    !strcmp(entry->name, ".") || !strcmp(entry->name, "..")) {
+                    if (problem("removed", "directory %d: entry %d has an invalid name", dir, slot)) {
+                        clear_entry(entry);
+                    }
+                    continue;
+                }
+                if (inum < 0 || inum >= INODE_COUNT || !live[inum]) {
+                    if (problem("removed", "directory %d: entry %s names inode %d, which is not in use", dir,
+                                entry->name, inum)) {
+                        clear_entry(entry);
+                    }
+                    continue;
+                }
+                if (inum == ROOT_INUM || inum == dir) {
+                    if (problem("removed", "directory %d: entry %s names %s", dir, entry->name,
+                                inum == dir ? "the directory itself" : "the root directory")) {
+                        clear_entry(entry);
+                    }
+                    continue;
+                }
+                if (count == *refs_capacity) {
+                    *refs_capacity = *refs_capacity ? 2 * *refs_capacity : 256;
+                    *refs = realloc(*refs, *refs_capacity * sizeof(entry_ref_t));
+                    if (!*refs) {
+                        perror("fsck.nufs");
+                        exit(8);
+                    }
+                }
+                (*refs)[count++] = (entry_ref_t){ entry, slot };
+            }
+        }
+    }
+
+    // Of entries with the same name, the first one stays
+    qsort(*refs, count, sizeof(entry_ref_t), compare_entries);
+    for (int i = 0; i < count; i++) {
+        entry_ref_t *r = &(*refs)[i];
+        if (i > 0 && strncmp(r->entry->name, (*refs)[i - 1].entry->name, DIR_NAME_LENGTH) == 0) {
+            if (problem("removed", "directory %d: entry %s, naming inode %d, repeats an earlier name", dir,
+                        r->entry->name, r->entry->inum)) {
+                clear_entry(r->entry);
+            }
+            continue;
+        }
+        if (lower_to(&entry_owner[r->entry->inum], ((uint64_t)dir << 32 | (uint32_t)r->slot) + 1)) {
+            __atomic_store_n(&entry_conflicts, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Second pass over the inode table: the extents of each file, the blocks they claim, and the entries of
+// each directory. Runs once every extent block is known.
+static void check_extents(int first, int end) {
+    entry_ref_t *refs = NULL;
+    int refs_capacity = 0;
+    for (int inum = first; inum < end; inum++) {
+        if (!live[inum]) {
+            continue;
+        }
+        inode_t *node = table_inode(inum);
+        if (node->flags & INODE_INLINE) {
+            continue;
+        }
+        inode_t was = *node;
+        int xb = node->extent_block;
+        if (node->extent_count > INODE_EXTENTS && xb >= FIRST_DATA_BLOCK && xb < BLOCK_COUNT &&
+            extent_owner[xb] != inum + 1 &&
+            problem(DROP_SPILL, "inode %d: extent block %d is also that of inode %d", inum, xb, extent_owner[xb] - 1)) {
+            node->extent_block = 0;
+            node->extent_count = INODE_EXTENTS;
+        }
+        int usable = readable_extents(inum, node);
+
+        // Keep the extents that are in the data area, in order and clear of every extent block
+        int kept = 0;
+        int blocks = 0;
+        int64_t next_file_block = 0;
+        for (int i = 0; i < usable; i++) {
+            extent_t e = *extent_at(node, i);
+            const char *why = NULL;
+            if (e.length <= 0) {
+                why = "is empty";
+            } else if (!extent_in_data(e)) {
+                why = "is outside the data blocks";
+            } else if (e.file_block < next_file_block || (int64_t)e.file_block + e.length > INODE_MAX_BLOCKS) {
+                why = "overlaps the one before it";
+            } else {
+                for (int b = e.start; b < e.start + e.length; b++) {
+                    if (__atomic_load_n(&extent_owner[b], __ATOMIC_RELAXED)) {
+                        why = "maps an extent block";
+                        break;
+                    }
+                }
+            }
+            if (why && problem("dropped", "inode %d: extent %d (%d blocks at %d, file block %d) %s", inum, i,
+                               e.length, e.start, e.file_block, why)) {
+                continue;
+            }
+            if (!why) {
+                if (S_ISDIR(node->mode) && e.file_block != blocks &&
+                    problem("closed", "directory %d: hole before file block %d", inum, e.file_block)) {
+                    e.file_block = blocks; // Directory slots are numbered without gaps
+                }
+                next_file_block = (int64_t)e.file_block + e.length;
+                blocks += e.length;
+                for (int b = e.start; b < e.start + e.length; b++) {
+                    __atomic_fetch_add(&claims[b], 1, __ATOMIC_RELAXED);
+                }
+            }
+            if (kept != i || memcmp(extent_at(node, kept), &e, sizeof(e)) != 0) {
+                *extent_at(node, kept) = e;
+                dirty_at(extent_at(node, kept));
+            }
+            kept++;
+        }
+        if (kept < usable) {
+            node->extent_count = kept;
+            if (kept <= INODE_EXTENTS && node->extent_block) {
+                // The extent block is no longer needed; check_blocks() frees it
+                __atomic_store_n(&extent_owner[node->extent_block], 0, __ATOMIC_RELAXED);
+                node->extent_block = 0;
+            }
+        }
+        if (node->block_count != blocks &&
+            problem("corrected", "inode %d: block count is %d, its extents map %d", inum, node->block_count, blocks)) {
+            node->block_count = blocks;
+        }
+        if (S_ISDIR(node->mode) && node->size != (int64_t)blocks * BLOCK_SIZE &&
+            problem("corrected", "directory %d: size is %lld, its blocks hold %lld bytes", inum, (long long)node->size,
+                    (long long)blocks * BLOCK_SIZE)) {
+            node->size = (int64_t)blocks * BLOCK_SIZE;
+        }
+        if (memcmp(&was, node, sizeof(inode_t)) != 0) {
+            dirty_at(node);
+        }
+        if (S_ISDIR(node->mode)) {
+            check_entries(inum, node, &refs, &refs_capacity);
+        }
+    }
+    free(refs);
+}
+
+// Drop the entries naming an inode that another entry names first. Only needed if check_entries() saw any.
+static void check_names(int first, int end) {
+    for (int dir = first; dir < end; dir++) {
+        inode_t *node = table_inode(dir);
+        if (!live[dir] || !S_ISDIR(node->mode) || (node->flags & INODE_INLINE)) {
+            continue;
+        }
+        int extents = readable_extents(dir, node);
+        for (int i = 0; i < extents; i++) {
+            extent_t e = *extent_at(node, i);
+            for (int b = 0; extent_in_data(e) && b < e.length; b++) {
+                dirent_t *entries = blocks_get_block(e.start + b);
+                for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+                    dirent_t *entry = &entries[j];
+                    uint64_t key = ((uint64_t)dir << 32 | (uint32_t)((e.file_block + b) * DIRENTS_PER_BLOCK + j)) + 1;
+                    int inum = entry->inum;
+                    if (entry->name[0] == '\0' || !memchr(entry->name, '\0', DIR_NAME_LENGTH) || inum <= ROOT_INUM ||
+                        inum >= INODE_COUNT || inum == dir || !live[inum] || entry_owner[inum] == key ||
+                        entry_owner[inum] == 0) {
+                        continue;
+                    }
+                    if (problem("removed", "directory %d: entry %s names inode %d, also named in directory %d", dir,
+                                entry->name, inum, parent_of(inum))) {
+                        clear_entry(entry);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Report a run of blocks [from, to) that the block bitmap marks wrongly, and mark them in use (v = 1) or free.
+static void bitmap_run(void *bbm, int from, int to, int v) {
+    char run[32];
+    snprintf(run, sizeof(run), to - from > 1 ? "blocks %d-%d" : "block %d", from, to - 1);
+    const char *what = v ? "mapped by a file, but marked free" : "marked in use, but not mapped by any file";
+    if (problem(v ? "marked in use" : "freed", "%s: %s", run, what)) {
+        for (int i = from; i < to; i++) {
+            bitmap_put(bbm, i, v);
+            dirty_at((uint64_t *)bbm + i / 64);
+        }
+    }
+}
+
+// Pass over the block bitmap and reference counts, against the blocks the files map.
+static void check_blocks(int first, int end) {
+    void *bbm = get_blocks_bitmap();
+    uint16_t *refs = get_block_refs();
+    int leaked_from = -1, unmarked_from = -1;
+    for (int b = first; b <= end; b++) {
+        int used = 0, want = 0;
+        if (b < end) {
+            used = bitmap_get(bbm, b);
+            want = b < FIRST_DATA_BLOCK || claims[b] > 0 || extent_owner[b] > 0;
+        }
+        // Report runs of bitmap differences rather than single blocks, since a stale bitmap has many
+        if (used && !want) {
+            if (leaked_from < 0) {
+                leaked_from = b;
+            }
+        } else if (leaked_from >= 0) {
+            bitmap_run(bbm, leaked_from, b, 0);
+            leaked_from = -1;
+        }
+        if (!used && want) {
+            if (unmarked_from < 0) {
+                unmarked_from = b;
+            }
+        } else if (unmarked_from >= 0) {
+            bitmap_run(bbm, unmarked_from, b, 1);
+            unmarked_from = -1;
+        }
+        if (b == end) {
+            break;
+        }
+
+        uint32_t expected = claims[b] > 1 ? claims[b] - 1 : 0;
+        if (refs[b] == expected) {
+            continue;
+        }
+        if (expected > UINT16_MAX) {
+            problem(NULL, "block %d: mapped %u times, more than a reference count can hold", b, claims[b]);
+        } else if (problem("corrected", "block %d: counts %d references, but %u files map it", b, refs[b] + 1,
+                           claims[b])) {
+            refs[b] = expected;
+            dirty_at(&refs[b]);
+        }
+    }
+}
+
+// The entry that names an inode, found through the slot that entry_owner[] records.
+static dirent_t *entry_of(int inum) {
+    inode_t *dir = table_inode(parent_of(inum));
+    int slot = (int)((entry_owner[inum] - 1) & 0xffffffff);
+    int file_block = slot / DIRENTS_PER_BLOCK;
+    int extents = readable_extents(parent_of(inum), dir);
+    for (int i = 0; i < extents; i++) {
+        extent_t e = *extent_at(dir, i);
+        if (extent_in_data(e) && file_block >= e.file_block && file_block < e.file_block + e.length) {
+            dirent_t *entries = blocks_get_block(e.start + file_block - e.file_block);
+            return &entries[slot % DIRENTS_PER_BLOCK];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the inodes that are in use but cannot be reached from the root: those
+ * without a name, and directories whose chain of parents ends in a cycle.
+ * The entries that close cycles are removed.
+ *
+ * @param orphans Receives the inode numbers, at most INODE_COUNT of them.
+ *
+ * @return The number of inodes found.
+ */
+static int find_orphans(int *orphans) {
+    // 0 not visited, 1 on the chain being walked, 2 reachable, or will be once the orphans are moved
+    uint8_t *state = calloc(INODE_COUNT, 1);
+    int *chain = malloc(INODE_COUNT * sizeof(int));
+    if (!state || !chain) {
+        perror("fsck.nufs");
+        exit(8);
+    }
+    int count = 0;
+    state[ROOT_INUM] = 2;
+    for (int inum = 0; inum < INODE_COUNT; inum++) {
+        if (!live[inum] || state[inum]) {
+            continue;
+        }
+        if (!S_ISDIR(table_inode(inum)->mode)) {
+            if (entry_owner[inum] == 0) {
+                orphans[count++] = inum;
+            }
+            continue;
+        }
+        // Walk up to the root, or an orphan at the top of the chain
+        int length = 0;
+        int d = inum;
+        while (d >= 0 && state[d] == 0) {
+            state[d] = 1;
+            chain[length++] = d;
+            d = parent_of(d);
+        }
+        if (d < 0) {
+            orphans[count++] = chain[length - 1];
+        } else if (state[d] == 1) {
+            dirent_t *entry = entry_of(d);
+            int cut = problem("entry removed", "directory %d: its parents form a cycle, closed by entry %s of %d",
+                              d, entry ? entry->name : "?", parent_of(d));
+            if (cut && entry) {
+                clear_entry(entry);
+            }
+            if (cut) {
+                orphans[count++] = d;
+            }
+        }
+        for (int i = 0; i < length; i++) {
+            state[chain[i]] = 2;
+        }
+    }
+    free(state);
+    free(chain);
+    return count;
+}
+
+/**
+ * Free the orphans that are empty files and move the others to /lost+found.
+ * Runs on a freshly loaded image, through the modules the file system uses.
+ *
+ * @param orphans Inode numbers of the orphans.
+ * @param count Number of orphans.
+ */
+static void adopt_orphans(const int *orphans, int count) {
+    inode_t *root = get_inode(ROOT_INUM);
+    int lost_found = -1;
+    for (int i = 0; i < count; i++) {
+        int inum = orphans[i];
+        inode_t *node = get_inode(inum);
+        if (!S_ISDIR(node->mode) && node->size == 0 && node->block_count == 0) {
+            free_inode(inum);
+            continue;
+        }
+        if (lost_found < 0) {
+            lost_found = directory_lookup(root, LOST_FOUND);
+            if (lost_found < 0) {
+                lost_found = alloc_inode(S_IFDIR | 0700);
+                if (lost_found < 0 || directory_put(root, LOST_FOUND, lost_found) < 0) {
+                    printf("cannot create /%s, %d inodes left without a name\n", LOST_FOUND, count - i);
+                    __atomic_fetch_add(&unrepaired, count - i, __ATOMIC_RELAXED);
+                    return;
+                }
+            } else if (!S_ISDIR(get_inode(lost_found)->mode)) {
+                printf("/%s is not a directory, %d inodes left without a name\n", LOST_FOUND, count - i);
+                __atomic_fetch_add(&unrepaired, count - i, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+        char name[DIR_NAME_LENGTH];
+        snprintf(name, sizeof(name), "#%d", inum);
+        if (directory_put(get_inode(lost_found), name, inum) < 0) {
+            printf("cannot add %s to /%s\n", name, LOST_FOUND);
+            __atomic_fetch_add(&unrepaired, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = cpus > 0 ? (int)cpus : 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "nj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            repair = 0;
+            break;
+        case 'j':
+            thread_count = atoi(optarg);
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1 || thread_count < 1) {
+        fprintf(stderr, "usage: %s [-n] [-j THREADS] IMAGE\n", argv[0]);
+        return 8;
+    }
+    if (thread_count > MAX_THREADS) {
+        thread_count = MAX_THREADS;
+    }
+    const char *image = argv[optind];
+    log_init(LOG_LEVEL_WARN, 0);
+
+    // blocks_init() exits on an image it cannot mount; tell those apart from images with problems first
+    superblock_t sb;
+    FILE *f = fopen(image, "r");
+    if (!f) {
+        perror(image);
+        return 8;
+    }
+    size_t got = fread(&sb, sizeof(sb), 1, f);
+    fclose(f);
+    if (got != 1 || sb.magic != NUFS_MAGIC || sb.version != NUFS_VERSION) {
+        fprintf(stderr, "%s: not a nufs image of version %d\n", image, NUFS_VERSION);
+        return 8;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    blocks_set_read_only(!repair);
+    blocks_init(image, NULL);
+    journal_init(JOURNAL_FIRST_BLOCK, JOURNAL_BLOCKS);
+    int replayed = journal_replay();
+    if (replayed > 0) {
+        printf("%s: replayed %d journal transactions%s\n", image, replayed, repair ? "" : " in memory");
+    }
+
+    live = calloc(INODE_COUNT, 1);
+    entry_owner = calloc(INODE_COUNT, sizeof(uint64_t));
+    claims = calloc(BLOCK_COUNT, sizeof(uint32_t));
+    extent_owner = calloc(BLOCK_COUNT, sizeof(int));
+    int *orphans = malloc(INODE_COUNT * sizeof(int));
+    if (!live || !entry_owner || !claims || !extent_owner || !orphans) {
+        perror("fsck.nufs");
+        return 8;
+    }
+
+    parallel_for(check_inodes, INODE_COUNT);
+    if (!live[ROOT_INUM] || !S_ISDIR(table_inode(ROOT_INUM)->mode)) {
+        problem(NULL, "inode %d: the root directory is missing", ROOT_INUM);
+        blocks_free();
+        return 4;
+    }
+    parallel_for(check_extents, INODE_COUNT);
+    if (entry_conflicts) {
+        parallel_for(check_names, INODE_COUNT);
+    }
+    int orphan_count = find_orphans(orphans);
+    for (int i = 0; i < orphan_count; i++) {
+        inode_t *node = table_inode(orphans[i]);
+        int empty = !S_ISDIR(node->mode) && node->size == 0 && node->block_count == 0;
+        problem(empty ? "freed" : "moved to /" LOST_FOUND, "inode %d: %s without a name", orphans[i],
+                S_ISDIR(node->mode) ? "directory" : "file");
+    }
+    parallel_for(check_blocks, BLOCK_COUNT);
+
+    if (repair) {
+        // The scans changed the image behind the modules' back: write it out, then load it as a mount would
+        blocks_flush();
+        alloc_init();
+        load_inodes();
+        directory_init();
+        if (orphan_count > 0) {
+            adopt_orphans(orphans, orphan_count);
+        }
+        save_inodes();
+    }
+
+    void *ibm = get_inode_bitmap();
+    printf("%s: %d of %d inodes and %d of %d blocks in use, %d problems found, %d left, in %.1f ms (%d thread%s)\n",
+           image, bitmap_count(ibm, INODE_COUNT), INODE_COUNT, BLOCK_COUNT - blocks_free_count(), BLOCK_COUNT,
+           problems, unrepaired, elapsed_ms(&start), thread_count, thread_count > 1 ? "s" : "");
+    blocks_free();
+    free(live);
+    free(entry_owner);
+    free(claims);
+    free(extent_owner);
+    free(orphans);
+    return problems == 0 ? 0 : unrepaired == 0 ? 1 : 4;
+}
@@ -0,0 +1,92 @@
+// Copies a file on a mounted nufs to another path on the same mount with NUFS_IOC_COPY_RANGE, so the copy shares
+// the source's blocks instead of duplicating them, like `cp --reflink`. The destination is created or truncated.
+//
+// usage: reflink SRC DEST
+
+// necessary libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "nufs_ioctl.h"
+
+/**
+ * Find the root of the nufs mount a directory is on: the nearest directory
+ * at or above it with the control directory /.nufs in it.
+ *
+ * @param dir Absolute path of a directory, without symbolic links; cut down to the root.
+ *
+ * @return 0 on success, -1 if no parent directory is a nufs mount.
+ */
+static int mount_root(char *dir) {
+    char probe[PATH_MAX + 16];
+    struct stat st;
+    for (;;) {
+        snprintf(probe, sizeof(probe), "%s/.nufs/stats", strcmp(dir, "/") ? dir : "");
+        if (stat(probe, &st) == 0) {
+            return 0;
+        }
+        if (strcmp(dir, "/") == 0) {
+            return -1;
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == dir) {
+            slash[1] = 0;
+        } else {
+            *slash = 0;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SRC DEST\n", argv[0]);
+        return 1;
+    }
+    char src[PATH_MAX], src_root[PATH_MAX], dst_root[PATH_MAX];
+    if (!realpath(argv[1], src)) {
+        perror(argv[1]);
+        return 1;
+    }
+    char dst_dir[PATH_MAX];
+    snprintf(dst_dir, sizeof(dst_dir), "%s", argv[2]);
+    if (!realpath(dirname(dst_dir), dst_root)) {
+        perror(argv[2]);
+        return 1;
+    }
+    strcpy(src_root, src);
+    if (mount_root(src_root) < 0 || mount_root(dst_root) < 0 || strcmp(src_root, dst_root) != 0) {
+        fprintf(stderr, "%s: %s and %s are not on the same nufs mount\n", argv[0], argv[1], argv[2]);
+        return 1;
+    }
+
+    struct nufs_copy_range arg = {0};
+    const char *rel = src + (strcmp(src_root, "/") ? strlen(src_root) : 0);
+    if (strlen(rel) >= sizeof(arg.src_path)) {
+        fprintf(stderr, "%s: %s: path too long\n", argv[0], argv[1]);
+        return 1;
+    }
+    strcpy(arg.src_path, rel);
+
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (ioctl(fd, NUFS_IOC_COPY_RANGE, &arg) == -1) {
+        perror("reflink: NUFS_IOC_COPY_RANGE");
+        close(fd);
+        return 1;
+    }
+    if (close(fd) == -1) {
+        perror(argv[2]);
+        return 1;
+    }
+    return 0;
+}